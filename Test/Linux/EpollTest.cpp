@@ -0,0 +1,262 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to ModbusClient
+//               MIT license - see license.md for details
+// =================================================================================================
+// Tests for ModbusClientTCPepoll. Linux only - the servers run on the loopback interface
+// in a thread of their own.
+#include <stdio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "ModbusClientTCPepoll.h"
+#include "Logging.h"
+
+#define STRINGIFY(x) #x
+#define LNO(x) "line " STRINGIFY(x) " "
+
+uint16_t testsExecuted = 0;            // Global test cases counter
+uint16_t testsPassed = 0;              // Global passed test cases counter
+
+const uint16_t BASEPORT = 16500;       // First port a test server listens on
+const uint8_t SERVERS = 20;            // Number of test servers
+const uint8_t MUTE = 99;               // Server ID never answered by the test servers
+const uint16_t DEADPORT = 16499;       // Port nobody listens on
+
+// TestServers: Modbus TCP servers on BASEPORT..BASEPORT+SERVERS-1, all served by one thread.
+// Function code 0x03 returns the register addresses as values, requests to server MUTE are
+// swallowed. Other function codes are not expected.
+class TestServers {
+public:
+  TestServers() : running(true) {
+    for (uint8_t i = 0; i < SERVERS; ++i) {
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      int one = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      struct sockaddr_in a;
+      memset(&a, 0, sizeof(a));
+      a.sin_family = AF_INET;
+      a.sin_port = htons(BASEPORT + i);
+      a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      if (bind(fd, (struct sockaddr *)&a, sizeof(a)) || listen(fd, 16)) {
+        printf(LNO(__LINE__) "Test server %u could not listen\n", i);
+        close(fd);
+        continue;
+      }
+      fds.push_back({ fd, POLLIN, 0 });
+      listeners++;
+    }
+    thread = std::thread([this] { run(); });
+  }
+
+  ~TestServers() {
+    running = false;
+    thread.join();
+    for (auto& p : fds) close(p.fd);
+  }
+
+protected:
+  // run: accept connections and answer requests until stopped
+  void run() {
+    while (running) {
+      if (poll(fds.data(), fds.size(), 10) <= 0) continue;
+      for (size_t i = 0; i < fds.size(); ++i) {
+        if (!fds[i].revents) continue;
+        if (i < listeners) {
+          int c = accept(fds[i].fd, NULL, NULL);
+          if (c >= 0) fds.push_back({ c, POLLIN, 0 });
+        } else if (!answer(fds[i].fd)) {
+          close(fds[i].fd);
+          fds.erase(fds.begin() + i);
+          --i;
+        }
+      }
+    }
+  }
+
+  // answer: read one request and respond to it. Returns false if the connection is gone
+  bool answer(int fd) {
+    uint8_t buf[260];
+    if (!readAll(fd, buf, 6)) return false;
+    uint16_t len = (buf[4] << 8) | buf[5];
+    if (len < 2 || len > 254 || !readAll(fd, buf + 6, len)) return false;
+    if (buf[6] == MUTE) return true;
+    uint16_t addr = (buf[8] << 8) | buf[9];
+    uint16_t words = (buf[10] << 8) | buf[11];
+    // MBAP header stays the same but for the length
+    uint8_t count = words * 2;
+    buf[4] = 0;
+    buf[5] = 3 + count;
+    buf[8] = count;
+    for (uint16_t i = 0; i < words; ++i) {
+      buf[9 + 2 * i] = (addr + i) >> 8;
+      buf[10 + 2 * i] = (addr + i) & 0xFF;
+    }
+    return write(fd, buf, 9 + count) == 9 + count;
+  }
+
+  // readAll: read exactly n bytes
+  static bool readAll(int fd, uint8_t *buf, size_t n) {
+    size_t got = 0;
+    while (got < n) {
+      ssize_t r = read(fd, buf + got, n - got);
+      if (r <= 0) return false;
+      got += r;
+    }
+    return true;
+  }
+
+  std::atomic<bool> running;
+  std::thread thread;
+  std::vector<struct pollfd> fds;      // Listening sockets first, then the connections
+  size_t listeners = 0;
+};
+
+// Results of a batch of requests
+std::atomic<uint32_t> good(0);
+std::atomic<uint32_t> bad(0);
+
+// Response handler: the token is the register address asked for
+void checkResponse(ModbusMessage response, uint32_t token) {
+  uint16_t value = 0;
+  if (response.getError() == SUCCESS && response.get(3, value) && value == (token & 0xFFFF)) {
+    good++;
+  } else {
+    bad++;
+  }
+}
+
+// waitFor: wait until count responses came in, at most ms milliseconds.
+// pendingRequests() is not good for that, it is counted down before the handler runs
+bool waitFor(uint32_t count, uint32_t ms) {
+  unsigned long start = millis();
+  while (good + bad < count && millis() - start < ms) delay(1);
+  return good + bad == count;
+}
+
+int main() {
+  TestServers servers;
+  IPAddress local(127, 0, 0, 1);
+
+  // #1: requests to all servers, pipelined, on two event loops
+  {
+    ModbusClientTCPepoll client(1000, 2);
+    client.setTimeout(2000, 0);
+    client.setMaxInflightRequests(4);
+    client.begin();
+    good = bad = 0;
+    for (uint16_t r = 0; r < 10; ++r) {
+      for (uint8_t i = 0; i < SERVERS; ++i) {
+        uint16_t addr = i * 100 + r;
+        client.addRequestTo(local, BASEPORT + i, addr, checkResponse, (uint8_t)1, READ_HOLD_REGISTER, (uint16_t)addr, (uint16_t)2);
+      }
+    }
+    testsExecuted++;
+    if (waitFor(10 * SERVERS, 5000) && good == 10 * SERVERS && bad == 0 && client.targetCount() == SERVERS) {
+      testsPassed++;
+    } else {
+      printf(LNO(__LINE__) "pipelined requests: %u good, %u bad\n", (uint32_t)good, (uint32_t)bad);
+    }
+
+    // #2: synchronous request to the default target
+    client.setTarget(local, BASEPORT + 3);
+    ModbusMessage response = client.syncRequest(1, (uint8_t)1, READ_HOLD_REGISTER, (uint16_t)77, (uint16_t)1);
+    uint16_t value = 0;
+    response.get(3, value);
+    testsExecuted++;
+    if (response.getError() == SUCCESS && value == 77) {
+      testsPassed++;
+    } else {
+      printf(LNO(__LINE__) "syncRequest: error %02X, value %u\n", response.getError(), value);
+    }
+    client.end();
+  }
+
+  // #3: a refused connect and a server not answering fail only their own requests
+  {
+    ModbusClientTCPepoll client(100, 1);
+    client.setTimeout(200, 0);
+    client.begin();
+    std::atomic<int> refused(0);
+    std::atomic<int> timedOut(0);
+    std::atomic<unsigned long> muteAnswer(0);
+    good = bad = 0;
+    unsigned long start = millis();
+    client.addRequestTo(local, DEADPORT, 0, [&refused](ModbusMessage m, uint32_t) {
+      if (m.getError() == IP_CONNECTION_FAILED) refused++;
+      bad++;
+    }, (uint8_t)1, READ_HOLD_REGISTER, (uint16_t)0, (uint16_t)1);
+    client.addRequestTo(local, BASEPORT, 0, [&timedOut, &muteAnswer](ModbusMessage m, uint32_t) {
+      if (m.getError() == TIMEOUT) timedOut++;
+      muteAnswer = millis();
+      bad++;
+    }, (uint8_t)MUTE, READ_HOLD_REGISTER, (uint16_t)0, (uint16_t)1);
+    client.addRequestTo(local, BASEPORT + 1, 5, checkResponse, (uint8_t)1, READ_HOLD_REGISTER, (uint16_t)5, (uint16_t)1);
+    waitFor(3, 2000);
+    testsExecuted++;
+    if (refused == 1 && timedOut == 1 && good == 1 && muteAnswer - start >= 200 && muteAnswer - start < 1000) {
+      testsPassed++;
+    } else {
+      printf(LNO(__LINE__) "errors: refused %d, timeout %d after %lums, good %u\n", (int)refused, (int)timedOut, (unsigned long)muteAnswer - start, (uint32_t)good);
+    }
+    client.end();
+  }
+
+  // #4: without pipelining, the interval is kept between requests to the same server
+  {
+    ModbusClientTCPepoll client(100, 1);
+    client.setTimeout(2000, 20);
+    client.begin();
+    good = bad = 0;
+    unsigned long start = millis();
+    for (uint16_t r = 0; r < 4; ++r) {
+      client.addRequestTo(local, BASEPORT + 2, r, checkResponse, (uint8_t)1, READ_HOLD_REGISTER, (uint16_t)r, (uint16_t)1);
+    }
+    waitFor(4, 2000);
+    unsigned long took = millis() - start;
+    testsExecuted++;
+    if (good == 4 && took >= 3 * 20) {
+      testsPassed++;
+    } else {
+      printf(LNO(__LINE__) "interval: %u good in %lums\n", (uint32_t)good, took);
+    }
+    client.end();
+  }
+
+  // #5: many idle targets do not slow down the busy one
+  {
+    ModbusClientTCPepoll client(1000, 1);
+    client.setTimeout(2000, 0);
+    client.begin();
+    // Known, but never used
+    for (uint16_t i = 0; i < 2000; ++i) {
+      client.setTarget(IPAddress(127, 0, 1 + i / 250, 1 + i % 250), 502);
+    }
+    // Used once, then idle with the connection open
+    good = bad = 0;
+    for (uint8_t i = 0; i < SERVERS; ++i) {
+      client.addRequestTo(local, BASEPORT + i, i, checkResponse, (uint8_t)1, READ_HOLD_REGISTER, (uint16_t)i, (uint16_t)1);
+    }
+    waitFor(SERVERS, 2000);
+    unsigned long start = millis();
+    for (uint16_t r = 0; r < 200; ++r) {
+      client.addRequestTo(local, BASEPORT, r, checkResponse, (uint8_t)1, READ_HOLD_REGISTER, (uint16_t)r, (uint16_t)1);
+    }
+    waitFor(SERVERS + 200, 5000);
+    unsigned long took = millis() - start;
+    testsExecuted++;
+    if (good == SERVERS + 200 && bad == 0 && client.targetCount() == 2000 + SERVERS) {
+      testsPassed++;
+    } else {
+      printf(LNO(__LINE__) "idle targets: %u good, %u bad in %lums\n", (uint32_t)good, (uint32_t)bad, took);
+    }
+    client.end();
+  }
+
+  // Print summary.
+  printf("----->    epoll client tests: %4d, passed: %4d\n", testsExecuted, testsPassed);
+  return testsExecuted == testsPassed ? 0 : 1;
+}
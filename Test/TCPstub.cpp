@@ -183,6 +183,8 @@ void TCPstub::setIdentity(IPAddress ip, uint16_t port) {
 
 // handleConnection: worker task method
 void TCPstub::workerTask(TCPstub *instance) {
+  std::vector<uint8_t> held;         // Response held back to be sent with the next one
+  bool heldFirst = false;            // The held response goes in front of the next one
   while (1) {
     // Do we have at least 6 bytes in the inQueue (TCP header)?
     if (instance->inQueue.size() >= 6) {
@@ -191,21 +193,27 @@ void TCPstub::workerTask(TCPstub *instance) {
       uint8_t TCPhead[6];
       {
         lock_guard<mutex> lockIn(instance->inLock);
-        uint16_t i = 0;
         // Serial.print("Read  ");
-        // Keep the TCPhead and discard the rest.
-        while (!instance->inQueue.empty()) {
-          uint8_t byte = instance->inQueue.front();
-          if (i < 6) {
-            TCPhead[i++] = byte;
-          }
+        // Keep the TCPhead
+        for (uint8_t i = 0; i < 6; ++i) {
+          TCPhead[i] = instance->inQueue.front();
+          instance->inQueue.pop();
+          // Serial.printf("%02X ", TCPhead[i]);
+        }
+      }
+      // Discard the request itself - but only that, another one may follow right away
+      uint16_t len = (TCPhead[4] << 8) | TCPhead[5];
+      while (instance->inQueue.size() < len) {
+        delay(1);
+      }
+      {
+        lock_guard<mutex> lockIn(instance->inLock);
+        while (len--) {
           instance->inQueue.pop();
-          // Serial.printf("%02X ", byte);
         }
-        // Serial.println((*instance->tm).size());
       }
       // Get the TID
-      tid = ((TCPhead[0] << 8) & 0xFF) | (TCPhead[1] & 0xFF);
+      tid = (TCPhead[0] << 8) | TCPhead[1];
 
       // Look for the tid in the TestCase map
       auto tc = (*instance->tm).find(tid);
@@ -221,34 +229,53 @@ void TCPstub::workerTask(TCPstub *instance) {
         }
         // Do we have to send a response?
         if (myTest->response.size() > 0) {
-          // Yes, we do. Lock the outQueue, since we ar egoing to write to it
-          lock_guard<mutex> lockOut(instance->outLock);
-
-          // Are we asked to fake the transaction ID?
+          // Yes, we do. Are we asked to fake the transaction ID?
           if (myTest->fakeTransactionID == true) {
             TCPhead[0] += 13;
           }
+          // Or the protocol ID?
+          if (myTest->fakeProtocolID == true) {
+            TCPhead[2] = 0x47;
+          }
 
           // Set the response size in the TCP header
-          TCPhead[4] = (myTest->response.size() << 8) & 0xFF;
+          TCPhead[4] = (myTest->response.size() >> 8) & 0xFF;
           TCPhead[5] = myTest->response.size() & 0xFF;
 
-          // Serial.print("Write ");
-          // Write the TCP header
-          for (uint8_t i = 0; i < 6; ++i) {
-            instance->outQueue.push(TCPhead[i]);
-            // Serial.printf("%02X ", TCPhead[i]);
-          }
+          // Put together header and response
+          std::vector<uint8_t> frame(TCPhead, TCPhead + 6);
+          frame.insert(frame.end(), myTest->response.begin(), myTest->response.end());
 
-          // Now write the response
-          const uint8_t *cp = myTest->response.data();
-          size_t cnt = myTest->response.size();
-          while (cnt--) {
-            instance->outQueue.push(*cp);
-            // Serial.printf("%02X ", *cp);
-            cp++;
+          // Shall we keep it until the next response is sent?
+          if (myTest->holdResponse || myTest->joinResponse) {
+            held = frame;
+            heldFirst = myTest->joinResponse;
+          } else {
+            // No. A response held back goes out in the same write, in front or behind it
+            if (!held.empty()) {
+              frame.insert(heldFirst ? frame.begin() : frame.end(), held.begin(), held.end());
+              held.clear();
+            }
+            // Send the first part only, if the response shall arrive in two TCP segments
+            size_t cut = myTest->splitResponse ? frame.size() / 2 : frame.size();
+            {
+              // Lock the outQueue, since we are going to write to it
+              lock_guard<mutex> lockOut(instance->outLock);
+              // Serial.print("Write ");
+              for (size_t i = 0; i < cut; ++i) {
+                instance->outQueue.push(frame[i]);
+                // Serial.printf("%02X ", frame[i]);
+              }
+              // Serial.println();
+            }
+            if (cut < frame.size()) {
+              delay(50);
+              lock_guard<mutex> lockOut(instance->outLock);
+              for (size_t i = cut; i < frame.size(); ++i) {
+                instance->outQueue.push(frame[i]);
+              }
+            }
           }
-          // Serial.println();
         }
         // Are we to stop ourselves after response has been sent?
         if (myTest->stopAfterResponding == true) {
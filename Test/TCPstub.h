@@ -8,6 +8,7 @@
 #include <map>
 #include <queue>
 #include <mutex>      // NOLINT
+#include <vector>
 #include "ModbusMessage.h"
 
 using std::mutex;
@@ -33,6 +34,10 @@ struct TestCase {
   uint32_t delayTime;            // A time in ms to wait before the response is sent
   bool stopAfterResponding;      // if true, worker will kill itself after answering (simulate server disconnect)
   bool fakeTransactionID;        // if true, stub will use a wrong TID in response
+  bool holdResponse;             // if true, stub will send the response after the next one (out of order)
+  bool joinResponse;             // if true, stub will send the response together with the next one in one go
+  bool splitResponse;            // if true, stub will send the response in two parts with a pause in between
+  bool fakeProtocolID;           // if true, stub will use a protocolID other than 0 in response
 };
 
 // Short names for the test cases' maps
@@ -12,6 +12,11 @@
 
 #include "TCPstub.h"
 #include "CoilData.h"
+#include "ModbusMessageView.h"
+#include "RegisterMap.h"
+#include "ModbusCoalescer.h"
+#include "ModbusPoller.h"
+#include "RequestQueue.h"
 
 #define STRINGIFY(x) #x
 #define LNO(x) "line " STRINGIFY(x) " "
@@ -44,6 +49,7 @@ ModbusClientTCP TestTCP(stub, 2);               // ModbusClientTCP test instance
 WiFiClient wc;
 ModbusClientTCP TestClientWiFi(wc, 25);         // ModbusClientTCP test instance for WiFi loopback use.
 ModbusClientRTU RTUclient(GPIO_NUM_4);  // ModbusClientRTU test instance. Connect a LED to GPIO pin 4 to see the RTS toggle.
+ModbusCoalescer Coalescer(RTUclient, 20);       // Joins read requests to RTUclient
 ModbusServerRTU RTUserver(20000, RTStest);      // ModbusServerRTU instance
 ModbusServerWiFi MBserver;                      // ModbusServerWiFi instance
 IPAddress ip = {127,   0,   0,   1};            // IP address of ModbusServerWiFi (loopback IF)
@@ -60,6 +66,22 @@ uint16_t broadcastCnt = 0;
 
 uint16_t memo[32];                     // Test server memory: 32 words
 
+// Register map test layout
+struct MapTest {
+  uint16_t status;
+  int32_t power;
+  float voltage;
+  bool alarm;
+  uint8_t mode;
+};
+const RegisterMap::Field mapTestFields[] = {
+  RM_FIELD(MapTest, status, 0, 0),
+  RM_FIELD(MapTest, power, 1, SWAP_REGISTERS),
+  RM_FIELD(MapTest, voltage, 3, SWAP_REGISTERS|SWAP_NIBBLES),
+  RM_BITS(MapTest, alarm, 0, 15, 1),
+  RM_BITS(MapTest, mode, 0, 8, 3),
+};
+
 ModbusMessage empty;                   // Empty message for initializers
 
 // Worker function for function code 0x03
@@ -157,6 +179,52 @@ void Sniffer(ModbusMessage m) {
   Serial.println();
 }
 
+// Sniffer noting server ID, function code and low address byte of the messages on the bus
+ModbusMessage busOrder;
+void OrderSniffer(ModbusMessage m) {
+  busOrder.add(m.getServerID(), m.getFunctionCode(), (uint8_t)(m.size() > 3 ? m[3] : 0));
+}
+
+// RequestQueue test: a producer task pushes id << 16 | sequence number, retrying while the queue is full
+struct QueueProducer {
+  RequestQueue<uint32_t> *queue;
+  uint16_t id;
+  uint16_t count;
+  uint32_t refused;              // push() calls refused because the queue was full
+  volatile bool done;
+};
+void queueProducer(QueueProducer *p) {
+  for (uint16_t i = 0; i < p->count; ++i) {
+    while (!p->queue->push((uint32_t)(p->id << 16) | i)) {
+      p->refused++;
+      taskYIELD();
+    }
+  }
+  p->done = true;
+  vTaskDelete(NULL);
+}
+
+// ASCII test: a Stream writing into a buffer and reading from it
+class BufferStream : public Stream {
+public:
+  std::vector<uint8_t> buffer;
+  size_t readPos = 0;
+  int available() { return buffer.size() - readPos; }
+  int read() { return readPos < buffer.size() ? buffer[readPos++] : -1; }
+  int peek() { return readPos < buffer.size() ? buffer[readPos] : -1; }
+  size_t write(uint8_t b) { buffer.push_back(b); return 1; }
+  size_t write(const uint8_t *data, size_t len) { buffer.insert(buffer.end(), data, data + len); return len; }
+  void flush() { }
+  // set: replace the contents by a string to be read
+  void set(const char *text) { buffer.assign(text, text + strlen(text)); readPos = 0; }
+};
+
+// ASCII test: access to the frame functions of RTUutils
+struct ASCIIutils : public RTUutils {
+  using RTUutils::send;
+  using RTUutils::receive;
+};
+
 // Worker function for any function code
 ModbusMessage FCany(ModbusMessage request) {
   // return recognizable text
@@ -624,6 +692,112 @@ void setup()
   adder.add(b);
   testOutput(__func__, LNO(__LINE__) "add double swapped", makeVector("11 88 45 33 F6 23 C0 CA C0 11"), adder);
 
+  // same with the swap rules fixed at compile time, and read back
+  adder.clear();
+  adder.add<SWAP_REGISTERS|SWAP_NIBBLES>(f);
+  adder.add<SWAP_WORDS|SWAP_BYTES>(d);
+  testOutput(__func__, LNO(__LINE__) "add<> float and double swapped", makeVector("60 15 F3 E9 88 45 33 F6 23 C0 CA C0"), adder);
+  {
+    float fv = 0.0;
+    double dv = 0.0;
+    uint16_t pos = adder.get<SWAP_REGISTERS|SWAP_NIBBLES>(0, fv);
+    pos = adder.get<SWAP_WORDS|SWAP_BYTES>(pos, dv);
+    adder.clear();
+    adder.add(pos);
+    adder.add(fv);
+    adder.add(dv);
+    testOutput(__func__, LNO(__LINE__) "get<> float and double swapped", makeVector("00 0C 3F 9E 06 51 C0 23 C0 CA 45 88 F6 33"), adder);
+  }
+
+  // Grow a message beyond the inline buffer, then copy, move and shrink it again
+  {
+    ModbusMessage big;
+    vector<uint8_t> expect;
+    for (uint16_t i = 0; i < MM_INLINE_SIZE + 20; ++i) {
+      big.add((uint8_t)i);
+      expect.push_back((uint8_t)i);
+    }
+    ModbusMessage copied(big);
+    testOutput(__func__, LNO(__LINE__) "copy beyond inline size", ModbusMessage(expect), copied);
+    // Framing bytes around the data must not touch it
+    memset(copied.headroom(), 0xEE, MM_HEADROOM);
+    memset(copied.tailroom(), 0xEE, MM_TAILROOM);
+    testOutput(__func__, LNO(__LINE__) "head- and tailroom", ModbusMessage(expect), copied);
+    ModbusMessage moved(std::move(copied));
+    testOutput(__func__, LNO(__LINE__) "move beyond inline size", ModbusMessage(expect), moved);
+    moved.setMessage(1, READ_HOLD_REGISTER, 1, 2);
+    testOutput(__func__, LNO(__LINE__) "reuse after heap use", makeVector("01 03 00 01 00 02"), moved);
+  }
+
+  // Decode a response through a ModbusMessageView, without copying it
+  {
+    ModbusMessage resp(makeVector("01 03 08 12 34 56 78 3F 9E 06 51"));
+    ModbusMessageView view(resp);
+    ModbusMessage decoded;
+    for (uint16_t reg : view.registers()) {
+      decoded.add(reg);
+    }
+    testOutput(__func__, LNO(__LINE__) "view registers", makeVector("12 34 56 78 3F 9E 06 51"), decoded);
+    uint16_t r1 = 0;
+    float fv = 0.0;
+    uint16_t pos = view.get(3, r1);
+    pos = view.get(pos + 2, fv);
+    decoded.clear();
+    decoded.add(r1, pos);
+    decoded.add(fv);
+    testOutput(__func__, LNO(__LINE__) "view get", makeVector("12 34 00 0B 3F 9E 06 51"), decoded);
+    ModbusMessageView cut(resp.data(), 6);
+    decoded.clear();
+    decoded.add((uint16_t)cut.registers().size(), (uint16_t)cut.payload().size());
+    testOutput(__func__, LNO(__LINE__) "view truncated", makeVector("00 00 00 00"), decoded);
+  }
+
+  // Decode arrays of values in one go
+  {
+    ModbusMessage resp(makeVector("01 03 14 12 34 56 78 60 15 F3 E9 60 15 F3 E9 88 45 33 F6 23 C0 CA C0"));
+    ModbusMessage decoded;
+    uint16_t regs[2];
+    uint32_t words[1];
+    float fv[2];
+    double dv[1];
+    uint16_t pos = resp.getRegisters(3, regs, 2);
+    resp.getRegisters(3, words, 1, SWAP_REGISTERS);
+    pos = resp.getRegisters(pos, fv, 2, SWAP_REGISTERS|SWAP_NIBBLES);
+    pos = resp.getRegisters(pos, dv, 1, SWAP_WORDS|SWAP_BYTES);
+    decoded.add(regs[0], regs[1], words[0], pos);
+    decoded.add(fv[0]);
+    decoded.add(fv[1]);
+    decoded.add(dv[0]);
+    testOutput(__func__, LNO(__LINE__) "get register arrays", makeVector("12 34 56 78 56 78 12 34 00 17 3F 9E 06 51 3F 9E 06 51 C0 23 C0 CA 45 88 F6 33"), decoded);
+    decoded.clear();
+    decoded.add(resp.getRegisters(20, regs, 2), resp.getRegisters(20, dv, 1));
+    testOutput(__func__, LNO(__LINE__) "get register arrays too long", makeVector("00 14 00 14"), decoded);
+  }
+
+  // Decode a response into a struct by a register map
+  {
+    RegisterMap map(mapTestFields);
+    MapTest mt;
+    memset(&mt, 0, sizeof(mt));
+    ModbusMessage resp(makeVector("01 03 0A 85 12 FF FE FF FF 60 15 F3 E9"));
+    ModbusMessage decoded;
+    Error e = map.decode(resp, &mt);
+    decoded.add((uint8_t)e, (uint8_t)map.changed(), mt.status, mt.power);
+    decoded.add(mt.voltage);
+    decoded.add((uint8_t)mt.alarm, mt.mode);
+    testOutput(__func__, LNO(__LINE__) "register map decode", makeVector("00 05 85 12 FF FF FF FE 3F 9E 06 51 01 05"), decoded);
+    // Same response again: nothing to write
+    mt.status = 0;
+    e = map.decode(resp, &mt, true);
+    decoded.clear();
+    decoded.add((uint8_t)e, (uint8_t)map.changed(), mt.status);
+    testOutput(__func__, LNO(__LINE__) "register map unchanged", makeVector("00 00 00 00"), decoded);
+    ModbusMessage shortResp(makeVector("01 03 02 85 12"));
+    decoded.clear();
+    decoded.add((uint8_t)map.decode(shortResp, &mt), (uint8_t)map.words());
+    testOutput(__func__, LNO(__LINE__) "register map too short", makeVector("E5 05"), decoded);
+  }
+
   // Print summary.
   Serial.printf("----->    Generate messages tests: %4d, passed: %4d", testsExecuted, testsPassed);
 
@@ -844,6 +1018,86 @@ void setup()
   }
   WAIT_FOR_FINISH(TestTCP)
 
+  // Response arriving in two TCP segments must be put together
+  tc = new TestCase {
+    .name = LNO(__LINE__),
+    .testname = "Response split across segments",
+    .transactionID = static_cast<uint16_t>(TestTCP.getMessageCount() & 0xFFFF),
+    .token = Token++,
+    .response = makeVector("01 03 04 11 22 33 44"),
+    .expected = makeVector("01 03 04 11 22 33 44"),
+    .delayTime = 0,
+    .stopAfterResponding = false,
+    .fakeTransactionID = false,
+    .holdResponse = false,
+    .joinResponse = false,
+    .splitResponse = true
+  };
+  testCasesByTID[tc->transactionID] = tc;
+  testCasesByToken[tc->token] = tc;
+  e = TestTCP.addRequest(tc->token, 1, 0x03, 1, 2);
+  if (e != SUCCESS) {
+    ModbusMessage r;
+    r.add(e);
+    testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+  }
+  WAIT_FOR_FINISH(TestTCP)
+
+  // Response with a protocol ID other than Modbus
+  tc = new TestCase {
+    .name = LNO(__LINE__),
+    .testname = "Invalid protocol ID in response",
+    .transactionID = static_cast<uint16_t>(TestTCP.getMessageCount() & 0xFFFF),
+    .token = Token++,
+    .response = makeVector("01 07 00"),
+    .expected = makeVector("01 87 EB"),
+    .delayTime = 0,
+    .stopAfterResponding = false,
+    .fakeTransactionID = false,
+    .holdResponse = false,
+    .joinResponse = false,
+    .splitResponse = false,
+    .fakeProtocolID = true
+  };
+  testCasesByTID[tc->transactionID] = tc;
+  testCasesByToken[tc->token] = tc;
+  e = TestTCP.addRequest(tc->token, 1, 0x07);
+  if (e != SUCCESS) {
+    ModbusMessage r;
+    r.add(e);
+    testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+  }
+  WAIT_FOR_FINISH(TestTCP)
+
+  // Response too short to hold server ID and function code
+  tc = new TestCase {
+    .name = LNO(__LINE__),
+    .testname = "Invalid length in response",
+    .transactionID = static_cast<uint16_t>(TestTCP.getMessageCount() & 0xFFFF),
+    .token = Token++,
+    .response = makeVector("01"),
+    .expected = makeVector("01 87 EB"),
+    .delayTime = 0,
+    .stopAfterResponding = false,
+    .fakeTransactionID = false,
+    .holdResponse = false,
+    .joinResponse = false,
+    .splitResponse = false,
+    .fakeProtocolID = false
+  };
+  testCasesByTID[tc->transactionID] = tc;
+  testCasesByToken[tc->token] = tc;
+  e = TestTCP.addRequest(tc->token, 1, 0x07);
+  if (e != SUCCESS) {
+    ModbusMessage r;
+    r.add(e);
+    testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+  }
+  WAIT_FOR_FINISH(TestTCP)
+
   // Stub will not respond at all - another timeout constellation
   tc = new TestCase { 
     .name = LNO(__LINE__),
@@ -1061,6 +1315,135 @@ void setup()
   }
   WAIT_FOR_FINISH(TestTCP)
 
+  // Count heap blocks of a request too large for the inline buffer: building it must be the
+  // only allocation on its way through queue, worker and stub.
+  {
+    uint16_t words[30];
+    for (uint8_t i = 0; i < 30; ++i) words[i] = i;
+    tc = new TestCase {
+      .name = LNO(__LINE__),
+      .testname = "Large request without copies",
+      .transactionID = static_cast<uint16_t>(TestTCP.getMessageCount() & 0xFFFF),
+      .token = Token++,
+      .response = makeVector("01 10 00 00 00 1E"),
+      .expected = makeVector("01 10 00 00 00 1E"),
+      .delayTime = 0,
+      .stopAfterResponding = false,
+      .fakeTransactionID = false
+    };
+    testCasesByTID[tc->transactionID] = tc;
+    testCasesByToken[tc->token] = tc;
+    uint32_t heapBefore = ModbusMessage::heapAllocations();
+    e = TestTCP.addRequest(tc->token, 1, WRITE_MULT_REGISTERS, 0, 30, 60, words);
+    if (e != SUCCESS) {
+      ModbusMessage r;
+      r.add(e);
+      testOutput(tc->testname, tc->name, tc->expected, r);
+      highestTokenProcessed = tc->token;
+    }
+    WAIT_FOR_FINISH(TestTCP)
+    ModbusMessage heapCount;
+    heapCount.add((uint16_t)(ModbusMessage::heapAllocations() - heapBefore));
+    testOutput(__func__, LNO(__LINE__) "Heap blocks per large request", makeVector("00 01"), heapCount);
+  }
+
+  // Pipelining: two requests in flight, the stub answers the second one first.
+  // Each response must find its own request by the transactionID.
+  TestTCP.setMaxInflightRequests(2);
+  tc = new TestCase {
+    .name = LNO(__LINE__),
+    .testname = "Pipelined, answered last",
+    .transactionID = static_cast<uint16_t>(TestTCP.getMessageCount() & 0xFFFF),
+    .token = Token++,
+    .response = makeVector("01 03 02 11 11"),
+    .expected = makeVector("01 03 02 11 11"),
+    .delayTime = 0,
+    .stopAfterResponding = false,
+    .fakeTransactionID = false,
+    .holdResponse = true
+  };
+  testCasesByTID[tc->transactionID] = tc;
+  testCasesByToken[tc->token] = tc;
+  e = TestTCP.addRequest(tc->token, 1, 0x03, 1, 1);
+  if (e != SUCCESS) {
+    ModbusMessage r;
+    r.add(e);
+    testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+  }
+
+  tc = new TestCase {
+    .name = LNO(__LINE__),
+    .testname = "Pipelined, answered first",
+    .transactionID = static_cast<uint16_t>(TestTCP.getMessageCount() & 0xFFFF),
+    .token = Token++,
+    .response = makeVector("01 03 02 22 22"),
+    .expected = makeVector("01 03 02 22 22"),
+    .delayTime = 0,
+    .stopAfterResponding = false,
+    .fakeTransactionID = false,
+    .holdResponse = false
+  };
+  testCasesByTID[tc->transactionID] = tc;
+  testCasesByToken[tc->token] = tc;
+  e = TestTCP.addRequest(tc->token, 1, 0x03, 2, 1);
+  if (e != SUCCESS) {
+    ModbusMessage r;
+    r.add(e);
+    testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+  }
+  WAIT_FOR_FINISH(TestTCP)
+
+  // Two responses arriving in one read must both be found
+  tc = new TestCase {
+    .name = LNO(__LINE__),
+    .testname = "Pipelined, first in joined read",
+    .transactionID = static_cast<uint16_t>(TestTCP.getMessageCount() & 0xFFFF),
+    .token = Token++,
+    .response = makeVector("01 03 02 33 33"),
+    .expected = makeVector("01 03 02 33 33"),
+    .delayTime = 0,
+    .stopAfterResponding = false,
+    .fakeTransactionID = false,
+    .holdResponse = false,
+    .joinResponse = true
+  };
+  testCasesByTID[tc->transactionID] = tc;
+  testCasesByToken[tc->token] = tc;
+  e = TestTCP.addRequest(tc->token, 1, 0x03, 3, 1);
+  if (e != SUCCESS) {
+    ModbusMessage r;
+    r.add(e);
+    testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+  }
+
+  tc = new TestCase {
+    .name = LNO(__LINE__),
+    .testname = "Pipelined, second in joined read",
+    .transactionID = static_cast<uint16_t>(TestTCP.getMessageCount() & 0xFFFF),
+    .token = Token++,
+    .response = makeVector("01 03 02 44 44"),
+    .expected = makeVector("01 03 02 44 44"),
+    .delayTime = 0,
+    .stopAfterResponding = false,
+    .fakeTransactionID = false,
+    .holdResponse = false,
+    .joinResponse = false
+  };
+  testCasesByTID[tc->transactionID] = tc;
+  testCasesByToken[tc->token] = tc;
+  e = TestTCP.addRequest(tc->token, 1, 0x03, 4, 1);
+  if (e != SUCCESS) {
+    ModbusMessage r;
+    r.add(e);
+    testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+  }
+  WAIT_FOR_FINISH(TestTCP)
+  TestTCP.setMaxInflightRequests(1);
+
   TestTCP.setTarget(testHost2, 502);
   stub.setIdentity(testHost2, 502);
   tc = new TestCase { 
@@ -1087,6 +1470,68 @@ void setup()
   // Print summary. We will have to wait a bit to get all test cases executed!
   WAIT_FOR_FINISH(TestTCP)
 
+  // Connection pool: two stubs, each simulating a host of its own.
+  // A stub only connects to its identity, so a request going to the wrong slot fails.
+  {
+    TCPstub poolStub1;
+    TCPstub poolStub2;
+    poolStub1.begin(&testCasesByTID, testHost, 502);
+    poolStub2.begin(&testCasesByTID, testHost2, 502);
+    ModbusClientTCP poolTCP(poolStub1, 2);
+    poolTCP.addPoolClient(poolStub2);
+    poolTCP.begin();
+    IPAddress testHost3 = IPAddress(10, 1, 2, 3);
+
+    // poolRequest: synchronous request to host, the stub answers with response
+    auto poolRequest = [&](IPAddress host, const char *name, const char *testname, const char *response) {
+      poolTCP.setTarget(host, 502, 2000, 0);
+      tc = new TestCase {
+        .name = name,
+        .testname = testname,
+        .transactionID = static_cast<uint16_t>(poolTCP.getMessageCount() & 0xFFFF),
+        .token = Token++,
+        .response = makeVector(response),
+        .expected = makeVector(response),
+        .delayTime = 0,
+        .stopAfterResponding = false,
+        .fakeTransactionID = false
+      };
+      testCasesByTID[tc->transactionID] = tc;
+      ModbusMessage r = poolTCP.syncRequest(tc->token, 1, 0x03, 1, 1);
+      testOutput(tc->testname, tc->name, tc->expected, r);
+    };
+
+    // poolState: which of the stubs are connected
+    auto poolState = [&]() {
+      ModbusMessage m;
+      m.add(poolStub1.connected(), poolStub2.connected());
+      return m;
+    };
+
+    // Each target gets a connection of its own
+    poolRequest(testHost, LNO(__LINE__), "Pool, first target", "01 03 02 01 01");
+    poolRequest(testHost2, LNO(__LINE__), "Pool, second target", "01 03 02 02 02");
+    testOutput(__func__, LNO(__LINE__) "Pool, both connections open", makeVector("01 01"), poolState());
+
+    // The open connection is used again - no slot is taken over for it
+    poolRequest(testHost, LNO(__LINE__), "Pool, reuse open connection", "01 03 02 03 03");
+    testOutput(__func__, LNO(__LINE__) "Pool, no connection closed for reuse", makeVector("01 01"), poolState());
+
+    // Pool is full: a new target takes the slot used least recently - the one to testHost2.
+    // Only poolStub2 may connect to testHost3 now
+    poolStub2.setIdentity(testHost3, 502);
+    poolRequest(testHost3, LNO(__LINE__), "Pool, least recently used slot taken", "01 03 02 04 04");
+    testOutput(__func__, LNO(__LINE__) "Pool, recently used connection kept", makeVector("01 01"), poolState());
+
+    // Lowering the cap closes the connections above it
+    poolTCP.setMaxConnections(1);
+    delay(100);
+    testOutput(__func__, LNO(__LINE__) "Pool, connection above cap closed", makeVector("01 00"), poolState());
+    poolRequest(testHost, LNO(__LINE__), "Pool, request below cap", "01 03 02 05 05");
+
+    poolTCP.end();
+  }
+
   Serial.printf("----->    TCP loop stub tests: %4d, passed: %4d", testsExecuted, testsPassed);
 
 
@@ -1162,6 +1607,7 @@ void setup()
 
     // Start RTU client. 
     RTUclient.begin(Serial1);
+    Coalescer.begin();
 
     // Define and start RTU server
     RTUserver.registerWorker(1, READ_HOLD_REGISTER, &FC03);      // FC=03 for serverID=1
@@ -1274,6 +1720,72 @@ void setup()
     highestTokenProcessed = tc->token;
     }
 
+    // #4a, #4b: two adjacent reads, sent as one request and split again
+    ExpectedToggles++;
+    tc = new TestCase { 
+      .name = LNO(__LINE__),
+      .testname = "Coalesced read, lower part",
+      .transactionID = 0,
+      .token = Token++,
+      .response = empty,
+      .expected = makeVector("01 03 04 1A 1B 1C 1D"),
+      .delayTime = 0,
+      .stopAfterResponding = true,
+      .fakeTransactionID = false
+    };
+    testCasesByToken[tc->token] = tc;
+    e = Coalescer.addRequest(tc->token, &handleData, 1, READ_HOLD_REGISTER, 14, 2);
+    if (e != SUCCESS) {
+      ModbusMessage r;
+      r.add(e);
+      testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+    }
+    tc = new TestCase { 
+      .name = LNO(__LINE__),
+      .testname = "Coalesced read, upper part",
+      .transactionID = 0,
+      .token = Token++,
+      .response = empty,
+      .expected = makeVector("01 03 04 BE EF 20 21"),
+      .delayTime = 0,
+      .stopAfterResponding = true,
+      .fakeTransactionID = false
+    };
+    testCasesByToken[tc->token] = tc;
+    e = Coalescer.addRequest(tc->token, &handleData, 1, READ_HOLD_REGISTER, 16, 2);
+    if (e != SUCCESS) {
+      ModbusMessage r;
+      r.add(e);
+      testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+    }
+    // #4c: a third one collected with them, but withdrawn before the window ends
+    tc = new TestCase { 
+      .name = LNO(__LINE__),
+      .testname = "Coalesced read, cancelled",
+      .transactionID = 0,
+      .token = Token++,
+      .response = empty,
+      .expected = makeVector("01 83 F3"),
+      .delayTime = 0,
+      .stopAfterResponding = true,
+      .fakeTransactionID = false
+    };
+    testCasesByToken[tc->token] = tc;
+    e = Coalescer.addRequest(tc->token, &handleData, 1, READ_HOLD_REGISTER, 18, 2);
+    if (e != SUCCESS) {
+      ModbusMessage r;
+      r.add(e);
+      testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+    }
+    {
+      ModbusMessage count;
+      count.add((uint8_t)Coalescer.cancel(tc->token));
+      testOutput(__func__, LNO(__LINE__) "Coalescer cancel count", makeVector("01"), count);
+    }
+
     // Snap in the Sniffer
     // RTUserver.registerSniffer(Sniffer);
 
@@ -1365,6 +1877,139 @@ void setup()
     }
     WAIT_FOR_FINISH(RTUclient)
 
+    // #8a: timeout puts server into quarantine
+    RTUclient.setQuarantine(1, 60000, 60000);
+    tc = new TestCase { 
+      .name = LNO(__LINE__),
+      .testname = "Timeout before quarantine",
+      .transactionID = 0,
+      .token = Token++,
+      .response = empty,
+      .expected = makeVector("03 87 E0"), 
+      .delayTime = 0,
+      .stopAfterResponding = true,
+      .fakeTransactionID = false
+    };
+    testCasesByToken[tc->token] = tc;
+    e = RTUclient.addRequest(tc->token, 3, 0x07);
+    if (e != SUCCESS) {
+      ModbusMessage r;
+      r.add(e);
+      testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+    }
+
+    // #8b: quarantined server is refused without a request sent
+    tc = new TestCase { 
+      .name = LNO(__LINE__),
+      .testname = "Server quarantined",
+      .transactionID = 0,
+      .token = Token++,
+      .response = empty,
+      .expected = makeVector("03 87 F1"), 
+      .delayTime = 0,
+      .stopAfterResponding = true,
+      .fakeTransactionID = false
+    };
+    testCasesByToken[tc->token] = tc;
+    e = RTUclient.addRequest(tc->token, 3, 0x07);
+    if (e != SUCCESS) {
+      ModbusMessage r;
+      r.add(e);
+      testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+    }
+    WAIT_FOR_FINISH(RTUclient)
+    RTUclient.setQuarantine(0);
+
+    // #8c: request waiting too long behind a timeout expires
+    tc = new TestCase {
+      .name = LNO(__LINE__),
+      .testname = "Timeout before deadline",
+      .transactionID = 0,
+      .token = Token++,
+      .response = empty,
+      .expected = makeVector("02 C1 E0"),
+      .delayTime = 0,
+      .stopAfterResponding = true,
+      .fakeTransactionID = false
+    };
+    testCasesByToken[tc->token] = tc;
+    e = RTUclient.addRequest(tc->token, 2, USER_DEFINED_41);
+    if (e != SUCCESS) {
+      ModbusMessage r;
+      r.add(e);
+      testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+    }
+
+    tc = new TestCase {
+      .name = LNO(__LINE__),
+      .testname = "Request expired",
+      .transactionID = 0,
+      .token = Token++,
+      .response = empty,
+      .expected = makeVector("01 07 F2"),
+      .delayTime = 0,
+      .stopAfterResponding = true,
+      .fakeTransactionID = false
+    };
+    testCasesByToken[tc->token] = tc;
+    e = RTUclient.addRequest(RequestClass(PRIO_NORMAL, 10), tc->token, nullptr, 1, 0x07);
+    if (e != SUCCESS) {
+      ModbusMessage r;
+      r.add(e);
+      testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+    }
+    WAIT_FOR_FINISH(RTUclient)
+
+    // #8d: request cancelled while waiting behind a timeout
+    tc = new TestCase {
+      .name = LNO(__LINE__),
+      .testname = "Timeout before cancel",
+      .transactionID = 0,
+      .token = Token++,
+      .response = empty,
+      .expected = makeVector("02 C1 E0"),
+      .delayTime = 0,
+      .stopAfterResponding = true,
+      .fakeTransactionID = false
+    };
+    testCasesByToken[tc->token] = tc;
+    e = RTUclient.addRequest(tc->token, 2, USER_DEFINED_41);
+    if (e != SUCCESS) {
+      ModbusMessage r;
+      r.add(e);
+      testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+    }
+
+    tc = new TestCase {
+      .name = LNO(__LINE__),
+      .testname = "Request cancelled",
+      .transactionID = 0,
+      .token = Token++,
+      .response = empty,
+      .expected = makeVector("01 07 F3"),
+      .delayTime = 0,
+      .stopAfterResponding = true,
+      .fakeTransactionID = false
+    };
+    testCasesByToken[tc->token] = tc;
+    e = RTUclient.addRequest(tc->token, 1, 0x07);
+    if (e != SUCCESS) {
+      ModbusMessage r;
+      r.add(e);
+      testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+    } else if (RTUclient.cancel(tc->token) != 1) {
+      ModbusMessage r;
+      r.add((uint8_t)0);
+      testOutput(tc->testname, tc->name, tc->expected, r);
+    }
+    WAIT_FOR_FINISH(RTUclient)
+
     // Test-wise, switch handlers
     RTUclient.onResponseHandler(nullptr);
     RTUclient.onDataHandler(handleData);
@@ -1482,6 +2127,140 @@ void setup()
       testsPassed++;
     }
 
+    // #12a: cyclic requests by the poller
+    uint32_t pollAnswers = 0;
+    uint32_t pollErrors = 0;
+    {
+      ModbusPoller Poller;
+      MBOnResponse pollHandler = [&](ModbusMessage response, uint32_t token) {
+        if (response.getError() == SUCCESS) pollAnswers++;
+        else                                 pollErrors++;
+      };
+      // Every 100ms for a second
+      int id = Poller.addPoll(RTUclient, 1, READ_HOLD_REGISTER, 16, 1, 100, 0, pollHandler, 1);
+      Poller.begin();
+      delay(1050);
+      testsExecuted++;
+      if (!Poller.removePoll(id) || Poller.removePoll(id)) {
+        mb_log_w("Poller: removePoll() failed");
+      } else {
+        testsPassed++;
+      }
+      delay(200);
+      ModbusPoller::PollStats ps = Poller.getStats(id);
+      testsExecuted++;
+      if (ps.issued < 10 || ps.issued > 11 || ps.responses != ps.issued || ps.errors || ps.overruns || pollAnswers != ps.issued) {
+        mb_log_w("Poller: issued=%u responses=%u errors=%u overruns=%u answers=%u",
+          ps.issued, ps.responses, ps.errors, ps.overruns, pollAnswers);
+      } else {
+        testsPassed++;
+      }
+      // No more requests after removePoll()
+      delay(300);
+      testsExecuted++;
+      if (Poller.getStats(id).issued != ps.issued) {
+        mb_log_w("Poller: removed poll still issued requests");
+      } else {
+        testsPassed++;
+      }
+      // Every 500ms to a server not answering: the pending request lets the next cycles overrun.
+      // The worker has nothing to wait for now - addPoll() must wake it up to send the first at once
+      id = Poller.addPoll(RTUclient, 2, USER_DEFINED_41, 0, 0, 500, 0, pollHandler, 2);
+      delay(1200);
+      Poller.removePoll(id);
+      ps = Poller.getStats(id);
+      testsExecuted++;
+      if (ps.issued != 1 || ps.overruns < 2 || ps.responses || ps.maxJitter > 2) {
+        mb_log_w("Poller: issued=%u responses=%u overruns=%u jitter=%u", ps.issued, ps.responses, ps.overruns, ps.maxJitter);
+      } else {
+        testsPassed++;
+      }
+      // The destructor has to wait for the timeout
+    }
+    testsExecuted++;
+    if (pollErrors != 1) {
+      mb_log_w("Poller: %u errors instead of 1", pollErrors);
+    } else {
+      testsPassed++;
+    }
+
+    // #12b: bus time prediction at 5MBaud: 2us per character, 1750us silent interval.
+    // Server 5 has never answered, so no turnaround is known
+    {
+      ModbusMessage m;
+      m.setMessage(5, READ_HOLD_REGISTER, 1, 10);
+      uint32_t t = RTUclient.predictTime(m);
+      testsExecuted++;
+      // 8 bytes request, 25 bytes response, two intervals
+      if (t != 33 * 2 + 2 * 1750) {
+        mb_log_w("predictTime 05/03 = %u instead of %u", t, 33 * 2 + 2 * 1750);
+      } else {
+        testsPassed++;
+      }
+      m.clear();
+      m.add((uint8_t)0, USER_DEFINED_41);
+      t = RTUclient.predictTime(m);
+      testsExecuted++;
+      // Broadcast: 4 bytes request, no response
+      if (t != 4 * 2 + 1750) {
+        mb_log_w("predictTime 00/41 = %u instead of %u", t, 4 * 2 + 1750);
+      } else {
+        testsPassed++;
+      }
+    }
+
+    // #12c: planner order. A timeout blocks the bus while the requests are queued behind it
+    RTUserver.registerSniffer(OrderSniffer);
+    MBOnResponse ignore = [](ModbusMessage, uint32_t) { };
+    uint8_t bcPlan[] = { USER_DEFINED_41 };
+    for (uint8_t run = 0; run < 4; ++run) {
+      const char *testname = "";
+      const char *expected = "";
+      RTUclient.usePlanner(true, run == 3 ? 50 : 10000);
+      busOrder.clear();
+      RTUclient.addRequest(Token++, ignore, 2, USER_DEFINED_41);
+      delay(20);
+      switch (run) {
+      case 0:
+        // Server 2 moves more registers, but server 1's requests keep their order
+        testname = "Planner keeps order per server";
+        expected = "02 41 00 02 03 14 01 03 10 01 03 01";
+        RTUclient.addRequest(Token++, ignore, 1, READ_HOLD_REGISTER, 16, 1);
+        RTUclient.addRequest(Token++, ignore, 1, READ_HOLD_REGISTER, 1, 10);
+        RTUclient.addRequest(Token++, ignore, 2, READ_HOLD_REGISTER, 20, 8);
+        break;
+      case 1:
+        // Nothing overtakes a broadcast, and the broadcast nothing before it
+        testname = "Planner keeps broadcast order";
+        expected = "02 41 00 01 03 10 00 41 00 02 03 14";
+        RTUclient.addRequest(Token++, ignore, 1, READ_HOLD_REGISTER, 16, 1);
+        RTUclient.addBroadcastMessage(bcPlan, sizeof(bcPlan));
+        RTUclient.addRequest(Token++, ignore, 2, READ_HOLD_REGISTER, 20, 8);
+        break;
+      case 2:
+        // Most registers per bus time go first
+        testname = "Planner prefers larger requests";
+        expected = "02 41 00 02 03 14 02 03 01 01 03 10";
+        RTUclient.addRequest(Token++, ignore, 1, READ_HOLD_REGISTER, 16, 1);
+        RTUclient.addRequest(Token++, ignore, 2, READ_HOLD_REGISTER, 20, 8);
+        RTUclient.addRequest(Token++, ignore, 2, READ_HOLD_REGISTER, 1, 8);
+        break;
+      default:
+        // The same, but the small request has waited longer than maxDelay
+        testname = "Planner respects maxDelay";
+        expected = "02 41 00 01 03 10 02 03 14 02 03 01";
+        RTUclient.addRequest(Token++, ignore, 1, READ_HOLD_REGISTER, 16, 1);
+        RTUclient.addRequest(Token++, ignore, 2, READ_HOLD_REGISTER, 20, 8);
+        RTUclient.addRequest(Token++, ignore, 2, READ_HOLD_REGISTER, 1, 8);
+        break;
+      }
+      WAIT_FOR_FINISH(RTUclient)
+      delay(20);
+      testOutput(testname, LNO(__LINE__), makeVector(expected), busOrder);
+    }
+    RTUclient.usePlanner(false);
+    RTUserver.registerSniffer(nullptr);
+
     // Now to something completely different...
     // Use Modbus ASCII now.
     // First set client to ASCII only to check for error returns
@@ -2202,6 +2981,186 @@ void setup()
   // Print summary.
   Serial.printf("----->    FC redefiniton: %4d, passed: %4d", testsExecuted, testsPassed);
 
+  // ******************************************************************************
+  // RequestQueue tests
+  // ******************************************************************************
+  testsExecuted = 0;
+  testsPassed = 0;
+  {
+    // #1 - the limit counts, not the ring size (8)
+    RequestQueue<uint32_t> rq(5);
+    bool pushed = true;
+    for (uint32_t i = 0; i < 5; ++i) pushed &= rq.push(i);
+    testsExecuted++;
+    if (pushed && !rq.push(5) && rq.size() == 5) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "RequestQueue full #1 failed");
+    }
+
+    // #2 - an entry taken stays counted until released
+    testsExecuted++;
+    uint32_t first = *rq.front();
+    rq.take();
+    if (first == 0 && !rq.push(5) && rq.size() == 5) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "RequestQueue full #2 failed");
+    }
+    rq.release();
+
+    // #3 - room again after release, order kept across the end of the ring
+    testsExecuted++;
+    pushed = rq.push(5) && rq.push(6) == false;
+    uint32_t expect = 1;
+    while (uint32_t *v = rq.front()) {
+      if (*v != expect++) pushed = false;
+      rq.pop();
+    }
+    if (pushed && expect == 6 && rq.size() == 0 && rq.empty()) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "RequestQueue order #3 failed");
+    }
+
+    // #4 - four producer tasks on both cores, one consumer. Every entry arrives once and
+    // in the order of its producer, the queue never holds more than its limit
+    const uint8_t PRODUCERS = 4;
+    const uint16_t PERPRODUCER = 2000;
+    RequestQueue<uint32_t> mq(16);
+    QueueProducer producers[PRODUCERS];
+    uint16_t next[PRODUCERS] = { 0 };
+    for (uint8_t i = 0; i < PRODUCERS; ++i) {
+      producers[i] = { &mq, i, PERPRODUCER, 0, false };
+      xTaskCreatePinnedToCore((TaskFunction_t)&queueProducer, "RQproducer", 2048, &producers[i], 1, NULL, i & 1);
+    }
+    uint32_t received = 0;
+    bool ordered = true;
+    bool limited = true;
+    unsigned long start = millis();
+    while (received < PRODUCERS * PERPRODUCER && millis() - start < 10000) {
+      if (mq.size() > 16) limited = false;
+      uint32_t *v = mq.front();
+      if (!v) {
+        delay(1);
+        continue;
+      }
+      uint16_t id = *v >> 16;
+      if (id >= PRODUCERS || (*v & 0xFFFF) != next[id]) {
+        ordered = false;
+      } else {
+        next[id]++;
+      }
+      mq.pop();
+      received++;
+    }
+    bool done = true;
+    uint32_t refused = 0;
+    for (uint8_t i = 0; i < PRODUCERS; ++i) {
+      done &= producers[i].done;
+      refused += producers[i].refused;
+    }
+    testsExecuted++;
+    if (done && ordered && limited && received == PRODUCERS * PERPRODUCER && mq.empty() && mq.size() == 0) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "RequestQueue multi-producer #4 failed: %u received, ordered=%d, limited=%d", received, ordered, limited);
+    }
+    Serial.printf("RequestQueue: %u pushes refused while full", refused);
+  }
+
+  // Print summary.
+  Serial.printf("----->    RequestQueue tests: %4d, passed: %4d", testsExecuted, testsPassed);
+
+  // ******************************************************************************
+  // ASCII tests
+  // ******************************************************************************
+  testsExecuted = 0;
+  testsPassed = 0;
+  {
+    // Lengths around the 8 bytes resp. 16 characters done per step by the bulk code
+    const uint16_t lengths[] = { 1, 7, 8, 9, 15, 16, 17, 33, 254 };
+    uint8_t bytes[254];
+    uint8_t chars[2 * 254];
+    uint8_t decoded[254];
+
+    for (uint16_t len : lengths) {
+      for (uint16_t i = 0; i < len; ++i) bytes[i] = i * 37 + len;
+
+      // #1 - encode to upper case hex digits, decode again, in place as well with lower case
+      bool good = RTUutils::encodeASCII(bytes, len, chars) == 2 * len;
+      for (uint16_t i = 0; good && i < len; ++i) {
+        char hex[3];
+        snprintf(hex, 3, "%02X", bytes[i]);
+        good = chars[2 * i] == hex[0] && chars[2 * i + 1] == hex[1];
+      }
+      good = good && RTUutils::decodeASCII(chars, 2 * len, decoded) == len && !memcmp(decoded, bytes, len);
+      for (uint16_t i = 0; i < 2 * len; ++i) {
+        if (chars[i] >= 'A') chars[i] |= 0x20;
+      }
+      good = good && RTUutils::decodeASCII(chars, 2 * len, chars) == len && !memcmp(chars, bytes, len);
+      testsExecuted++;
+      if (good) {
+        testsPassed++;
+      } else {
+        Serial.printf(LNO(__LINE__) "ASCII round trip #1 failed for %u bytes", len);
+      }
+
+      // #2 - an invalid character is found at the start, in the middle and at the end
+      const uint8_t invalid[] = { 'G', 'g', ':', '@', '/', '\r', 0xB0 };
+      RTUutils::encodeASCII(bytes, len, chars);
+      const uint16_t positions[] = { 0, len, (uint16_t)(2 * len - 1) };
+      good = true;
+      uint8_t k = 0;
+      for (uint16_t pos : positions) {
+        for (uint8_t c : invalid) {
+          uint8_t keep = chars[pos];
+          chars[pos] = c;
+          if (RTUutils::decodeASCII(chars, 2 * len, decoded) != -1) good = false;
+          chars[pos] = keep;
+          k++;
+        }
+      }
+      testsExecuted++;
+      if (good && k == 3 * sizeof(invalid)) {
+        testsPassed++;
+      } else {
+        Serial.printf(LNO(__LINE__) "ASCII invalid character #2 not found for %u bytes", len);
+      }
+    }
+
+    // #3 - send() frames the message with lead-in, LRC and the CR LF lead-out
+    BufferStream stream;
+    unsigned long lastMicros = 0;
+    ModbusMessage msg;
+    msg.setMessage(1, READ_HOLD_REGISTER, 16, 1);
+    ASCIIutils::send(stream, lastMicros, 0, RTUutils::RTSauto, msg, true);
+    ModbusMessage frame;
+    frame.add(stream.buffer.data(), stream.buffer.size());
+    ModbusMessage expected;
+    expected.add((const uint8_t *)":010300100001EB\r\n", 17);
+    testOutput("ASCII send", LNO(__LINE__), expected, frame);
+
+    // #4 - a frame sent is received unchanged, for a length not done in steps of 8 alone
+    msg.clear();
+    msg.add(bytes, 33);
+    stream.buffer.clear();
+    ASCIIutils::send(stream, lastMicros, 0, RTUutils::RTSauto, msg, true);
+    stream.readPos = 0;
+    testOutput("ASCII receive", LNO(__LINE__), msg, ASCIIutils::receive('T', stream, 100, lastMicros, 0, true));
+
+    // #5 - receive errors: LRC, invalid character, missing LF
+    stream.set(":010300100001EC\r\n");
+    testOutput("ASCII receive, wrong LRC", LNO(__LINE__), makeVector("EE"), ASCIIutils::receive('T', stream, 100, lastMicros, 0, true));
+    stream.set(":0103001G0001EB\r\n");
+    testOutput("ASCII receive, invalid character", LNO(__LINE__), makeVector("EF"), ASCIIutils::receive('T', stream, 100, lastMicros, 0, true));
+    stream.set(":010300100001EB\r:");
+    testOutput("ASCII receive, no LF", LNO(__LINE__), makeVector("ED"), ASCIIutils::receive('T', stream, 100, lastMicros, 0, true));
+  }
+
+  // Print summary.
+  Serial.printf("----->    ASCII tests: %4d, passed: %4d", testsExecuted, testsPassed);
+
   // ******************************************************************************
   // Counter tests
   // ******************************************************************************
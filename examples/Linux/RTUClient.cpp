@@ -0,0 +1,59 @@
+#include "Logging.h"
+#include "ModbusClientRTU.h"
+#include "HardwareSerial.h"
+
+// ============= main =============
+int main(int argc, char **argv) {
+  uint32_t baud = 19200;
+  uint8_t targetSID = 1;
+  uint16_t addr = 1;
+  uint16_t words = 8;
+
+  if (argc != 6) {
+    printf("Usage: %s device baudrate serverID address numRegisters\n", argv[0]);
+    return -1;
+  }
+
+  baud = atoi(argv[2]);
+  targetSID = atoi(argv[3]) & 0xFF;
+  addr = atoi(argv[4]) & 0xFFFF;
+  words = atoi(argv[5]) & 0xFFFF;
+
+  // Define the serial interface, 8N1
+  HardwareSerial serial(argv[1]);
+  if (!serial.begin(baud, SERIAL_8N1)) {
+    printf("Cannot open %s with %u baud\n", argv[1], baud);
+    return -1;
+  }
+  // Let the driver do the DE/RE toggling of a RS485 adapter, if it can
+  serial.setRS485(true);
+
+  printf("Using %s@%u:%u @%u/%u\n", argv[1], baud, targetSID, addr, words);
+
+  // Define a Modbus RTU client on the interface
+  ModbusClientRTU MBclient;
+  MBclient.setTimeout(2000);
+  // Start ModbusRTU background task
+  MBclient.begin(serial);
+
+  // Create request for
+  // - token to match the response with the request. We take the current millis() value for it.
+  // - server ID = targetSID
+  // - function code = 0x03 (read holding register)
+  // - start address to read = addr
+  // - number of words to read = words
+  ModbusMessage response = MBclient.syncRequest((uint32_t)millis(), targetSID, READ_HOLD_REGISTER, addr, words);
+  Error err = response.getError();
+  if (err != SUCCESS) {
+    ModbusError e(err);
+    printf("Error response: %02X - %s\n", (int)e, (const char *)e);
+  } else {
+    for (uint16_t i = 0; i < response.size(); ++i) {
+      printf("%02X%c", response[i], (i & 15) == 15 ? '\n' : ' ');
+    }
+    printf("\n");
+  }
+
+  MBclient.end();
+  return 0;
+}
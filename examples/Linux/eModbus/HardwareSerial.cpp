@@ -0,0 +1,185 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "options.h"
+
+#if IS_LINUX
+#include "HardwareSerial.h"
+#include "Logging.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+// Constructor: remember the device, open it in begin()
+HardwareSerial::HardwareSerial(const char *dev) :
+  device(dev),
+  fdes(-1),
+  baud(0),
+  rxHead(0),
+  rxTail(0) { }
+
+// Destructor: close device, if open
+HardwareSerial::~HardwareSerial() { end(); }
+
+// speedFor: termios constant for a baud rate, B0 if there is none
+static speed_t speedFor(uint32_t baud) {
+  switch (baud) {
+  case 1200: return B1200;
+  case 2400: return B2400;
+  case 4800: return B4800;
+  case 9600: return B9600;
+  case 19200: return B19200;
+  case 38400: return B38400;
+  case 57600: return B57600;
+  case 115200: return B115200;
+  case 230400: return B230400;
+  case 460800: return B460800;
+  case 500000: return B500000;
+  case 921600: return B921600;
+  case 1000000: return B1000000;
+  default: break;
+  }
+  return B0;
+}
+
+// begin: open the device raw and non-blocking with the given baud rate and configuration
+bool HardwareSerial::begin(uint32_t b, uint32_t config) {
+  end();
+
+  speed_t speed = speedFor(b);
+  if (speed == B0) {
+    mb_log_e("Unsupported baud rate %u", b);
+    return false;
+  }
+
+  fdes = ::open(device.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fdes < 0) {
+    mb_log_e("Error %d opening %s", errno, device.c_str());
+    return false;
+  }
+
+  struct termios tio;
+  if (tcgetattr(fdes, &tio) < 0) {
+    mb_log_e("Error %d reading attributes of %s", errno, device.c_str());
+    end();
+    return false;
+  }
+  cfmakeraw(&tio);
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
+  tio.c_cflag |= ((config & 0x0F) == 7) ? CS7 : CS8;
+  if (config & 0x30) tio.c_cflag |= PARENB;
+  if (config & 0x20) tio.c_cflag |= PARODD;
+  if (config & 0x40) tio.c_cflag |= CSTOPB;
+  // Reads return what is there, without waiting
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  if (tcsetattr(fdes, TCSANOW, &tio) < 0) {
+    mb_log_e("Error %d setting attributes of %s", errno, device.c_str());
+    end();
+    return false;
+  }
+  tcflush(fdes, TCIOFLUSH);
+  baud = b;
+  rxHead = rxTail = 0;
+  mb_log_d("%s opened with %u baud", device.c_str(), baud);
+  return true;
+}
+
+// end: close the device
+void HardwareSerial::end() {
+  if (fdes >= 0) {
+    ::close(fdes);
+    fdes = -1;
+  }
+  rxHead = rxTail = 0;
+}
+
+// fill: move what has arrived into the receive buffer
+void HardwareSerial::fill() {
+  if (fdes < 0) return;
+  if (rxHead == rxTail) rxHead = rxTail = 0;
+  if (rxTail < sizeof(rxBuf)) {
+    ssize_t n = ::read(fdes, rxBuf + rxTail, sizeof(rxBuf) - rxTail);
+    if (n > 0) rxTail += n;
+  }
+}
+
+int HardwareSerial::available() {
+  if (rxHead == rxTail) fill();
+  return rxTail - rxHead;
+}
+
+int HardwareSerial::read() {
+  if (available()) return rxBuf[rxHead++];
+  return -1;
+}
+
+int HardwareSerial::peek() {
+  if (available()) return rxBuf[rxHead];
+  return -1;
+}
+
+size_t HardwareSerial::write(uint8_t b) {
+  return write(&b, 1);
+}
+
+// write: put out all bytes, waiting for the driver to take them if necessary
+size_t HardwareSerial::write(const uint8_t *buf, size_t size) {
+  if (fdes < 0) return 0;
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = ::write(fdes, buf + done, size - done);
+    if (n > 0) {
+      done += n;
+    } else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+      struct pollfd p = { fdes, POLLOUT, 0 };
+      ::poll(&p, 1, 100);
+    } else {
+      mb_log_e("Error %d writing to %s", errno, device.c_str());
+      break;
+    }
+  }
+  return done;
+}
+
+// flush: wait until all data is out on the wire
+void HardwareSerial::flush() {
+  if (fdes >= 0) tcdrain(fdes);
+}
+
+// waitAvailable: wait up to timeout microseconds for data to arrive
+int HardwareSerial::waitAvailable(uint32_t timeout) {
+  int avail = available();
+  if (avail || fdes < 0) return avail;
+  struct pollfd p = { fdes, POLLIN, 0 };
+  struct timespec ts = { (time_t)(timeout / 1000000), (long)(timeout % 1000000) * 1000L };
+  if (::ppoll(&p, 1, &ts, nullptr) > 0) return available();
+  return 0;
+}
+
+// setRS485: let the kernel driver toggle DE/RE by RTS
+bool HardwareSerial::setRS485(bool on, bool rtsOnSend, uint32_t delayBeforeSend, uint32_t delayAfterSend) {
+  if (fdes < 0) return false;
+  struct serial_rs485 rs;
+  memset(&rs, 0, sizeof(rs));
+  if (on) {
+    rs.flags = SER_RS485_ENABLED | (rtsOnSend ? SER_RS485_RTS_ON_SEND : SER_RS485_RTS_AFTER_SEND);
+    rs.delay_rts_before_send = delayBeforeSend;
+    rs.delay_rts_after_send = delayAfterSend;
+  }
+  if (ioctl(fdes, TIOCSRS485, &rs) < 0) {
+    mb_log_w("RS485 mode not supported by %s (%d)", device.c_str(), errno);
+    return false;
+  }
+  return true;
+}
+
+#endif // IS_LINUX
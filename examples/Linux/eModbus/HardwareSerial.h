@@ -0,0 +1,62 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _HARDWARE_SERIAL_H
+#define _HARDWARE_SERIAL_H
+#include "options.h"
+
+#if IS_LINUX
+#include <string>
+#include "Stream.h"
+
+// Serial configurations: data bits in the low nibble, parity and stop bits above
+#define SERIAL_7N1 0x07
+#define SERIAL_8N1 0x08
+#define SERIAL_7E1 0x17
+#define SERIAL_8E1 0x18
+#define SERIAL_7O1 0x27
+#define SERIAL_8O1 0x28
+#define SERIAL_7N2 0x47
+#define SERIAL_8N2 0x48
+
+// HardwareSerial: a serial device (/dev/ttyUSB0, /dev/ttyS1, a pty, ...) driven by termios,
+// behaving like the Arduino class of the same name. All I/O is non-blocking.
+class HardwareSerial : public Stream {
+public:
+  explicit HardwareSerial(const char *device);
+  ~HardwareSerial();
+  // begin: open the device and set it up. Returns false if that failed
+  bool begin(uint32_t baud, uint32_t config = SERIAL_8N1);
+  void end();
+  int available() override;
+  int read() override;
+  int peek() override;
+  using Stream::write;
+  size_t write(uint8_t b) override;
+  size_t write(const uint8_t *buf, size_t size) override;
+  // flush: wait until all data is out on the wire
+  void flush() override;
+  uint32_t baudRate() const { return baud; }
+  // setRS485: let the kernel driver toggle DE/RE by RTS. Delays are in milliseconds.
+  // Returns false if the driver does not support it - as a pty, for example.
+  bool setRS485(bool on, bool rtsOnSend = true, uint32_t delayBeforeSend = 0, uint32_t delayAfterSend = 0);
+  // waitAvailable: wait up to timeout microseconds for data to arrive. Returns available()
+  int waitAvailable(uint32_t timeout) override;
+  inline int fd() const { return fdes; }
+  inline operator bool() const { return fdes >= 0; }
+
+protected:
+  // fill: move what has arrived into the receive buffer
+  void fill();
+
+  std::string device;             // device path
+  int fdes;                       // file descriptor, -1 if closed
+  uint32_t baud;                  // baud rate set in begin()
+  uint8_t rxBuf[256];             // receive buffer
+  uint16_t rxHead;                // next byte to read in rxBuf
+  uint16_t rxTail;                // end of data in rxBuf
+};
+
+#endif // IS_LINUX
+#endif // _HARDWARE_SERIAL_H
@@ -0,0 +1,37 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _STREAM_H
+#define _STREAM_H
+#include "options.h"
+
+#if IS_LINUX
+#include <cstddef>
+#include <cstring>
+
+// Stream: the part of the Arduino Stream interface the RTU functions are using
+class Stream {
+public:
+  virtual ~Stream() {}
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual size_t write(uint8_t b) = 0;
+  virtual size_t write(const uint8_t *buf, size_t size) = 0;
+  size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+  virtual void flush() = 0;
+  // waitAvailable: wait up to timeout microseconds for data to arrive. Returns available().
+  // This default polls every 100us, devices with a file descriptor will block on that instead.
+  virtual int waitAvailable(uint32_t timeout) {
+    unsigned long start = micros();
+    int avail;
+    while ((avail = available()) == 0 && (unsigned long)(micros() - start) < timeout) {
+      delayMicroseconds(100);
+    }
+    return avail;
+  }
+};
+
+#endif // IS_LINUX
+#endif // _STREAM_H
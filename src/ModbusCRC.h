@@ -0,0 +1,87 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_CRC_H
+#define _MODBUS_CRC_H
+#include "options.h"
+#include <stdint.h>
+
+// Number of 256-entry slicing tables kept: 8 enables all table engines, 4 drops slice8,
+// 1 leaves the bytewise engine only. ESP8266 has to keep the 4k of tables in RAM, so it gets one.
+#ifndef MODBUS_CRC_TABLES
+#if defined(ESP8266)
+#define MODBUS_CRC_TABLES 1
+#else
+#define MODBUS_CRC_TABLES 8
+#endif
+#endif
+
+// ModbusCRC: CRC16/Modbus (reflected polynomial 0xA001, start value 0xFFFF) with several engines.
+// calc() dispatches to the fastest engine the platform supports; useEngine() may pin one.
+// The result has the low byte first on the wire, like RTUutils::calcCRC() always had.
+// All functions are static!
+class ModbusCRC {
+public:
+  // Available engines
+  enum Engine : uint8_t {
+    CRC_AUTO = 0,     // best available
+    CRC_BYTEWISE,     // one table lookup per byte, 512 bytes of tables
+    CRC_SLICE4,       // 4 bytes per step, 2k of tables (MODBUS_CRC_TABLES >= 4)
+    CRC_SLICE8,       // 8 bytes per step, 4k of tables (MODBUS_CRC_TABLES == 8)
+    CRC_CLMUL,        // carry-less multiply folding, x86-64 Linux with PCLMULQDQ only
+  };
+
+  // calc: CRC of a block of data. crc may be a previous result to continue a calculation.
+  static uint16_t calc(const uint8_t *data, uint16_t len, uint16_t crc = 0xFFFF);
+
+  // update: fold a single byte into a running CRC
+  static inline uint16_t update(uint16_t crc, uint8_t byte) {
+    return (crc >> 8) ^ table[0][(crc ^ byte) & 0xFF];
+  }
+
+  // Running: CRC state of a frame that is coming in byte by byte.
+  // A Modbus frame followed by its own CRC leaves a CRC of 0, so the frame is known to be
+  // valid or not as soon as its last byte has been added.
+  class Running {
+  public:
+    Running() : RC_crc(0xFFFF), RC_count(0) {}
+    // reset: start over with a new frame
+    inline void reset() { RC_crc = 0xFFFF; RC_count = 0; }
+    // add: fold in the next byte(s)
+    inline void add(uint8_t byte) { RC_crc = update(RC_crc, byte); RC_count++; }
+    inline void add(const uint8_t *data, uint16_t len) { RC_crc = calc(data, len, RC_crc); RC_count += len; }
+    // value: CRC of all bytes added so far
+    inline uint16_t value() const { return RC_crc; }
+    // length: number of bytes added so far
+    inline uint16_t length() const { return RC_count; }
+    // valid: the bytes added so far are data plus a matching CRC
+    inline bool valid() const { return RC_count > 2 && RC_crc == 0; }
+  protected:
+    uint16_t RC_crc;             // CRC register
+    uint16_t RC_count;           // bytes added
+  };
+
+  // useEngine: select the engine for calc(). Returns false if it is not available here
+  static bool useEngine(Engine e);
+
+  // engine: the engine calc() is using
+  static Engine engine();
+
+  // isAvailable: check if an engine may be used on this platform
+  static bool isAvailable(Engine e);
+
+  // The engines, for direct use and comparison. Unavailable ones fall back to the next best
+  static uint16_t bytewise(const uint8_t *data, uint16_t len, uint16_t crc = 0xFFFF);
+  static uint16_t slice4(const uint8_t *data, uint16_t len, uint16_t crc = 0xFFFF);
+  static uint16_t slice8(const uint8_t *data, uint16_t len, uint16_t crc = 0xFFFF);
+  static uint16_t clmul(const uint8_t *data, uint16_t len, uint16_t crc = 0xFFFF);
+
+protected:
+  ModbusCRC() = delete;
+
+  // Slicing tables: table[0] is the classic byte table, table[k] advances a byte by k more positions
+  static const uint16_t table[MODBUS_CRC_TABLES][256];
+};
+
+#endif
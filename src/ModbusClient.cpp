@@ -42,30 +42,43 @@ void ModbusClient::resetCounts() {
   }
 }
 
-// waitSync: wait for response on syncRequest to arrive
-ModbusMessage ModbusClient::waitSync(uint8_t serverID, uint8_t functionCode, uint32_t token) {
+// waitSync: wait for response on syncRequest to arrive.
+// timeout is the longest time the request can take in the worker, including those queued before it.
+ModbusMessage ModbusClient::waitSync(uint8_t serverID, uint8_t functionCode, SyncSlotPtr slot, uint32_t timeout) {
   ModbusMessage response;
-  unsigned long lostPatience = millis();
- 
-  // Default response is TIMEOUT
-  response.setError(serverID, functionCode, TIMEOUT);
 
-  // Loop 10 seconds
-  while (millis() - lostPatience < 10000) {
-    {
-      LOCK_GUARD(lg, syncRespM);
-      // Look for the token
-      auto sR = syncResponse.find(token);
-      // Is it there?
-      if (sR != syncResponse.end()) {
-        // Yes. get the response, delete it from the map and return
-        response = sR->second;
-        syncResponse.erase(sR);
-        break;
-      }
-    }
-    // Give the watchdog time to act
-    delay(10);
+  // Did the worker not answer in time?
+  if (!slot->wait(timeout, response)) {
+    // No. Default response is TIMEOUT
+    response.setError(serverID, functionCode, TIMEOUT);
   }
   return response;
 }
+
+// SyncSlot::complete: store the response and wake up the requester
+void SyncSlot::complete(ModbusMessage r) {
+  {
+    LOCK_GUARD(lg, lock);
+    response = std::move(r);
+    done = true;
+  }
+#if USE_MUTEX
+  ready.notify_one();
+#endif
+}
+
+// SyncSlot::wait: wait up to timeout ms for the response
+bool SyncSlot::wait(uint32_t timeout, ModbusMessage& r) {
+#if USE_MUTEX
+  std::unique_lock<std::mutex> lk(lock);
+  if (!ready.wait_for(lk, std::chrono::milliseconds(timeout), [this] { return done; })) return false;
+#else
+  unsigned long start = millis();
+  while (!done) {
+    if (millis() - start >= timeout) return false;
+    delay(1);
+  }
+#endif
+  r = std::move(response);
+  return true;
+}
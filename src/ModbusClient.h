@@ -6,7 +6,7 @@
 #define _MODBUS_CLIENT_H
 
 #include <functional> 
-#include <map>
+#include <memory>
 #include "options.h"
 #include "ModbusMessage.h"
 
@@ -21,6 +21,7 @@ extern "C" {
 
 #if USE_MUTEX
 #include <mutex>                    // NOLINT
+#include <condition_variable>       // NOLINT
 using std::mutex;
 using std::lock_guard;
 #endif
@@ -29,13 +30,58 @@ using std::lock_guard;
 
 typedef std::function<void(ModbusMessage msg, uint32_t token)> MBOnResponse;
 
+// Request priorities. Requests with a higher priority are sent first, plain addRequest() calls use PRIO_NORMAL
+enum RequestPriority : uint8_t {
+  PRIO_LOW = 0,
+  PRIO_NORMAL = 1,
+  PRIO_HIGH = 2,
+  PRIO_URGENT = 3
+};
+
+// RequestClass: priority and deadline of a request.
+// A request not sent within deadline ms after it was queued is answered with REQUEST_EXPIRED (0: no deadline)
+struct RequestClass {
+  uint8_t priority;
+  uint32_t deadline;
+  explicit RequestClass(uint8_t p = PRIO_NORMAL, uint32_t d = 0) : priority(p), deadline(d) {}
+};
+
+// PriorityStats: how well priorities and deadlines were kept
+struct PriorityStats {
+  uint32_t inversions;        // requests that had to wait for one of lower priority being sent
+  uint32_t expired;           // requests dropped with REQUEST_EXPIRED
+  uint32_t late;              // requests answered after their deadline
+  PriorityStats() : inversions(0), expired(0), late(0) {}
+};
+
+// SyncSlot: completion object of a synchronous request.
+// The worker puts the response in, the waiting requester is woken up right away.
+// It is shared between both, so a requester giving up does not leave the worker with a dangling slot.
+class SyncSlot {
+public:
+  SyncSlot() : done(false) {}
+  // complete: store the response and wake up the requester
+  void complete(ModbusMessage r);
+  // wait: wait up to timeout ms for the response, which is moved into r. Returns false if none arrived in time
+  bool wait(uint32_t timeout, ModbusMessage& r);
+
+protected:
+  ModbusMessage response;          // The response, once done is set
+  bool done;                       // Response is there
+#if USE_MUTEX
+  std::mutex lock;                 // Protects response and done
+  std::condition_variable ready;   // Signalled by complete()
+#endif
+};
+typedef std::shared_ptr<SyncSlot> SyncSlotPtr;
+
 class ModbusClient {
 public:
   uint32_t getMessageCount();             // Informative: return number of messages created
   uint32_t getErrorCount();              // Informative: return number of errors received
   void resetCounts();                    // Set both message and error counts to zero
-  inline Error addRequest(ModbusMessage m, uint32_t token) { return addRequestM(m, token); }
-  inline ModbusMessage syncRequest(ModbusMessage m, uint32_t token) { return syncRequestM(m, token); }
+  inline Error addRequest(ModbusMessage m, uint32_t token) { return addRequestM(std::move(m), token); }
+  inline ModbusMessage syncRequest(ModbusMessage m, uint32_t token) { return syncRequestM(std::move(m), token); }
 
   // Template function to generate syncRequest functions as long as there is a 
   // matching ModbusMessage::setMessage() call
@@ -48,7 +94,7 @@ public:
 
     // Add it to the queue and wait for a response, if valid
     if (rc == SUCCESS) {
-      return syncRequestM(m, token);
+      return syncRequestM(std::move(m), token);
     } 
     // Else return the error as a message
     return buildErrorMsg(rc, std::forward<Args>(args) ...);
@@ -74,21 +120,53 @@ public:
 
     // Add it to the queue, if valid
     if (rc == SUCCESS) {
-      return addRequestM(m, token, handler);
+      return addRequestM(std::move(m), token, handler);
+    }
+    // Else return the error
+    return rc;
+  }
+
+  // addRequest with priority and deadline for a preformatted ModbusMessage
+  inline Error addRequest(RequestClass rclass, ModbusMessage m, uint32_t token, MBOnResponse handler = nullptr) {
+    return addRequestMC(std::move(m), token, handler, rclass);
+  }
+
+  // Template function to generate addRequest functions with priority and deadline:
+  //   MB.addRequest(RequestClass(PRIO_HIGH), token, handler, 1, WRITE_HOLD_REGISTER, 10, 42);
+  //   MB.addRequest(RequestClass(PRIO_LOW, 500), token, handler, 1, READ_HOLD_REGISTER, 0, 20);  // stale after 500ms
+  template <typename... Args>
+  Error addRequest(RequestClass rclass, uint32_t token, MBOnResponse handler, Args&&... args) {
+    Error rc = SUCCESS;        // Return value
+
+    // Create request, if valid
+    ModbusMessage m;
+    rc = m.setMessage(std::forward<Args>(args) ...);
+
+    // Add it to the queue, if valid
+    if (rc == SUCCESS) {
+      return addRequestMC(std::move(m), token, handler, rclass);
     }
     // Else return the error
     return rc;
   }
 
 protected:
+  friend class ModbusCoalescer;   // sends its requests through another client
+  friend class ModbusPoller;      // feeds its requests into clients
   ModbusClient();             // Default constructor
   ~ModbusClient();            // Default destructor
   virtual void isInstance() = 0;   // Make class abstract
-  ModbusMessage waitSync(uint8_t serverID, uint8_t functionCode, uint32_t token); // wait for syncRequest response to arrive
+  ModbusMessage waitSync(uint8_t serverID, uint8_t functionCode, SyncSlotPtr slot, uint32_t timeout); // wait for syncRequest response to arrive
   // Virtual addRequest variant needed internally. All others done by template!
   virtual Error addRequestM(ModbusMessage msg, uint32_t token, MBOnResponse handler = nullptr) = 0;
   // Virtual syncRequest variant following the same pattern
   virtual ModbusMessage syncRequestM(ModbusMessage msg, uint32_t token) = 0;
+  // addRequest variant with priority and deadline. Clients without a priority queue send in order.
+  // They can not drop a request waiting too long, so a deadline is refused with PARAMETER_LIMIT_ERROR
+  virtual Error addRequestMC(ModbusMessage msg, uint32_t token, MBOnResponse handler, RequestClass rclass) {
+    if (rclass.deadline) return PARAMETER_LIMIT_ERROR;
+    return addRequestM(std::move(msg), token, handler);
+  }
   // Prevent copy construction or assignment
   ModbusClient(ModbusClient& other) = delete;
   ModbusClient& operator=(ModbusClient& other) = delete;
@@ -101,9 +179,7 @@ protected:
   pthread_t worker;
 #endif
   static uint16_t instanceCounter; // Number of ModbusClients created
-  std::map<uint32_t, ModbusMessage> syncResponse; // Map to hold response messages on synchronous requests
 #if USE_MUTEX
-  std::mutex syncRespM;            // Mutex protecting syncResponse map against race conditions
   std::mutex countAccessM;         // Mutex protecting access to the message and error counts
 #endif
 };
@@ -4,21 +4,41 @@
 // =================================================================================================
 #include "ModbusClientRTU.h"
 
-#if HAS_FREERTOS
+#if HAS_FREERTOS || IS_LINUX
 
 #include "Logging.h"
 
 // Constructor takes an optional DE/RE pin and queue size
 ModbusClientRTU::ModbusClientRTU(int8_t rtsPin, uint16_t queueLimit) :
   ModbusClient(),
+  clearRequests(false),
+  requests(queueLimit),
   MR_serial(nullptr),
   MR_lastMicros(micros()),
   MR_interval(2000),
   MR_rtsPin(rtsPin),
   MR_qLimit(queueLimit),
+  MR_gapSum(0),
   MR_timeoutValue(DEFAULTTIMEOUT),
   MR_useASCII(false),
-  MR_skipLeadingZeroByte(false) {
+  MR_skipLeadingZeroByte(false),
+  MR_charTime(10000000000ULL / 19200),
+  MR_usePlanner(false),
+  MR_maxDelay(1000),
+  MR_current(0),
+  MR_planStart(millis()),
+  MR_classed(0),
+  MR_lastPriority(PRIO_NORMAL),
+  MR_lastDone(0),
+  MR_index(queueLimit) {
+#if IS_LINUX && !IS_RASPBERRY
+    // No GPIOs here - DE/RE has to be done by the driver, see HardwareSerial::setRS485()
+    if (MR_rtsPin >= 0) {
+      mb_log_w("RTS pin %d ignored - no GPIO access", MR_rtsPin);
+      MR_rtsPin = -1;
+    }
+    MTRSrts = RTUutils::RTSauto;
+#else
     if (MR_rtsPin >= 0) {
       pinMode(MR_rtsPin, OUTPUT);
       MTRSrts = [this](bool level) {
@@ -28,19 +48,32 @@ ModbusClientRTU::ModbusClientRTU(int8_t rtsPin, uint16_t queueLimit) :
     } else {
       MTRSrts = RTUutils::RTSauto;
     }
+#endif
 }
 
 // Alternative constructor takes an RTS callback function
 ModbusClientRTU::ModbusClientRTU(RTScallback rts, uint16_t queueLimit) :
   ModbusClient(),
+  clearRequests(false),
+  requests(queueLimit),
   MR_serial(nullptr),
   MR_lastMicros(micros()),
   MR_interval(2000),
   MTRSrts(rts),
   MR_qLimit(queueLimit),
+  MR_gapSum(0),
   MR_timeoutValue(DEFAULTTIMEOUT),
   MR_useASCII(false),
-  MR_skipLeadingZeroByte(false) {
+  MR_skipLeadingZeroByte(false),
+  MR_charTime(10000000000ULL / 19200),
+  MR_usePlanner(false),
+  MR_maxDelay(1000),
+  MR_current(0),
+  MR_planStart(millis()),
+  MR_classed(0),
+  MR_lastPriority(PRIO_NORMAL),
+  MR_lastDone(0),
+  MR_index(queueLimit) {
     MR_rtsPin = -1;
     MTRSrts(LOW);
 }
@@ -61,7 +94,9 @@ void ModbusClientRTU::begin(Stream& serial, uint32_t baudRate, int coreID) {
 void ModbusClientRTU::begin(HardwareSerial& serial, int coreID) {
   MR_serial = &serial;
   uint32_t baudRate = serial.baudRate();
+#if HAS_FREERTOS
   serial.setRxFIFOFull(1);
+#endif
   doBegin(baudRate, coreID);
 }
 
@@ -74,7 +109,17 @@ void ModbusClientRTU::doBegin(uint32_t baudRate, int coreID) {
 
   // Set minimum interval time
   MR_interval = RTUutils::calculateInterval(baudRate);
+  // Character time for the bus time predictions: 10 bits, like calculateInterval() assumes
+  if (baudRate) MR_charTime = 10000000000ULL / baudRate;
 
+#if IS_LINUX
+  int rc = pthread_create(&worker, NULL, &pHandle, this);
+  if (rc) {
+    mb_log_e("Error creating RTU client thread: %d", rc);
+  } else {
+    mb_log_d("RTU client worker started. Interval=%u", MR_interval);
+  }
+#else
   // Create unique task name
   char taskName[9];
   snprintf(taskName, 9, "MB%02XRTU", instanceCounter);
@@ -82,7 +127,15 @@ void ModbusClientRTU::doBegin(uint32_t baudRate, int coreID) {
   xTaskCreatePinnedToCore((TaskFunction_t)&handleConnection, taskName, CLIENT_TASK_STACK, this, 6, &worker, coreID >= 0 ? coreID : NULL);
 
   mb_log_d("Client task %u started. Interval=%u", (uint32_t)worker, MR_interval);
+#endif
+}
+
+#if IS_LINUX
+void *ModbusClientRTU::pHandle(void *p) {
+  handleConnection((ModbusClientRTU *)p);
+  return nullptr;
 }
+#endif
 
 // end: stop worker task
 void ModbusClientRTU::end() {
@@ -98,7 +151,11 @@ void ModbusClientRTU::end() {
     }
 #endif
     mb_log_d("Client task %u killed.", (uint32_t)worker);
+#if IS_LINUX
+    worker = 0;
+#else
     worker = nullptr;
+#endif
   }
 }
 
@@ -108,6 +165,45 @@ void ModbusClientRTU::setTimeout(uint32_t TOV) {
   mb_log_d("Timeout set to %u", TOV);
 }
 
+// getPriorityStats: get a copy of the priority and deadline statistics
+PriorityStats ModbusClientRTU::getPriorityStats() {
+  LOCK_GUARD(statsLock, countAccessM);
+  return MR_prio;
+}
+
+// resetPriorityStats: start over with the priority and deadline statistics
+void ModbusClientRTU::resetPriorityStats() {
+  LOCK_GUARD(statsLock, countAccessM);
+  MR_prio = PriorityStats();
+}
+
+// setAdaptiveTimeout: wait for each server as long as its learned response time suggests
+void ModbusClientRTU::setAdaptiveTimeout(bool onOff, uint32_t minTimeout) {
+  MR_health.setAdaptive(onOff, minTimeout);
+  mb_log_d("Adaptive timeout %s, min %u ms", onOff ? "ON" : "OFF", minTimeout);
+}
+
+// setQuarantine: refuse requests to servers not answering
+void ModbusClientRTU::setQuarantine(uint8_t failures, uint32_t probeInterval, uint32_t maxInterval) {
+  MR_health.setQuarantine(failures, probeInterval, maxInterval);
+  mb_log_d("Quarantine after %u timeouts, probe every %u..%u ms", failures, probeInterval, maxInterval);
+}
+
+// getHealth: learned response time and quarantine state of a server
+ServerHealth::Stats ModbusClientRTU::getHealth(uint8_t serverID) {
+  return MR_health.getStats(serverID, MR_timeoutValue);
+}
+
+// cancel: withdraw all requests with token that were not sent yet
+uint32_t ModbusClientRTU::cancel(uint32_t token) {
+  return MR_index.cancel(token);
+}
+
+// cancel_if: withdraw all requests not sent yet whose token fulfills predicate
+uint32_t ModbusClientRTU::cancel_if(std::function<bool(uint32_t token)> predicate) {
+  return MR_index.cancel_if(predicate);
+}
+
 // Toggle protocol to ModbusASCII
 void ModbusClientRTU::useModbusASCII(unsigned long timeout) {
   MR_useASCII = true;
@@ -137,6 +233,272 @@ uint32_t ModbusClientRTU::pendingRequests() {
   return requests.size();
 }
 
+// getStats: get a copy of the receive timing statistics
+ModbusClientRTU::RTUstats ModbusClientRTU::getStats() {
+  LOCK_GUARD(statsLock, countAccessM);
+  return MR_stats;
+}
+
+// resetStats: start over with the receive timing and bus time statistics
+void ModbusClientRTU::resetStats() {
+  LOCK_GUARD(statsLock, countAccessM);
+  MR_stats = RTUstats();
+  MR_gapSum = 0;
+  MR_plan = RTUplanStats();
+  MR_planStart = millis();
+}
+
+// usePlanner: pick the next request by predicted bus time instead of strictly in order
+void ModbusClientRTU::usePlanner(bool onOff, uint32_t maxDelay) {
+  MR_maxDelay = maxDelay;
+  MR_usePlanner = onOff;
+  mb_log_d("Planner %s, max delay %u ms", onOff ? "ON" : "OFF", maxDelay);
+}
+
+// getPlanStats: get a copy of the bus time statistics
+ModbusClientRTU::RTUplanStats ModbusClientRTU::getPlanStats() {
+  LOCK_GUARD(statsLock, countAccessM);
+  RTUplanStats st = MR_plan;
+  st.elapsed = millis() - MR_planStart;
+  if (st.elapsed) {
+    st.predictedLoad = st.predictedTime / 10 / st.elapsed;
+    st.actualLoad = st.actualTime / 10 / st.elapsed;
+    st.registersPerSecond = (uint64_t)st.registers * 1000 / st.elapsed;
+  }
+  return st;
+}
+
+// payload: number of registers a request moves, coils count as 1/16
+uint16_t ModbusClientRTU::payload(const ModbusMessage& msg) {
+  uint16_t count = 0;
+  switch (msg.getFunctionCode()) {
+  case READ_COIL:
+  case READ_DISCR_INPUT:
+  case WRITE_MULT_COILS:
+    msg.get(4, count);
+    return (count + 15) / 16;
+  case READ_HOLD_REGISTER:
+  case READ_INPUT_REGISTER:
+  case WRITE_MULT_REGISTERS:
+    msg.get(4, count);
+    return count;
+  case R_W_MULT_REGISTERS:
+    {
+      uint16_t writeCount = 0;
+      msg.get(4, count);
+      msg.get(8, writeCount);
+      return count + writeCount;
+    }
+  default:
+    return 1;
+  }
+}
+
+// predictTime: bus time in microseconds a request and its response will take.
+// That is the silent interval before each, both frames and the server's turnaround.
+uint32_t ModbusClientRTU::predictTime(const ModbusMessage& msg) {
+  uint32_t requestLength = msg.size() + 2;
+  uint32_t responseLength = 0;
+  uint16_t count = 0;
+
+  // Expected response length, CRC included
+  switch (msg.getFunctionCode()) {
+  case READ_COIL:
+  case READ_DISCR_INPUT:
+    msg.get(4, count);
+    responseLength = 5 + (count + 7) / 8;
+    break;
+  case READ_HOLD_REGISTER:
+  case READ_INPUT_REGISTER:
+  case R_W_MULT_REGISTERS:
+    msg.get(4, count);
+    responseLength = 5 + 2 * count;
+    break;
+  case WRITE_COIL:
+  case WRITE_HOLD_REGISTER:
+  case WRITE_MULT_COILS:
+  case WRITE_MULT_REGISTERS:
+    responseLength = 8;
+    break;
+  default:
+    // No idea - assume it is as long as the request
+    responseLength = requestLength;
+    break;
+  }
+
+  // ASCII sends each byte as two characters, plus ':' and CR LF. The LRC replaces the CRC
+  if (MR_useASCII) {
+    requestLength = requestLength * 2 + 1;
+    responseLength = responseLength * 2 + 1;
+  }
+
+  // Broadcasts get no response
+  if (msg.getServerID() == 0) {
+    return (uint64_t)requestLength * MR_charTime / 1000 + MR_interval;
+  }
+
+  // The learned response time runs from the end of the request to the end of the response.
+  // It was measured for the responses the server sent so far - if this one is longer, the
+  // frame length tells better. Without any answer yet assume the server replies at once.
+  uint32_t response = (uint64_t)responseLength * MR_charTime / 1000 + MR_interval;
+  uint32_t learned = MR_health.responseTime(msg.getServerID());
+  if (learned > response) response = learned;
+  return (uint64_t)requestLength * MR_charTime / 1000 + MR_interval + response;
+}
+
+// recordTime: update bus time statistics after a request.
+// The server's response time is learned by MR_health, predictTime() takes it from there.
+void ModbusClientRTU::recordTime(const ModbusMessage& request, uint32_t predicted, uint32_t actual) {
+  LOCK_GUARD(statsLock, countAccessM);
+  MR_plan.requests++;
+  MR_plan.predictedTime += predicted;
+  MR_plan.actualTime += actual;
+  MR_plan.registers += payload(request);
+}
+
+// nextRequest: the request to work on next, nullptr if there is none.
+// Cancelled requests are answered with REQUEST_CANCELLED on the way
+ModbusClientRTU::RequestEntry *ModbusClientRTU::nextRequest() {
+  while (RequestEntry *r = pickRequest()) {
+    if (MR_index.claim(r->ticket)) return r;
+    mb_log_d("Request %08X cancelled", r->token);
+    ModbusMessage response;
+    response.setError(r->msg.getServerID(), r->msg.getFunctionCode(), REQUEST_CANCELLED);
+    respond(*r, response);
+    removeRequest();
+  }
+  return nullptr;
+}
+
+// pickRequest: the request to look at next, cancelled or not
+ModbusClientRTU::RequestEntry *ModbusClientRTU::pickRequest() {
+  // Requests the planner holds already have to go first, even if it was switched off
+  if (MR_usePlanner || MR_classed || !MR_planned.empty()) return planNext();
+  return requests.front();
+}
+
+// requestDone: remove the request returned by nextRequest()
+void ModbusClientRTU::requestDone() {
+  MR_lastDone = millis();
+  MR_lastPriority = MR_planned.empty() ? requests.front()->priority : MR_planned[MR_current].priority;
+  removeRequest();
+}
+
+// removeRequest: take the request returned by nextRequest() out of the queue
+void ModbusClientRTU::removeRequest() {
+  if (!MR_planned.empty()) {
+    if (MR_planned[MR_current].classed()) MR_classed--;
+    MR_planned.erase(MR_planned.begin() + MR_current);
+    requests.release();
+  } else {
+    if (requests.front()->classed()) MR_classed--;
+    requests.pop();
+  }
+}
+
+// dropExpired: answer requests in MR_planned past their deadline with REQUEST_EXPIRED
+void ModbusClientRTU::dropExpired() {
+  unsigned long now = millis();
+  size_t i = 0;
+  while (i < MR_planned.size()) {
+    RequestEntry& r = MR_planned[i];
+    if (r.hasDeadline && (long)(now - r.expires) >= 0) {
+      mb_log_d("Request %08X expired", r.token);
+      // A cancelled request is answered as such
+      Error e = MR_index.claim(r.ticket) ? REQUEST_EXPIRED : REQUEST_CANCELLED;
+      ModbusMessage response;
+      response.setError(r.msg.getServerID(), r.msg.getFunctionCode(), e);
+      respond(r, response);
+      if (e == REQUEST_EXPIRED) {
+        LOCK_GUARD(statsLock, countAccessM);
+        MR_prio.expired++;
+      }
+      MR_classed--;
+      MR_planned.erase(MR_planned.begin() + i);
+      requests.release();
+    } else {
+      ++i;
+    }
+  }
+}
+
+// planNext: take all queued requests into MR_planned and pick the one to go next.
+// Only requests of the highest priority queued are candidates. Without the planner, the one
+// with the earliest deadline goes next - or the oldest, if none has a deadline.
+// With the planner, candidates are the oldest request of each server, up to the first broadcast.
+// A broadcast itself is a candidate only if it is the oldest one.
+// The one moving the most registers per predicted bus time wins - unless another one
+// would miss its latest start time (its deadline or queued + MR_maxDelay) by waiting for it.
+ModbusClientRTU::RequestEntry *ModbusClientRTU::planNext() {
+  // Take over all requests queued so far. They stay counted in the queue until done
+  while (RequestEntry *r = requests.front()) {
+    MR_planned.push_back(std::move(*r));
+    requests.take();
+  }
+  // Do not waste bus time on requests nobody is waiting for any more
+  dropExpired();
+  if (MR_planned.empty()) return nullptr;
+  uint8_t top = topPriority(MR_planned);
+
+  if (!MR_usePlanner) {
+    MR_current = earliestDeadline(MR_planned, top);
+  } else {
+    MR_current = planBest(top);
+  }
+
+  // Did it have to wait for a request of lower priority?
+  RequestEntry& r = MR_planned[MR_current];
+  if (r.priority > MR_lastPriority && (long)(MR_lastDone - r.queued) > 0) {
+    LOCK_GUARD(statsLock, countAccessM);
+    MR_prio.inversions++;
+  }
+  return &r;
+}
+
+// planBest: the planner's choice among the requests of priority top
+size_t ModbusClientRTU::planBest(uint8_t top) {
+  unsigned long now = millis();
+  bool seen[256] = { false };
+  size_t best = MR_planned.size();
+  size_t urgent = MR_planned.size();
+  uint64_t bestScore = 0;
+  int32_t urgentSlack = INT32_MAX;
+  uint32_t bestTime = 0;
+
+  for (size_t i = 0; i < MR_planned.size(); ++i) {
+    if (MR_planned[i].priority != top) continue;
+    const ModbusMessage& msg = MR_planned[i].msg;
+    uint8_t serverID = msg.getServerID();
+    // Only the oldest request of a server may go
+    if (seen[serverID]) continue;
+    seen[serverID] = true;
+    // A broadcast addresses all servers as well, so it has to wait for those before
+    if (serverID == 0 && best != MR_planned.size()) break;
+
+    uint32_t t = predictTime(msg);
+    // Registers per bus time, scaled to keep the fraction
+    uint64_t score = ((uint64_t)payload(msg) << 20) / (t ? t : 1);
+    if (best == MR_planned.size() || score > bestScore) {
+      best = i;
+      bestScore = score;
+      bestTime = t;
+    }
+    // Time left until the latest start
+    unsigned long latest = MR_planned[i].queued + MR_maxDelay;
+    if (MR_planned[i].hasDeadline && (long)(MR_planned[i].expires - latest) < 0) latest = MR_planned[i].expires;
+    int32_t slack = (int32_t)(latest - now);
+    if (slack < urgentSlack) {
+      urgent = i;
+      urgentSlack = slack;
+    }
+    // A broadcast addresses all servers, nothing behind it may be done before
+    if (serverID == 0) break;
+  }
+
+  // Would the most urgent one be late if the best one went first?
+  return (urgent != best && urgentSlack < (int32_t)(bestTime / 1000 + 1)) ? urgent : best;
+}
+
 // Base addRequest taking a preformatted data buffer and length as parameters
 Error ModbusClientRTU::addRequestM(ModbusMessage msg, uint32_t token, MBOnResponse handler) {
   Error rc = SUCCESS;        // Return value
@@ -146,7 +508,7 @@ Error ModbusClientRTU::addRequestM(ModbusMessage msg, uint32_t token, MBOnRespon
   // Add it to the queue, if valid
   if (msg) {
     // Queue add successful?
-    if (!addToQueue(token, msg, handler)) {
+    if (!addToQueue(token, std::move(msg), handler)) {
       // No. Return error after deleting the allocated request.
       rc = REQUEST_QUEUE_FULL;
     }
@@ -156,18 +518,47 @@ Error ModbusClientRTU::addRequestM(ModbusMessage msg, uint32_t token, MBOnRespon
   return rc;
 }
 
+// addRequest with priority and deadline
+Error ModbusClientRTU::addRequestMC(ModbusMessage msg, uint32_t token, MBOnResponse handler, RequestClass rclass) {
+  Error rc = SUCCESS;        // Return value
+
+  mb_log_d("request for %02X/%02X, priority %u, deadline %u", msg.getServerID(), msg.getFunctionCode(), rclass.priority, rclass.deadline);
+
+  // Add it to the queue, if valid
+  if (msg) {
+    // As long as it is queued, the worker has to look at all queued requests to find the next one
+    bool classed = rclass.priority != PRIO_NORMAL || rclass.deadline;
+    if (classed) MR_classed++;
+    // Queue add successful?
+    if (!addToQueue(token, std::move(msg), handler, nullptr, rclass)) {
+      // No. Return error
+      if (classed) MR_classed--;
+      rc = REQUEST_QUEUE_FULL;
+    }
+  }
+
+  mb_log_d("RC=%02X", rc);
+  return rc;
+}
+
 // Base syncRequest follows the same pattern
 ModbusMessage ModbusClientRTU::syncRequestM(ModbusMessage msg, uint32_t token) {
   ModbusMessage response;
 
   if (msg) {
+    uint8_t serverID = msg.getServerID();
+    uint8_t functionCode = msg.getFunctionCode();
+    SyncSlotPtr slot(new SyncSlot);
     // Queue add successful?
-    if (!addToQueue(token, msg, nullptr, true)) {
+    if (!addToQueue(token, std::move(msg), nullptr, slot)) {
       // No. Return error after deleting the allocated request.
-      response.setError(msg.getServerID(), msg.getFunctionCode(), REQUEST_QUEUE_FULL);
+      response.setError(serverID, functionCode, REQUEST_QUEUE_FULL);
     } else {
       // Request is queued - wait for the result.
-      response = waitSync(msg.getServerID(), msg.getFunctionCode(), token);
+      // Each request queued may take the timeout plus the time to transmit
+      // request and response of up to 256 bytes each. MR_interval is 3.5 character times in us.
+      uint32_t timeout = pendingRequests() * (MR_timeoutValue + MR_interval / 7 + 1);
+      response = waitSync(serverID, functionCode, slot, timeout);
     }
   } else {
     response.setError(msg.getServerID(), msg.getFunctionCode(), EMPTY_MESSAGE);
@@ -193,7 +584,7 @@ Error ModbusClientRTU::addBroadcastMessage(const uint8_t *data, uint8_t len) {
     msg.add(data, len);
 
     // Queue add successful?
-    if (!addToQueue(token, msg)) {
+    if (!addToQueue(token, std::move(msg))) {
       // No. Return error after deleting the allocated request.
       rc = REQUEST_QUEUE_FULL;
     }
@@ -207,16 +598,23 @@ Error ModbusClientRTU::addBroadcastMessage(const uint8_t *data, uint8_t len) {
 
 
 // addToQueue: send freshly created request to queue
-bool ModbusClientRTU::addToQueue(uint32_t token, ModbusMessage request, MBOnResponse handler, bool syncReq) {
+bool ModbusClientRTU::addToQueue(uint32_t token, ModbusMessage request, MBOnResponse handler, SyncSlotPtr slot, RequestClass rclass) {
   bool rc = false;
   // Did we get one?
   if (request) {
-    RequestEntry re(token, request, handler, syncReq);
-    if (requests.size()<MR_qLimit) {
-      // Yes. Safely lock queue and push request to queue
-      rc = true;
-      LOCK_GUARD(lockGuard, qLock);
-      requests.push(re);
+    // Yes. Push request to queue, if there is room left
+    RequestEntry re(token, std::move(request), handler, slot, rclass);
+    RequestIndex::Ticket ticket = MR_index.add(token);
+    // No slot left in the index? Then the queue is full as well
+    if (ticket.slot >= 0) {
+      re.ticket = ticket;
+      rc = requests.push(std::move(re));
+      // Only now it may be cancelled
+      if (rc) {
+        MR_index.queued(ticket);
+      } else {
+        MR_index.remove(ticket);
+      }
     }
     {
       LOCK_GUARD(cntLock, countAccessM);
@@ -237,11 +635,13 @@ void ModbusClientRTU::handleConnection(ModbusClientRTU *instance) {
 
   // Loop forever - or until task is killed
   while (1) {
+#if HAS_FREERTOS
     if (ulTaskNotifyTake(pdTRUE, 1) == STOP_NOTIFICATION_VALUE)
     {
       instance->_clearRequests(); // Ensure event handlers are called
       break;
     }
+#endif
     // Clear requests if requested
     if (instance->clearRequests)
     {
@@ -249,14 +649,28 @@ void ModbusClientRTU::handleConnection(ModbusClientRTU *instance) {
       instance->clearRequests = false;
     }
     // Do we have a reuest in queue?
-    if (!instance->requests.empty()) {
-      // Yes. pull it.
-      RequestEntry request = instance->requests.front();
+    if (RequestEntry *next = instance->nextRequest()) {
+      // Yes. Work on it in place - it stays in the queue until done.
+      RequestEntry& request = *next;
+      uint8_t serverID = request.msg.getServerID();
 
       mb_log_d("Pulled request from queue");
 
+      // Is the server in quarantine? Then do not waste bus time on it
+      if (serverID && !instance->MR_health.admit(serverID)) {
+        ModbusMessage response;
+        response.setError(serverID, request.msg.getFunctionCode(), SERVER_QUARANTINED);
+        instance->respond(request, response);
+        instance->requestDone();
+        continue;
+      }
+      uint32_t timeout = serverID ? instance->MR_health.timeout(serverID, instance->MR_timeoutValue) : instance->MR_timeoutValue;
+      uint32_t predicted = instance->predictTime(request.msg);
+      unsigned long started = micros();
+
       // Send it via Serial
       RTUutils::send(*(instance->MR_serial), instance->MR_lastMicros, instance->MR_interval, instance->MTRSrts, request.msg, instance->MR_useASCII);
+      unsigned long sent = micros();
 
       mb_log_d("Request sent.");
       mb_log_buf_v(request.msg.data(), request.msg.size());
@@ -264,14 +678,42 @@ void ModbusClientRTU::handleConnection(ModbusClientRTU *instance) {
       // For a broadcast, we will not wait for a response
       if (request.msg.getServerID() != 0 || ((request.token & 0xFF000000) != 0xBC000000)) {
         // This is a regular request, Get the response - if any
+        RTUtiming timing;
         ModbusMessage response = RTUutils::receive(
           'C',
           *(instance->MR_serial), 
-          instance->MR_timeoutValue, 
+          timeout,
           instance->MR_lastMicros, 
           instance->MR_interval, 
           instance->MR_useASCII,
-          instance->MR_skipLeadingZeroByte);
+          instance->MR_skipLeadingZeroByte,
+          &timing,
+          instance->MR_rxBuffer);
+
+        // Learn the server's response time - or note it did not answer
+        if (serverID) {
+          if (response.size() == 1 && response[0] == TIMEOUT) {
+            instance->MR_health.failure(serverID);
+          } else {
+            instance->MR_health.success(serverID, micros() - sent);
+          }
+        }
+
+        // Compare the time the request took with the prediction
+        instance->recordTime(request.msg, predicted, micros() - started);
+
+        // Did we get a frame? Then record its timing
+        if (timing.length) {
+          LOCK_GUARD(statsLock, instance->countAccessM);
+          RTUstats& st = instance->MR_stats;
+          st.frames++;
+          st.lastGap = timing.gap;
+          if (st.frames == 1 || timing.gap < st.minGap) st.minGap = timing.gap;
+          if (timing.gap > st.maxGap) st.maxGap = timing.gap;
+          if (timing.charGap > st.maxCharGap) st.maxCharGap = timing.charGap;
+          instance->MR_gapSum += timing.gap;
+          st.avgGap = instance->MR_gapSum / st.frames;
+        }
   
         mb_log_d("%s response (%u bytes) received.", response.size()>1 ? "Data" : "Error", response.size());
         mb_log_buf_v(response.data(), response.size());
@@ -297,52 +739,64 @@ void ModbusClientRTU::handleConnection(ModbusClientRTU *instance) {
         mb_log_d("Response generated.");
         mb_log_buf_v(response.data(), response.size());
 
-        // If we got an error, count it
-        if (response.getError() != SUCCESS) {
-          instance->errorCount++;
-        }
-  
-        // Was it a synchronous request?
-        if (request.isSyncRequest) {
-          // Yes. Put it into the response map
-          {
-            LOCK_GUARD(sL, instance->syncRespM);
-            instance->syncResponse[request.token] = response;
-          }
-        // No, an async request. Do we have an onResponse handler?
-        } else if (request.responseHandler) {
-          // Yes. Call it
-          request.responseHandler(response, request.token);
-        } else {
-          mb_log_w("No response handler.");
-        }
-      }
-      // Clean-up time. 
-      {
-        // Safely lock the queue
-        LOCK_GUARD(lockGuard, instance->qLock);
-        // Remove the front queue entry
-        instance->requests.pop();
+        // Hand it over to the requester
+        instance->respond(request, response);
+      } else {
+        instance->recordTime(request.msg, predicted, micros() - started);
       }
+      // Clean-up time. Remove the queue entry
+      instance->requestDone();
     } else {
       delay(1);
     }
   }
+#if HAS_FREERTOS
   vTaskDelete(NULL);
+#endif
+}
+
+// respond: hand over a response to the requester - sync response slot or onResponse handler
+void ModbusClientRTU::respond(RequestEntry& request, ModbusMessage& response) {
+  {
+    LOCK_GUARD(responseCnt, countAccessM);
+    // If we got an error, count it
+    if (response.getError() != SUCCESS) errorCount++;
+    // Was it sent, but answered too late?
+    if (request.hasDeadline && response.getError() != REQUEST_EXPIRED && (long)(millis() - request.expires) > 0) {
+      MR_prio.late++;
+    }
+  }
+  // Was it a synchronous request?
+  if (request.syncSlot) {
+    // Yes. Wake up the requester
+    request.syncSlot->complete(std::move(response));
+  // No, an async request. Do we have an onResponse handler?
+  } else if (request.responseHandler) {
+    // Yes. Call it
+    request.responseHandler(std::move(response), request.token);
+  } else {
+    mb_log_w("No response handler.");
+  }
 }
 
 void ModbusClientRTU::_clearRequests()
 {
-  LOCK_GUARD(lockGuard, qLock);
-  while (!requests.empty())
+  while (RequestEntry *next = nextRequest())
   {
     ModbusMessage response;
-    RequestEntry request = requests.front();
+    RequestEntry& request = *next;
     response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), QUEUE_CLEARED);
-    request.responseHandler(response, request.token);
-    messageCount--;
-    requests.pop();
+    if (request.syncSlot) {
+      request.syncSlot->complete(response);
+    } else if (request.responseHandler) {
+      request.responseHandler(response, request.token);
+    }
+    {
+      LOCK_GUARD(cntLock, countAccessM);
+      messageCount--;
+    }
+    requestDone();
   }
 }
 
-#endif  // HAS_FREERTOS
+#endif  // HAS_FREERTOS || IS_LINUX
@@ -7,16 +7,19 @@
 
 #include "options.h"
 
-#if HAS_FREERTOS
+#if HAS_FREERTOS || IS_LINUX
 
 #include "ModbusClient.h"
 #include "Stream.h"
+#if IS_LINUX
+#include "HardwareSerial.h"
+#endif
 #include "RTUutils.h"
-#include <queue>
+#include "RequestQueue.h"
+#include "ServerHealth.h"
+#include "RequestIndex.h"
 #include <vector>
 
-using std::queue;
-
 #define DEFAULTTIMEOUT 2000
 
 class ModbusClientRTU : public ModbusClient {
@@ -65,54 +68,170 @@ public:
   // addBroadcastMessage: create a fire-and-forget message to all servers on the RTU bus
   Error addBroadcastMessage(const uint8_t *data, uint8_t len);
 
+  // Receive timing statistics, all times in microseconds
+  struct RTUstats {
+    uint32_t frames;            // frames received
+    uint32_t lastGap;           // silence after the last byte until the frame end was detected
+    uint32_t minGap;            // shortest of these
+    uint32_t maxGap;            // longest of these
+    uint32_t avgGap;            // average of these
+    uint32_t maxCharGap;        // longest pause between two bytes within a frame
+    RTUstats() : frames(0), lastGap(0), minGap(0), maxGap(0), avgGap(0), maxCharGap(0) {}
+  };
+
+  // getStats: get a copy of the receive timing statistics
+  RTUstats getStats();
+
+  // resetStats: start over with the receive timing and bus time statistics
+  void resetStats();
+
+  // usePlanner: pick the next request by predicted bus time instead of strictly in order.
+  // Requests with the most registers per bus time go first, but none is held back longer
+  // than maxDelay ms. Requests to the same server keep their order.
+  void usePlanner(bool onOff = true, uint32_t maxDelay = 1000);
+
+  // Bus time statistics, with or without planner. Times in microseconds
+  struct RTUplanStats {
+    uint32_t requests;          // requests done
+    uint64_t predictedTime;     // bus time predicted for these
+    uint64_t actualTime;        // bus time they took
+    uint32_t registers;         // registers (or coils, rounded up to 16) read or written
+    uint32_t elapsed;           // time since the statistics were reset, in ms
+    uint16_t predictedLoad;     // percentage of elapsed time the bus was predicted to be busy
+    uint16_t actualLoad;        // percentage of elapsed time the bus was busy
+    uint32_t registersPerSecond; // registers moved per second of elapsed time
+    RTUplanStats() : requests(0), predictedTime(0), actualTime(0), registers(0), elapsed(0),
+      predictedLoad(0), actualLoad(0), registersPerSecond(0) {}
+  };
+
+  // getPlanStats: get a copy of the bus time statistics
+  RTUplanStats getPlanStats();
+
+  // predictTime: bus time in microseconds a request and its response will take
+  uint32_t predictTime(const ModbusMessage& msg);
+
+  // getPriorityStats: get a copy of the priority and deadline statistics
+  PriorityStats getPriorityStats();
+
+  // resetPriorityStats: start over with the priority and deadline statistics
+  void resetPriorityStats();
+
+  // setAdaptiveTimeout: wait for each server as long as its learned response time suggests,
+  // but not shorter than minTimeout and not longer than the timeout set by setTimeout()
+  void setAdaptiveTimeout(bool onOff = true, uint32_t minTimeout = 20);
+
+  // setQuarantine: refuse requests to a server with SERVER_QUARANTINED after failures
+  // timeouts in a row (0: never). It is probed after probeInterval ms, doubling up to maxInterval
+  void setQuarantine(uint8_t failures = 3, uint32_t probeInterval = 1000, uint32_t maxInterval = 60000);
+
+  // getHealth: learned response time and quarantine state of a server
+  ServerHealth::Stats getHealth(uint8_t serverID);
+
+  // cancel: withdraw all requests with token that were not sent yet. They will be answered
+  // with REQUEST_CANCELLED instead. Returns the number of requests cancelled
+  uint32_t cancel(uint32_t token);
+
+  // cancel_if: same for all requests not sent yet whose token fulfills predicate.
+  // predicate is called with the request index locked and must not use the client
+  uint32_t cancel_if(std::function<bool(uint32_t token)> predicate);
+
 protected:
   struct RequestEntry {
     uint32_t token;
     ModbusMessage msg;
     MBOnResponse responseHandler;
-    bool isSyncRequest;
-    RequestEntry(uint32_t t, ModbusMessage m, MBOnResponse r, bool syncReq = false) :
+    SyncSlotPtr syncSlot;       // Completion slot of a synchronous request, empty else
+    unsigned long queued;       // millis() when the request was queued
+    unsigned long expires;      // millis() the deadline ends, if there is one
+    uint8_t priority;           // Requests with higher priority go first
+    bool hasDeadline;           // expires is valid
+    RequestIndex::Ticket ticket; // Slot in MR_index
+    RequestEntry(uint32_t t, ModbusMessage m, MBOnResponse r, SyncSlotPtr slot = nullptr, RequestClass c = RequestClass()) :
       token(t),
-      msg(m),
+      msg(std::move(m)),
       responseHandler(r),
-      isSyncRequest(syncReq) {}
+      syncSlot(slot),
+      queued(millis()),
+      expires(queued + c.deadline),
+      priority(c.priority),
+      hasDeadline(c.deadline != 0) {}
+    // classed: request has a priority or deadline
+    bool classed() const { return priority != PRIO_NORMAL || hasDeadline; }
   };
 
   // Base addRequest and syncRequest must be present
   Error addRequestM(ModbusMessage msg, uint32_t token, MBOnResponse handler = nullptr);
   ModbusMessage syncRequestM(ModbusMessage msg, uint32_t token);
+  Error addRequestMC(ModbusMessage msg, uint32_t token, MBOnResponse handler, RequestClass rclass);
 
   // addToQueue: send freshly created request to queue
-  bool addToQueue(uint32_t token, ModbusMessage msg, MBOnResponse handler = nullptr, bool syncReq = false);
+  bool addToQueue(uint32_t token, ModbusMessage msg, MBOnResponse handler = nullptr, SyncSlotPtr slot = nullptr, RequestClass rclass = RequestClass());
 
   // handleConnection: worker task method
   static void handleConnection(ModbusClientRTU *instance);
+#if IS_LINUX
+  static void *pHandle(void *p);
+#endif
 
   // receive: get response via Serial
   ModbusMessage receive(const ModbusMessage request);
 
+  // nextRequest: the request to work on next, nullptr if there is none
+  RequestEntry *nextRequest();
+  // requestDone: remove the request returned by nextRequest()
+  void requestDone();
+  // removeRequest: take the request returned by nextRequest() out of the queue
+  void removeRequest();
+  // pickRequest: the request to look at next, cancelled or not
+  RequestEntry *pickRequest();
+  // planNext: take all queued requests into MR_planned and pick the one to go next
+  RequestEntry *planNext();
+  // planBest: the planner's choice among the requests of priority top
+  size_t planBest(uint8_t top);
+  // dropExpired: answer requests in MR_planned past their deadline with REQUEST_EXPIRED
+  void dropExpired();
+  // payload: number of registers a request moves, coils count as 1/16
+  static uint16_t payload(const ModbusMessage& msg);
+  // recordTime: update bus time statistics after a request
+  void recordTime(const ModbusMessage& request, uint32_t predicted, uint32_t actual);
+  // respond: hand over a response to the requester
+  void respond(RequestEntry& request, ModbusMessage& response);
+
   // start background task
   void doBegin(uint32_t baudRate, int coreID);
 
   void isInstance() { return; }   // make class instantiable
   bool clearRequests;             // Bool to indicate requests must be cleared
   void _clearRequests();          // Helper function to clear requests from queue, calling response handler
-  queue<RequestEntry> requests;   // Queue to hold requests to be processed
-  #if USE_MUTEX
-  mutex qLock;                    // Mutex to protect queue
-  #endif
+  RequestQueue<RequestEntry> requests; // Queue to hold requests to be processed
   Stream *MR_serial;              // Ptr to the serial interface used
   unsigned long MR_lastMicros;    // Microseconds since last bus activity
   uint32_t MR_interval;           // Modbus RTU bus quiet time
   int8_t MR_rtsPin;               // GPIO pin to toggle RS485 DE/RE line. -1 if none.
   RTScallback MTRSrts;            // RTS line callback function
   uint16_t MR_qLimit;             // Maximum number of requests to hold in the queue
+  uint8_t MR_rxBuffer[RTU_RXBUFSIZE]; // Receive buffer, reused for every response
+  RTUstats MR_stats;              // Receive timing statistics
+  uint64_t MR_gapSum;             // Sum of all gaps measured, for the average
   uint32_t MR_timeoutValue;       // Interface default timeout
   bool MR_useASCII;               // true=ModbusASCII, false=ModbusRTU
   bool MR_skipLeadingZeroByte;    // true=skip the first byte if it is 0x00, false=accept all bytes
+  uint32_t MR_charTime;           // Time of a character on the bus in ns
+  bool MR_usePlanner;             // true=pick requests by bus time, false=FIFO
+  uint32_t MR_maxDelay;           // Longest time in ms the planner may hold back a request
+  std::vector<RequestEntry> MR_planned; // Requests taken from the queue by the planner. Worker only
+  size_t MR_current;              // Index in MR_planned of the request worked on
+  RTUplanStats MR_plan;           // Bus time statistics
+  unsigned long MR_planStart;     // millis() the bus time statistics were started
+  ServerHealth MR_health;         // Learned response times and quarantined servers
+  std::atomic<uint32_t> MR_classed; // Requests with priority or deadline not done yet - pick from MR_planned
+  PriorityStats MR_prio;          // Priority and deadline statistics
+  uint8_t MR_lastPriority;        // Priority of the request done last
+  unsigned long MR_lastDone;      // millis() the last request was done
+  RequestIndex MR_index;          // Requests queued by token, to cancel them
 
 };
 
-#endif  // HAS_FREERTOS
+#endif  // HAS_FREERTOS || IS_LINUX
 
 #endif  // INCLUDE GUARD
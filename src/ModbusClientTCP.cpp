@@ -11,24 +11,52 @@
 // Constructor takes reference to Client (EthernetClient or WiFiClient)
 ModbusClientTCP::ModbusClientTCP(Client& client, uint16_t queueLimit) :
   ModbusClient(),
+  requests(queueLimit),
+  clearRequests(false),
   MT_client(client),
   MT_lastTarget(IPAddress(0, 0, 0, 0), 0, DEFAULTTIMEOUT, TARGETHOSTINTERVAL),
   MT_target(IPAddress(0, 0, 0, 0), 0, DEFAULTTIMEOUT, TARGETHOSTINTERVAL),
   MT_defaultTimeout(DEFAULTTIMEOUT),
   MT_defaultInterval(TARGETHOSTINTERVAL),
-  MT_qLimit(queueLimit)
-  { }
+  MT_qLimit(queueLimit),
+  MT_maxInflight(1),
+  MT_poolSize(1),
+  MT_maxConnections(MAXPOOLSIZE),
+  MT_current(0),
+  MT_idleTimeout(0),
+  MT_pick(0),
+  MT_classed(0),
+  MT_lastPriority(PRIO_NORMAL),
+  MT_lastDone(0),
+  MT_index(queueLimit)
+  {
+    MT_pool[0].client = &client;
+  }
 
 // Alternative Constructor takes reference to Client (EthernetClient or WiFiClient) plus initial target host
 ModbusClientTCP::ModbusClientTCP(Client& client, IPAddress host, uint16_t port, uint16_t queueLimit) :
   ModbusClient(),
+  requests(queueLimit),
+  clearRequests(false),
   MT_client(client),
   MT_lastTarget(IPAddress(0, 0, 0, 0), 0, DEFAULTTIMEOUT, TARGETHOSTINTERVAL),
   MT_target(host, port, DEFAULTTIMEOUT, TARGETHOSTINTERVAL),
   MT_defaultTimeout(DEFAULTTIMEOUT),
   MT_defaultInterval(TARGETHOSTINTERVAL),
-  MT_qLimit(queueLimit)
-  { }
+  MT_qLimit(queueLimit),
+  MT_maxInflight(1),
+  MT_poolSize(1),
+  MT_maxConnections(MAXPOOLSIZE),
+  MT_current(0),
+  MT_idleTimeout(0),
+  MT_pick(0),
+  MT_classed(0),
+  MT_lastPriority(PRIO_NORMAL),
+  MT_lastDone(0),
+  MT_index(queueLimit)
+  {
+    MT_pool[0].client = &client;
+  }
 
 // Destructor: clean up queue, task etc.
 ModbusClientTCP::~ModbusClientTCP() {
@@ -49,7 +77,11 @@ void ModbusClientTCP::end() {
     }
 #endif
   mb_log_d("TCP client worker killed.");
+#if IS_LINUX
+  worker = 0;
+#else
   worker = nullptr;
+#endif
   }
 }
 
@@ -90,6 +122,53 @@ void ModbusClientTCP::setTimeout(uint32_t timeout, uint32_t interval) {
   MT_defaultInterval = interval;
 }
 
+// setAdaptiveTimeout: wait for each server as long as its learned response time suggests
+void ModbusClientTCP::setAdaptiveTimeout(bool onOff, uint32_t minTimeout) {
+  MT_health.setAdaptive(onOff, minTimeout);
+  mb_log_d("Adaptive timeout %s, min %u ms", onOff ? "ON" : "OFF", minTimeout);
+}
+
+// setQuarantine: refuse requests to servers not answering
+void ModbusClientTCP::setQuarantine(uint8_t failures, uint32_t probeInterval, uint32_t maxInterval) {
+  MT_health.setQuarantine(failures, probeInterval, maxInterval);
+  mb_log_d("Quarantine after %u failures, probe every %u..%u ms", failures, probeInterval, maxInterval);
+}
+
+// getHealth: learned response time and quarantine state of a server
+ServerHealth::Stats ModbusClientTCP::getHealth(IPAddress host, uint16_t port, uint8_t serverID) {
+  TargetHost target(host, port, MT_defaultTimeout, MT_defaultInterval);
+  // The current target may have a timeout of its own
+  if (target == MT_target) target.timeout = MT_target.timeout;
+  return MT_health.getStats(healthKey(target, serverID), target.timeout);
+}
+
+// cancel: withdraw all requests with token that were not sent yet
+uint32_t ModbusClientTCP::cancel(uint32_t token) {
+  return MT_index.cancel(token);
+}
+
+// cancel_if: withdraw all requests not sent yet whose token fulfills predicate
+uint32_t ModbusClientTCP::cancel_if(std::function<bool(uint32_t token)> predicate) {
+  return MT_index.cancel_if(predicate);
+}
+
+// healthKey: identify a server at a target in MT_health
+uint64_t ModbusClientTCP::healthKey(const TargetHost& target, uint8_t serverID) {
+  return ((uint64_t)target.host[0] << 48) | ((uint64_t)target.host[1] << 40) | ((uint64_t)target.host[2] << 32)
+    | ((uint64_t)target.host[3] << 24) | ((uint64_t)target.port << 8) | serverID;
+}
+
+// learn: update the server's health data with the outcome of a request, us after it was sent
+void ModbusClientTCP::learn(RequestEntry& request, const ModbusMessage& response, uint32_t us) {
+  uint64_t key = healthKey(request.target, request.msg.getServerID());
+  Error e = response.getError();
+  if (e == TIMEOUT || e == IP_CONNECTION_FAILED) {
+    MT_health.failure(key);
+  } else {
+    MT_health.success(key, us);
+  }
+}
+
 // Switch target host (if necessary)
 // Return true, if host/port is different from last host/port used
 bool ModbusClientTCP::setTarget(IPAddress host, uint16_t port, uint32_t timeout, uint32_t interval) {
@@ -102,7 +181,43 @@ bool ModbusClientTCP::setTarget(IPAddress host, uint16_t port, uint32_t timeout,
   return true;
 }
 
-// Return number of unprocessed requests in queue
+// Set number of requests allowed on the wire to the same target at the same time.
+// 1 is the classic request-response mode, larger values will pipeline requests
+// and match the responses by their transactionID. Requests on the wire when the
+// window is made smaller are still answered before new ones are sent.
+void ModbusClientTCP::setMaxInflightRequests(uint8_t maxInflight) {
+  if (maxInflight < 1) maxInflight = 1;
+  if (maxInflight > MAXINFLIGHT) maxInflight = MAXINFLIGHT;
+  MT_maxInflight = maxInflight;
+  mb_log_d("Max in-flight requests set to %u", maxInflight);
+}
+
+// Add another Client to the connection pool.
+// Must be done before begin(), returns false if the pool is full.
+bool ModbusClientTCP::addPoolClient(Client& client) {
+  if (worker || MT_poolSize >= MAXPOOLSIZE) {
+    mb_log_e("Cannot add pool client");
+    return false;
+  }
+  MT_pool[MT_poolSize++].client = &client;
+  mb_log_d("Connection pool size %u", MT_poolSize);
+  return true;
+}
+
+// Limit the number of connections open at the same time
+void ModbusClientTCP::setMaxConnections(uint8_t maxConnections) {
+  if (maxConnections < 1) maxConnections = 1;
+  if (maxConnections > MAXPOOLSIZE) maxConnections = MAXPOOLSIZE;
+  MT_maxConnections = maxConnections;
+  mb_log_d("Max connections set to %u", maxConnections);
+}
+
+// Close pooled connections not used for idleTimeout ms (0: keep them open)
+void ModbusClientTCP::setIdleTimeout(uint32_t idleTimeout) {
+  MT_idleTimeout = idleTimeout;
+}
+
+// Return number of unprocessed requests in queue - including those in flight
 uint32_t ModbusClientTCP::pendingRequests() {
   return requests.size();
 }
@@ -114,7 +229,7 @@ Error ModbusClientTCP::addRequestM(ModbusMessage msg, uint32_t token, MBOnRespon
   // Add it to the queue, if valid
   if (msg) {
     // Queue add successful?
-    if (!addToQueue(token, msg, MT_target, handler)) {
+    if (!addToQueue(token, std::move(msg), MT_target, handler)) {
       // No. Return error after deleting the allocated request.
       rc = REQUEST_QUEUE_FULL;
     }
@@ -124,6 +239,27 @@ Error ModbusClientTCP::addRequestM(ModbusMessage msg, uint32_t token, MBOnRespon
   return rc;
 }
 
+// addRequest with priority and deadline for last set target
+Error ModbusClientTCP::addRequestMC(ModbusMessage msg, uint32_t token, MBOnResponse handler, RequestClass rclass) {
+  Error rc = SUCCESS;        // Return value
+
+  // Add it to the queue, if valid
+  if (msg) {
+    // As long as it is queued, the worker has to look at all queued requests to find the next one
+    bool classed = rclass.priority != PRIO_NORMAL || rclass.deadline;
+    if (classed) MT_classed++;
+    // Queue add successful?
+    if (!addToQueue(token, std::move(msg), MT_target, handler, nullptr, rclass)) {
+      // No. Return error
+      if (classed) MT_classed--;
+      rc = REQUEST_QUEUE_FULL;
+    }
+  }
+
+  mb_log_d("Add TCP request result: %02X", rc);
+  return rc;
+}
+
 // TCP addRequest for preformatted ModbusMessage and adhoc target
 Error ModbusClientTCP::addRequestMT(ModbusMessage msg, uint32_t token, IPAddress targetHost, uint16_t targetPort, MBOnResponse handler) {
   Error rc = SUCCESS;        // Return value
@@ -133,7 +269,7 @@ Error ModbusClientTCP::addRequestMT(ModbusMessage msg, uint32_t token, IPAddress
     // Set up adhoc target 
     TargetHost adhocTarget(targetHost, targetPort, MT_defaultTimeout, MT_defaultInterval);
     // Queue add successful?
-    if (!addToQueue(token, msg, adhocTarget, handler, true)) {
+    if (!addToQueue(token, std::move(msg), adhocTarget, handler)) {
       // No. Return error after deleting the allocated request.
       rc = REQUEST_QUEUE_FULL;
     }
@@ -148,13 +284,16 @@ ModbusMessage ModbusClientTCP::syncRequestM(ModbusMessage msg, uint32_t token) {
   ModbusMessage response;
 
   if (msg) {
+    uint8_t serverID = msg.getServerID();
+    uint8_t functionCode = msg.getFunctionCode();
+    SyncSlotPtr slot(new SyncSlot);
     // Queue add successful?
-    if (!addToQueue(token, msg, MT_target, nullptr, true)) {
+    if (!addToQueue(token, std::move(msg), MT_target, nullptr, slot)) {
       // No. Return error after deleting the allocated request.
-      response.setError(msg.getServerID(), msg.getFunctionCode(), REQUEST_QUEUE_FULL);
+      response.setError(serverID, functionCode, REQUEST_QUEUE_FULL);
     } else {
       // Request is queued - wait for the result.
-      response = waitSync(msg.getServerID(), msg.getFunctionCode(), token);
+      response = waitSync(serverID, functionCode, slot, syncTimeout(MT_target));
     }
   } else {
     response.setError(msg.getServerID(), msg.getFunctionCode(), EMPTY_MESSAGE);
@@ -169,13 +308,16 @@ ModbusMessage ModbusClientTCP::syncRequestMT(ModbusMessage msg, uint32_t token,
   if (msg) {
     // Set up adhoc target 
     TargetHost adhocTarget(targetHost, targetPort, MT_defaultTimeout, MT_defaultInterval);
+    uint8_t serverID = msg.getServerID();
+    uint8_t functionCode = msg.getFunctionCode();
+    SyncSlotPtr slot(new SyncSlot);
     // Queue add successful?
-    if (!addToQueue(token, msg, adhocTarget, nullptr, true)) {
+    if (!addToQueue(token, std::move(msg), adhocTarget, nullptr, slot)) {
       // No. Return error after deleting the allocated request.
-      response.setError(msg.getServerID(), msg.getFunctionCode(), REQUEST_QUEUE_FULL);
+      response.setError(serverID, functionCode, REQUEST_QUEUE_FULL);
     } else {
       // Request is queued - wait for the result.
-      response = waitSync(msg.getServerID(), msg.getFunctionCode(), token);
+      response = waitSync(serverID, functionCode, slot, syncTimeout(adhocTarget));
     }
   } else {
     response.setError(msg.getServerID(), msg.getFunctionCode(), EMPTY_MESSAGE);
@@ -183,227 +325,511 @@ ModbusMessage ModbusClientTCP::syncRequestMT(ModbusMessage msg, uint32_t token,
   return response;
 }
 
+// syncTimeout: longest time a synchronous request to target may take in the worker.
+// Each request queued up to now may use up the timeout and the interval.
+uint32_t ModbusClientTCP::syncTimeout(TargetHost &target) {
+  return pendingRequests() * (target.timeout + target.interval);
+}
+
 // addToQueue: send freshly created request to queue
-bool ModbusClientTCP::addToQueue(uint32_t token, ModbusMessage request, TargetHost &target, MBOnResponse handler, bool syncReq) {
+bool ModbusClientTCP::addToQueue(uint32_t token, ModbusMessage request, TargetHost &target, MBOnResponse handler, SyncSlotPtr slot, RequestClass rclass) {
   bool rc = false;
   // Did we get one?
-  mb_log_d("Queue size: %d", (uint32_t)requests.size());
+  mb_log_d("Queue size: %d", requests.size());
   mb_log_buf_d(request.data(), request.size());
-  if (request) {
-    if (requests.size()<MT_qLimit) {
-      RequestEntry re(token, request, handler, target, syncReq);
+  // Room left? A lost race for the last place in push() will only skip a transactionID
+  if (request && requests.size() < MT_qLimit) {
+    RequestEntry re(token, std::move(request), handler, target, slot, rclass);
+    {
       // inject proper transactionID
+      LOCK_GUARD(cntLock, countAccessM);
       re.head.transactionID = messageCount++;
-      re.head.len = request.size();
-      // Safely lock queue and push request to queue
-      rc = true;
-      LOCK_GUARD(lockGuard, qLock);
-      requests.push(re);
+    }
+    re.head.len = re.msg.size();
+    RequestIndex::Ticket ticket = MT_index.add(token);
+    // No slot left in the index? Then the queue is full as well
+    if (ticket.slot >= 0) {
+      re.ticket = ticket;
+      // Push request to queue, if there is room left
+      rc = requests.push(std::move(re));
+      // Only now it may be cancelled
+      if (rc) {
+        MT_index.queued(ticket);
+      } else {
+        MT_index.remove(ticket);
+      }
     }
   }
 
   return rc;
 }
 
+// nextRequest: the request to work on next, nullptr if there is none.
+// Cancelled requests are answered with REQUEST_CANCELLED on the way.
+// With only given, a request to another target is left alone - and can still be cancelled
+ModbusClientTCP::RequestEntry *ModbusClientTCP::nextRequest(const TargetHost *only) {
+  while (RequestEntry *r = pickRequest()) {
+    if (only && r->target != *only) return nullptr;
+    if (MT_index.claim(r->ticket)) return r;
+    mb_log_d("Request %08X cancelled", r->token);
+    ModbusMessage response;
+    response.setError(r->msg.getServerID(), r->msg.getFunctionCode(), REQUEST_CANCELLED);
+    respond(*r, response);
+    if (r->classed()) MT_classed--;
+    if (MT_waiting.empty()) {
+      requests.pop();
+    } else {
+      MT_waiting.erase(MT_waiting.begin() + MT_pick);
+      requests.release();
+    }
+  }
+  return nullptr;
+}
+
+// pickRequest: the request to look at next, cancelled or not.
+// While requests with priority or deadline are queued, all are taken into MT_waiting.
+// Those of the highest priority are candidates, the one with the earliest deadline goes
+// next - or the oldest, if none has a deadline.
+ModbusClientTCP::RequestEntry *ModbusClientTCP::pickRequest() {
+  if (!MT_classed && MT_waiting.empty()) return requests.front();
+  // Take over all requests queued so far. They stay counted in the queue until released
+  while (RequestEntry *r = requests.front()) {
+    MT_waiting.push_back(std::move(*r));
+    requests.take();
+  }
+  // Do not waste time on requests nobody is waiting for any more
+  dropExpired();
+  if (MT_waiting.empty()) return nullptr;
+  MT_pick = earliestDeadline(MT_waiting, topPriority(MT_waiting));
+  return &MT_waiting[MT_pick];
+}
+
+// takeRequest: remove the request returned by nextRequest(). It stays counted until released
+void ModbusClientTCP::takeRequest() {
+  if (MT_waiting.empty()) {
+    if (requests.front()->classed()) MT_classed--;
+    requests.take();
+    return;
+  }
+  // Did it have to wait for a request of lower priority?
+  RequestEntry& r = MT_waiting[MT_pick];
+  if (r.priority > MT_lastPriority && (long)(MT_lastDone - r.queued) > 0) {
+    LOCK_GUARD(statsLock, countAccessM);
+    MT_prio.inversions++;
+  }
+  if (r.classed()) MT_classed--;
+  MT_waiting.erase(MT_waiting.begin() + MT_pick);
+}
+
+// requestDone: remove the request returned by nextRequest() for good
+void ModbusClientTCP::requestDone() {
+  takeRequest();
+  requests.release();
+}
+
+// dropExpired: answer requests in MT_waiting past their deadline with REQUEST_EXPIRED
+void ModbusClientTCP::dropExpired() {
+  unsigned long now = millis();
+  size_t i = 0;
+  while (i < MT_waiting.size()) {
+    RequestEntry& r = MT_waiting[i];
+    if (r.hasDeadline && (long)(now - r.expires) >= 0) {
+      mb_log_d("Request %08X expired", r.token);
+      // A cancelled request is answered as such
+      Error e = MT_index.claim(r.ticket) ? REQUEST_EXPIRED : REQUEST_CANCELLED;
+      ModbusMessage response;
+      response.setError(r.msg.getServerID(), r.msg.getFunctionCode(), e);
+      respond(r, response);
+      if (e == REQUEST_EXPIRED) {
+        LOCK_GUARD(statsLock, countAccessM);
+        MT_prio.expired++;
+      }
+      MT_classed--;
+      MT_waiting.erase(MT_waiting.begin() + i);
+      requests.release();
+    } else {
+      ++i;
+    }
+  }
+}
+
+// getPriorityStats: get a copy of the priority and deadline statistics
+PriorityStats ModbusClientTCP::getPriorityStats() {
+  LOCK_GUARD(statsLock, countAccessM);
+  return MT_prio;
+}
+
+// resetPriorityStats: start over with the priority and deadline statistics
+void ModbusClientTCP::resetPriorityStats() {
+  LOCK_GUARD(statsLock, countAccessM);
+  MT_prio = PriorityStats();
+}
+
 // handleConnection: worker task
 // This was created in begin() to handle the queue entries
 void ModbusClientTCP::handleConnection(ModbusClientTCP *instance) {
   bool doNotPop;
-  unsigned long lastRequest = millis();
 
   // Loop forever - or until task is killed
   while (1) {
+#if HAS_FREERTOS
     if (ulTaskNotifyTake(pdTRUE, 1) == STOP_NOTIFICATION_VALUE)
     {
       instance->_clearRequests(); // Ensure event handlers are called
       break;
     }
+#endif
     // Clear requests if requested
     if (instance->clearRequests)
     {
       instance->_clearRequests();
       instance->clearRequests = false;
     }
-    // Do we have a request in queue?
-    if (!instance->requests.empty()) {
-      // Yes. pull it.
-      RequestEntry request = instance->requests.front();
+    // Pipelined mode - or requests left in flight from it?
+    if (instance->MT_maxInflight > 1 || !instance->MT_inflight.empty()) {
+      // Yes. Let pipeline() do the work. It will not add requests beyond the window
+      instance->pipeline();
+    // No, classic mode. Do we have a request in queue?
+    } else if (RequestEntry *next = instance->nextRequest()) {
+      // Yes. Work on it in place - it stays in the queue until done.
+      RequestEntry& request = *next;
       doNotPop = false;
       mb_log_d("Got request from queue");
 
-      // Do we have a connection open?
-      if (instance->MT_client.connected()) {
-        // Empty the RX buffer in case there is a stray response left
-        while (instance->MT_client.read() != -1) {}
-        // check if lastHost/lastPort!=host/port off the queued request
-        if (instance->MT_lastTarget != request.target) {
-          // It is different. Disconnect it.
-          instance->MT_client.stop();
-          mb_log_d("Target different, disconnect");
-          delay(1);  // Give scheduler room to breathe
-        } else {
-          // it is the same host/port.
-          // Give it some slack to get ready again
-          while (millis() - lastRequest < request.target.interval) { delay(1); }
-        }
+      // Is the server in quarantine? Then do not waste time on it
+      if (!instance->MT_health.admit(healthKey(request.target, request.msg.getServerID()))) {
+        ModbusMessage response;
+        response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), SERVER_QUARANTINED);
+        instance->respond(request, response);
+        instance->requestDone();
+        continue;
       }
-      // if client is disconnected (we will have to switch hosts)
-      if (!instance->MT_client.connected()) {
-        // Serial.println("Client reconnecting");
-        // It is disconnected. connect to host/port from queue
-        instance->MT_client.connect(request.target.host, request.target.port);
-        mb_log_d("Target connect (%d.%d.%d.%d:%d).", request.target.host[0], request.target.host[1], request.target.host[2], request.target.host[3], request.target.port);
-
-        delay(1);  // Give scheduler room to breathe
+      request.target.timeout = instance->MT_health.timeout(healthKey(request.target, request.msg.getServerID()), request.target.timeout);
+
+      // Get a connection to the target - a pooled one, if there is any
+      instance->useConnection(request.target);
+      PoolSlot& slot = instance->MT_pool[instance->MT_current];
+      // Was it open already?
+      if (slot.lastUsed && slot.client->connected()) {
+        // Empty the RX buffer in case there is a stray response left
+        while (slot.client->available()) { slot.client->read(); }
+        instance->MT_framer.reset();
+        // Give it some slack to get ready again
+        while (millis() - slot.lastUsed < request.target.interval) { delay(1); }
       }
       ModbusMessage response;
       // Are we connected (again)?
-      if (instance->MT_client.connected()) {
+      if (slot.client->connected()) {
         mb_log_d("Is connected. Send request.");
         // Yes. Send the request via IP
         instance->send(request);
+        unsigned long sent = micros();
 
         // Get the response - if any
         response = instance->receive(request);
+        instance->learn(request, response, micros() - sent);
 
-        // Did we get a normal response?
-        if (response.getError()==SUCCESS) {
-          mb_log_d("Data response.");
-          // Yes. Is it a synchronous request?
-          if (request.isSyncRequest) {
-            // Yes. Put the response into the response map
-            {
-              LOCK_GUARD(sL, instance->syncRespM);
-              instance->syncResponse[request.token] = response;
-            }
-          // No, async request. Do we have an onResponse handler?
-          } else if (request.responseHandler) {
-            // Yes. Call it.
-            request.responseHandler(response, request.token);
-          } else {
-            mb_log_d("No response handler.");
-          }
-        } else {
-          // No, something went wrong. All we have is an error
-          mb_log_d("Error response.");
-          // Count it
-          {
-            LOCK_GUARD(responseCnt, instance->countAccessM);
-            instance->errorCount++;
-          }
-          // Is it a synchronous request?
-          if (request.isSyncRequest) {
-            // Yes. Put the response into the response map
-            {
-              LOCK_GUARD(sL, instance->syncRespM);
-              instance->syncResponse[request.token] = response;
-            }
-          // No, but do we have an onResponse handler?
-          } else if (request.responseHandler) {
-            // Yes, call it.
-            request.responseHandler(response, request.token);
-          } else {
-            mb_log_d("No response handler");
-          }
-        }
+        // Hand it over to the requester
+        instance->respond(request, response);
         //   set lastHost/lastPort tp host/port
         instance->MT_lastTarget = request.target;
       } else {
         // Oops. Connection failed
         response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), IP_CONNECTION_FAILED);
+        instance->learn(request, response, 0);
         // Stop client
-        instance->MT_client.stop();
-        // Is it a synchronous request?
-        if (request.isSyncRequest) {
-          // Yes. Put the response into the response map
-          {
-            LOCK_GUARD(sL, instance->syncRespM);
-            instance->syncResponse[request.token] = response;
-          }
-        // No, but do we have an onResponse handler?
-        } else if (request.responseHandler) {
-          // Yes, call it.
-          request.responseHandler(response, request.token);
-          instance->clearRequests = true;
-        }
+        slot.client->stop();
+        // Asynchronous requests behind it will not get through either
+        if (!request.syncSlot && request.responseHandler) instance->clearRequests = true;
+        // Hand over the response
+        instance->respond(request, response);
       }
       // Clean-up time. 
       if (!doNotPop)
       {
-        // Safely lock the queue
-        LOCK_GUARD(lockGuard, instance->qLock);
-        // Remove the front queue entry
-        instance->requests.pop();
+        // Remove the queue entry
+        instance->requestDone();
         mb_log_d("Request popped from queue.");
       }
-      lastRequest = millis();
+      slot.lastUsed = millis();
     } else {
       delay(1);  // Give scheduler room to breathe
     }
+    // Drop connections not needed any more
+    instance->closeIdle();
   }
+#if HAS_FREERTOS
   vTaskDelete(NULL);
+#endif
+}
+
+// respond: hand over a response to the requester - sync response slot or onResponse handler
+void ModbusClientTCP::respond(RequestEntry& request, ModbusMessage& response) {
+  {
+    LOCK_GUARD(responseCnt, countAccessM);
+    // Did we get a normal response?
+    if (response.getError() == SUCCESS) {
+      mb_log_d("Data response.");
+    } else {
+      // No, something went wrong. All we have is an error
+      mb_log_d("Error response.");
+      // Count it
+      errorCount++;
+    }
+    // Was it sent, but answered too late?
+    if (request.hasDeadline && response.getError() != REQUEST_EXPIRED && (long)(millis() - request.expires) > 0) {
+      MT_prio.late++;
+    }
+  }
+  MT_lastPriority = request.priority;
+  MT_lastDone = millis();
+  // Is it a synchronous request?
+  if (request.syncSlot) {
+    // Yes. Wake up the requester
+    request.syncSlot->complete(std::move(response));
+  // No, async request. Do we have an onResponse handler?
+  } else if (request.responseHandler) {
+    // Yes. Call it.
+    request.responseHandler(std::move(response), request.token);
+  } else {
+    mb_log_d("No response handler.");
+  }
+}
+
+// pipeline: worker step in pipelined mode.
+// Requests to the same target are sent without waiting for the previous response, until
+// MT_maxInflight requests are on the wire. Responses are matched by their transactionID.
+void ModbusClientTCP::pipeline() {
+  bool busy = false;
+
+  // Fill the in-flight window
+  RequestEntry *pick;
+  // Requests in flight already? Then only the same target may be added
+  while (MT_inflight.size() < MT_maxInflight
+      && (pick = nextRequest(MT_inflight.empty() ? nullptr : &MT_lastTarget)) != nullptr) {
+    RequestEntry& next = *pick;
+    busy = true;
+
+    // Is the server in quarantine? Then do not waste a connection attempt on it
+    uint64_t key = healthKey(next.target, next.msg.getServerID());
+    if (!MT_health.admit(key)) {
+      ModbusMessage response;
+      response.setError(next.msg.getServerID(), next.msg.getFunctionCode(), SERVER_QUARANTINED);
+      respond(next, response);
+      requestDone();
+      continue;
+    }
+
+    // Nothing in flight - switch to a connection to the target
+    if (MT_inflight.empty()) {
+      useConnection(next.target);
+      MT_lastTarget = next.target;
+    }
+
+    // Move the entry to MT_inflight - it stays counted until answered
+    MT_inflight.push_back(std::move(next));
+    takeRequest();
+    RequestEntry& request = MT_inflight.back();
+    request.target.timeout = MT_health.timeout(key, request.target.timeout);
+
+    // Connection failed?
+    if (!activeClient().connected()) {
+      // Yes. Report the failure for this request.
+      ModbusMessage response;
+      response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), IP_CONNECTION_FAILED);
+      activeClient().stop();
+      learn(request, response, 0);
+      respond(request, response);
+      MT_inflight.pop_back();
+      requests.release();
+      continue;
+    }
+
+    // Send the request and keep it in flight
+    send(request);
+    request.sentTime = millis();
+    MT_pool[MT_current].lastUsed = request.sentTime;
+    mb_log_d("Request %04X in flight (%u)", request.head.transactionID, (uint32_t)MT_inflight.size());
+  }
+
+  // Collect all responses that have arrived completely
+  ModbusTCPhead head;
+  ModbusMessage response;
+  if (!MT_inflight.empty() && MT_framer.pull(activeClient())) {
+    busy = true;
+    Error e;
+    while ((e = MT_framer.next(head, response)) == SUCCESS) {
+      // Look for the request with this transactionID
+      auto it = MT_inflight.begin();
+      while (it != MT_inflight.end() && it->head.transactionID != head.transactionID) ++it;
+      if (it == MT_inflight.end()) {
+        // Unknown - may be a late answer to a timed-out request
+        mb_log_w("Discarding response with unknown transactionID %04X", head.transactionID);
+        continue;
+      }
+      // Do server ID and function code match the request?
+      if (response.getServerID() != it->msg.getServerID()) {
+        response.setError(it->msg.getServerID(), it->msg.getFunctionCode(), SERVER_ID_MISMATCH);
+      } else if ((response.getFunctionCode() & 0x7F) != it->msg.getFunctionCode()) {
+        response.setError(it->msg.getServerID(), it->msg.getFunctionCode(), FC_MISMATCH);
+      }
+      learn(*it, response, (millis() - it->sentTime) * 1000);
+      respond(*it, response);
+      MT_inflight.erase(it);
+      requests.release();
+    }
+    // Garbage on the line?
+    if (e == TCP_HEAD_MISMATCH) {
+      // Yes. We have lost the frame sync, so all requests in flight are lost as well.
+      mb_log_e("Invalid MBAP header, dropping connection.");
+      while (!MT_inflight.empty()) {
+        RequestEntry& request = MT_inflight.front();
+        response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), TCP_HEAD_MISMATCH);
+        respond(request, response);
+        MT_inflight.pop_front();
+        requests.release();
+      }
+      activeClient().stop();
+      MT_framer.reset();
+    }
+  }
+
+  // Check for timeouts and lost connections
+  bool lost = !MT_inflight.empty() && !activeClient().connected();
+  auto it = MT_inflight.begin();
+  while (it != MT_inflight.end()) {
+    if (lost || millis() - it->sentTime >= it->target.timeout) {
+      response.setError(it->msg.getServerID(), it->msg.getFunctionCode(), lost ? IP_CONNECTION_FAILED : TIMEOUT);
+      learn(*it, response, 0);
+      respond(*it, response);
+      it = MT_inflight.erase(it);
+      requests.release();
+      busy = true;
+    } else {
+      ++it;
+    }
+  }
+  if (lost) activeClient().stop();
+
+  if (!busy) delay(1);  // Give scheduler room to breathe
+}
+
+// useConnection: make the pooled connection to target the active one.
+// Preference is a connection to the target already open, then an unused slot,
+// and finally the least recently used connection, that will be closed for it.
+void ModbusClientTCP::useConnection(TargetHost& target) {
+  int use = -1;
+  uint8_t limit = poolLimit();
+  // Is there a connection to the target already?
+  for (uint8_t i = 0; i < limit; ++i) {
+    if (MT_pool[i].target == target && MT_pool[i].client->connected()) {
+      use = i;
+      break;
+    }
+  }
+  // No. Is there an unused slot?
+  if (use < 0) {
+    for (uint8_t i = 0; i < limit; ++i) {
+      if (!MT_pool[i].client->connected()) {
+        use = i;
+        break;
+      }
+    }
+  }
+  // No. Take the one used least recently
+  if (use < 0) {
+    use = 0;
+    for (uint8_t i = 1; i < limit; ++i) {
+      if (MT_pool[i].lastUsed < MT_pool[use].lastUsed) use = i;
+    }
+    MT_pool[use].client->stop();
+    mb_log_d("Pool full, disconnect slot %d", use);
+    delay(1);  // Give scheduler room to breathe
+  }
+  PoolSlot& slot = MT_pool[use];
+  // Any leftovers belong to the previous connection
+  if (use != MT_current) MT_framer.reset();
+  MT_current = use;
+  // Not connected yet? Do it.
+  if (!slot.client->connected()) {
+    slot.client->connect(target.host, target.port);
+    slot.lastUsed = 0;
+    MT_framer.reset();
+    mb_log_d("Target connect (%d.%d.%d.%d:%d).", target.host[0], target.host[1], target.host[2], target.host[3], target.port);
+    delay(1);  // Give scheduler room to breathe
+  }
+  slot.target = target;
+}
+
+// closeIdle: disconnect pooled connections not used for MT_idleTimeout or above the limit
+void ModbusClientTCP::closeIdle() {
+  unsigned long now = millis();
+  uint8_t limit = poolLimit();
+  for (uint8_t i = 0; i < MT_poolSize; ++i) {
+    PoolSlot& slot = MT_pool[i];
+    // Leave alone unused slots and the one with requests in flight
+    if (!slot.target.port || (i == MT_current && !MT_inflight.empty())) continue;
+    if (i >= limit || (MT_idleTimeout && now - slot.lastUsed >= MT_idleTimeout)) {
+      slot.client->stop();
+      slot.target.port = 0;
+      mb_log_d("Idle connection in slot %d closed", i);
+    }
+  }
 }
 
 // send: send request via Client connection
-void ModbusClientTCP::send(RequestEntry request) {
+void ModbusClientTCP::send(RequestEntry& request) {
   // We have a established connection here, so we can write right away.
-  // Move tcpHead and request into one continuous buffer, since the very first request tends to 
-  // take too long to be sent to be recognized.
-  ModbusMessage m;
-  m.add((const uint8_t *)request.head, 6);
-  m.append(request.msg);
+  // Put tcpHead into the headroom in front of the request to have one continuous buffer,
+  // since the very first request tends to take too long to be sent to be recognized.
+  uint8_t *frame = request.msg.headroom();
+  memcpy(frame, (const uint8_t *)request.head, 6);
 
-  MT_client.write(m.data(), m.size());
+  activeClient().write(frame, request.msg.size() + 6);
   // Done. Are we?
-  MT_client.flush();
-  mb_log_buf_v(m.data(), m.size());
+  activeClient().flush();
+  mb_log_buf_v(frame, request.msg.size() + 6);
 }
 
 // receive: get response via Client connection
-ModbusMessage ModbusClientTCP::receive(RequestEntry request) {
+ModbusMessage ModbusClientTCP::receive(RequestEntry& request) {
   unsigned long lastMillis = millis();     // Timer to check for timeout
-  bool hadData = false;               // flag data received
-  const uint16_t dataLen(300);        // Modbus Packet supposedly will fit (260<300)
-  uint8_t data[dataLen];              // Local buffer to collect received data
-  uint16_t dataPtr = 0;               // Pointer into data
   ModbusMessage response;             // Response structure to be returned
-
-  // wait for packet data, overflow or timeout
-  while (millis() - lastMillis < request.target.timeout && dataPtr < dataLen && !hadData) {
-    // Is there data waiting?
-    if (MT_client.available()) {
-      // Yes. catch as much as is there and fits into buffer
-      while (MT_client.available() && dataPtr < dataLen) {
-        data[dataPtr++] = MT_client.read();
-      }
-      // Register data received
-      hadData = true;
-      // Rewind EOT and timeout timers
+  ModbusTCPhead head;                 // Header of the received packet
+  Error e = EMPTY_MESSAGE;            // Framing result
+
+  // wait for a complete packet, garbage or timeout
+  while (millis() - lastMillis < request.target.timeout) {
+    e = MT_framer.next(head, response);
+    if (e != EMPTY_MESSAGE) break;
+    // Need more data. Is there some waiting?
+    if (MT_framer.pull(activeClient())) {
+      // Yes. Rewind timeout timer
       lastMillis = millis();
+    } else {
+      delay(1); // Give scheduler room to breathe
     }
-    delay(1); // Give scheduler room to breathe
   }
-  // Did we get some data?
-  if (hadData) {
+  // Did we get a packet?
+  if (e == SUCCESS) {
     mb_log_d("Received response.");
-    mb_log_buf_v(data, dataPtr);
+    mb_log_buf_v(response.data(), response.size());
     // Yes. check it for validity
-    // First transactionID and protocolID shall be identical, length has to match the remainder.
-    ModbusTCPhead head(request.head.transactionID, request.head.protocolID, dataPtr - 6);
-    // Matching head?
-    if (memcmp((const uint8_t *)head, data, 6)) {
+    // First transactionID and protocolID shall be identical to the request's
+    if (head.transactionID != request.head.transactionID || head.protocolID != request.head.protocolID) {
       // No. return Error response
       response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), TCP_HEAD_MISMATCH);
       // If the server id does not match that of the request, report error
-    } else if (data[6] != request.msg.getServerID()) {
+    } else if (response.getServerID() != request.msg.getServerID()) {
       response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), SERVER_ID_MISMATCH);
       // If the function code does not match that of the request, report error
-    } else if ((data[7] & 0x7F) != request.msg.getFunctionCode()) {
+    } else if ((response.getFunctionCode() & 0x7F) != request.msg.getFunctionCode()) {
       response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), FC_MISMATCH);
-    } else {
-      // Looks good.
-      response.add(data + 6, dataPtr - 6);
     }
+  } else if (e == TCP_HEAD_MISMATCH) {
+    // Garbage received - drop it
+    MT_framer.reset();
+    response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), TCP_HEAD_MISMATCH);
   } else {
     // No, timeout must have struck
     response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), TIMEOUT);
@@ -412,17 +838,67 @@ ModbusMessage ModbusClientTCP::receive(RequestEntry request) {
   return response;
 }
 
+// ModbusTCPframer::pull: read what the Client has available, as far as it fits
+uint16_t ModbusClientTCP::ModbusTCPframer::pull(Client& client) {
+  int avail = client.available();
+  if (avail <= 0 || !room()) return 0;
+  if (avail > room()) avail = room();
+  int got = client.read(tail(), avail);
+  if (got <= 0) return 0;
+  added(got);
+  return got;
+}
+
+// ModbusTCPframer::next: extract the next complete packet from the buffer
+Error ModbusClientTCP::ModbusTCPframer::next(ModbusTCPhead& head, ModbusMessage& pdu) {
+  // Header complete?
+  if (fill < 6) return EMPTY_MESSAGE;
+  head.transactionID = (buffer[0] << 8) | buffer[1];
+  head.protocolID = (buffer[2] << 8) | buffer[3];
+  head.len = (buffer[4] << 8) | buffer[5];
+  // Sane header? Protocol must be Modbus, length must fit serverID, FC and at most 252 more bytes
+  if (head.protocolID != 0 || head.len < 2 || head.len > 254) {
+    mb_log_buf_e(buffer, 6);
+    return TCP_HEAD_MISMATCH;
+  }
+  // Packet complete?
+  uint16_t frameLen = 6 + head.len;
+  if (fill < frameLen) return EMPTY_MESSAGE;
+  // Yes. Hand out the PDU and keep the rest for the next call
+  pdu.clear();
+  pdu.add(buffer + 6, head.len);
+  fill -= frameLen;
+  if (fill) memmove(buffer, buffer + frameLen, fill);
+  return SUCCESS;
+}
+
 void ModbusClientTCP::_clearRequests()
 {
-  LOCK_GUARD(lockGuard, qLock);
-  while (!requests.empty())
+  // Requests in flight will not get their responses any more
+  while (!MT_inflight.empty())
   {
     ModbusMessage response;
-    RequestEntry request = requests.front();
+    RequestEntry& request = MT_inflight.front();
     response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), QUEUE_CLEARED);
-    request.responseHandler(response, request.token);
-    messageCount--;
-    requests.pop();
+    respond(request, response);
+    MT_inflight.pop_front();
+    requests.release();
+  }
+  while (RequestEntry *next = nextRequest())
+  {
+    ModbusMessage response;
+    RequestEntry& request = *next;
+    response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), QUEUE_CLEARED);
+    if (request.syncSlot) {
+      request.syncSlot->complete(response);
+    } else if (request.responseHandler) {
+      request.responseHandler(response, request.token);
+    }
+    {
+      LOCK_GUARD(cntLock, countAccessM);
+      messageCount--;
+    }
+    requestDone();
   }
 }
 
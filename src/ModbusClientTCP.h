@@ -14,14 +14,19 @@
 
 #include "ModbusClient.h"
 #include "Client.h"
-#include <queue>
+#include "RequestQueue.h"
+#include "ServerHealth.h"
+#include "RequestIndex.h"
+#include <list>
 #include <vector>
-using std::queue;
 
 #define TARGETHOSTINTERVAL 10
 #define DEFAULTTIMEOUT 2000
+#define MAXINFLIGHT 16
+#define MAXPOOLSIZE 8
 
 class ModbusClientTCP : public ModbusClient {
+  friend class ModbusClientTCPepoll;
 public:
   // Constructor takes reference to Client (EthernetClient or WiFiClient)
   explicit ModbusClientTCP(Client& client, uint16_t queueLimit = 50);
@@ -44,9 +49,49 @@ public:
   // Switch target host (if necessary)
   bool setTarget(IPAddress host, uint16_t port, uint32_t timeout = 0, uint32_t interval = 0);
 
+  // Set number of requests allowed on the wire to the same target at the same time (pipelining)
+  void setMaxInflightRequests(uint8_t maxInflight = 1);
+
+  // Add another Client to the connection pool. Each Client holds one persistent connection,
+  // so the pool size caps the number of targets connected at the same time
+  bool addPoolClient(Client& client);
+
+  // Limit the number of connections open at the same time to maxConnections, 1 up to the
+  // number of Clients in the pool. Connections above the limit are closed by the worker
+  void setMaxConnections(uint8_t maxConnections = MAXPOOLSIZE);
+
+  // Close pooled connections not used for idleTimeout ms (0: keep them open)
+  void setIdleTimeout(uint32_t idleTimeout = 0);
+
+  // setAdaptiveTimeout: wait for each server as long as its learned response time suggests,
+  // but not shorter than minTimeout and not longer than the target's timeout
+  void setAdaptiveTimeout(bool onOff = true, uint32_t minTimeout = 20);
+
+  // setQuarantine: refuse requests to a server with SERVER_QUARANTINED after failures
+  // timeouts or failed connections in a row (0: never). It is probed after probeInterval ms,
+  // doubling up to maxInterval
+  void setQuarantine(uint8_t failures = 3, uint32_t probeInterval = 1000, uint32_t maxInterval = 60000);
+
+  // getHealth: learned response time and quarantine state of a server
+  ServerHealth::Stats getHealth(IPAddress host, uint16_t port, uint8_t serverID);
+
+  // cancel: withdraw all requests with token that were not sent yet. They will be answered
+  // with REQUEST_CANCELLED instead. Returns the number of requests cancelled
+  uint32_t cancel(uint32_t token);
+
+  // cancel_if: same for all requests not sent yet whose token fulfills predicate.
+  // predicate is called with the request index locked and must not use the client
+  uint32_t cancel_if(std::function<bool(uint32_t token)> predicate);
+
   // Return number of unprocessed requests in queue
   uint32_t pendingRequests();
 
+  // getPriorityStats: get a copy of the priority and deadline statistics
+  PriorityStats getPriorityStats();
+
+  // resetPriorityStats: start over with the priority and deadline statistics
+  void resetPriorityStats();
+
   // Remove all pending request from queue
   inline void clearQueue()
   {
@@ -61,7 +106,7 @@ protected:
     uint32_t      timeout;      // Time in ms waiting for a response
     uint32_t      interval;     // Time in ms to wait between requests
     
-    inline TargetHost& operator=(TargetHost& t) {
+    inline TargetHost& operator=(const TargetHost& t) {
       host = t.host;
       port = t.port;
       timeout = t.timeout;
@@ -69,7 +114,7 @@ protected:
       return *this;
     }
     
-    inline TargetHost(TargetHost& t) :
+    inline TargetHost(const TargetHost& t) :
       host(t.host),
       port(t.port),
       timeout(t.timeout),
@@ -89,13 +134,13 @@ protected:
       interval(interval)
     { }
 
-    inline bool operator==(TargetHost& t) {
+    inline bool operator==(const TargetHost& t) {
       if (host != t.host) return false;
       if (port != t.port) return false;
       return true;
     }
 
-    inline bool operator!=(TargetHost& t) {
+    inline bool operator!=(const TargetHost& t) {
       if (host != t.host) return true;
       if (port != t.port) return true;
       return false;
@@ -130,7 +175,7 @@ protected:
       return headRoom;
     }
 
-    inline ModbusTCPhead& operator= (ModbusTCPhead& t) {
+    inline ModbusTCPhead& operator= (const ModbusTCPhead& t) {
       transactionID = t.transactionID;
       protocolID    = t.protocolID;
       len           = t.len;
@@ -141,31 +186,96 @@ protected:
     uint8_t headRoom[6];        // Buffer to hold MSB-first TCP header
   };
 
+  // class reassembling MBAP-framed packets from a TCP byte stream.
+  // The 6-byte header is read first, then exactly the number of bytes it announces.
+  // Bytes of a following packet are kept for the next call.
+  class ModbusTCPframer {
+  public:
+    ModbusTCPframer() : fill(0) {}
+
+    // Drop all bytes collected so far
+    inline void reset() { fill = 0; }
+
+    // Free space in the buffer and address to receive data into directly
+    inline uint16_t room() const { return sizeof(buffer) - fill; }
+    inline uint8_t *tail() { return buffer + fill; }
+    inline void added(uint16_t count) { fill += count; }
+
+    // pull: read what the Client has available, as far as it fits. Returns number of bytes read
+    uint16_t pull(Client& client);
+
+    // next: extract the next complete packet.
+    // Returns SUCCESS if one was found, EMPTY_MESSAGE if more data is needed
+    // and TCP_HEAD_MISMATCH if the stream does not start with a valid header.
+    Error next(ModbusTCPhead& head, ModbusMessage& pdu);
+
+  protected:
+    uint8_t buffer[520];        // Room for two maximum-sized packets
+    uint16_t fill;              // Number of bytes in buffer
+  };
+
+  // class holding one pooled connection
+  struct PoolSlot {
+    Client *client;             // Client holding the connection
+    TargetHost target;          // Target connected to
+    unsigned long lastUsed;     // millis() of last request sent on it
+    PoolSlot() : client(nullptr), lastUsed(0) {}
+  };
+
   struct RequestEntry {
     uint32_t token;
     ModbusMessage msg;
     MBOnResponse responseHandler;
-    TargetHost &target;
+    TargetHost target;          // Copy - the caller's TargetHost may change or vanish
     ModbusTCPhead head;
-    bool isSyncRequest;
-    RequestEntry(uint32_t t, ModbusMessage m, MBOnResponse r, TargetHost &tg, bool syncReq = false) :
+    SyncSlotPtr syncSlot;       // Completion slot of a synchronous request, empty else
+    unsigned long sentTime;     // millis() the request was sent at
+    unsigned long queued;       // millis() when the request was queued
+    unsigned long expires;      // millis() the deadline ends, if there is one
+    uint8_t priority;           // Requests with higher priority go first
+    bool hasDeadline;           // expires is valid
+    RequestIndex::Ticket ticket; // Slot in MT_index
+    RequestEntry(uint32_t t, ModbusMessage m, MBOnResponse r, const TargetHost &tg, SyncSlotPtr slot = nullptr, RequestClass c = RequestClass()) :
       token(t),
-      msg(m),
+      msg(std::move(m)),
       responseHandler(r),
       target(tg),
       head(ModbusTCPhead()),
-      isSyncRequest(syncReq) {}
+      syncSlot(slot),
+      sentTime(0),
+      queued(millis()),
+      expires(queued + c.deadline),
+      priority(c.priority),
+      hasDeadline(c.deadline != 0) {}
+    // classed: request has a priority or deadline
+    bool classed() const { return priority != PRIO_NORMAL || hasDeadline; }
   };
 
   // Base addRequest and syncRequest must be present
   Error addRequestM(ModbusMessage msg, uint32_t token, MBOnResponse handler = nullptr);
   ModbusMessage syncRequestM(ModbusMessage msg, uint32_t token);
+  Error addRequestMC(ModbusMessage msg, uint32_t token, MBOnResponse handler, RequestClass rclass);
   // TCP-specific addition "...MT()" including adhoc target - used by bridge 
   Error addRequestMT(ModbusMessage msg, uint32_t token, IPAddress targetHost, uint16_t targetPort, MBOnResponse handler = nullptr);
   ModbusMessage syncRequestMT(ModbusMessage msg, uint32_t token, IPAddress targetHost, uint16_t targetPort);
 
   // addToQueue: send freshly created request to queue
-  bool addToQueue(uint32_t token, ModbusMessage request, TargetHost &target, MBOnResponse handler = nullptr, bool syncReq = false);
+  bool addToQueue(uint32_t token, ModbusMessage request, TargetHost &target, MBOnResponse handler = nullptr, SyncSlotPtr slot = nullptr, RequestClass rclass = RequestClass());
+
+  // nextRequest: the request to work on next, nullptr if there is none.
+  // With only given, a request to another target is left alone and nullptr returned
+  RequestEntry *nextRequest(const TargetHost *only = nullptr);
+  // pickRequest: the request to look at next, cancelled or not
+  RequestEntry *pickRequest();
+  // takeRequest: remove the request returned by nextRequest(). It stays counted until released
+  void takeRequest();
+  // requestDone: remove the request returned by nextRequest() for good
+  void requestDone();
+  // dropExpired: answer requests in MT_waiting past their deadline with REQUEST_EXPIRED
+  void dropExpired();
+
+  // syncTimeout: longest time a synchronous request to target may take in the worker
+  uint32_t syncTimeout(TargetHost &target);
 
   // handleConnection: worker task method
   static void handleConnection(ModbusClientTCP *instance);
@@ -174,24 +284,61 @@ protected:
 #endif
 
   // send: send request via Client connection
-  void send(RequestEntry request);
+  void send(RequestEntry& request);
 
   // receive: get response via Client connection
-  ModbusMessage receive(RequestEntry request);
+  ModbusMessage receive(RequestEntry& request);
+
+  // useConnection: make the pooled connection to target the active one, (re)connect if needed
+  void useConnection(TargetHost& target);
+
+  // closeIdle: disconnect pooled connections not used for MT_idleTimeout or above the limit
+  void closeIdle();
+
+  // poolLimit: number of pool slots that may be used
+  inline uint8_t poolLimit() { return MT_poolSize < MT_maxConnections ? MT_poolSize : MT_maxConnections; }
+
+  // activeClient: Client of the connection in use
+  inline Client& activeClient() { return *MT_pool[MT_current].client; }
+
+  // pipeline: worker step for pipelined mode - fill the in-flight window and collect responses
+  void pipeline();
+
+  // respond: hand over a response to the requester
+  void respond(RequestEntry& request, ModbusMessage& response);
+
+  // healthKey: identify a server at a target in MT_health
+  static uint64_t healthKey(const TargetHost& target, uint8_t serverID);
+
+  // learn: update the server's health data with the outcome of a request, us after it was sent
+  void learn(RequestEntry& request, const ModbusMessage& response, uint32_t us);
 
   void isInstance() { return; }   // make class instantiable
-  queue<RequestEntry> requests;   // Queue to hold requests to be processed
+  RequestQueue<RequestEntry> requests; // Queue to hold requests to be processed
   bool clearRequests;             // Bool to indicate requests must be cleared
   void _clearRequests();          // Helper function to clear requests from queue, calling response handler
-  #if USE_MUTEX
-  mutex qLock;                    // Mutex to protect queue
-  #endif
   Client& MT_client;              // Client reference for Internet connections (EthernetClient or WifiClient)
   TargetHost MT_lastTarget;       // last used server
   TargetHost MT_target;           // Description of target server
   uint32_t MT_defaultTimeout;     // Standard timeout value taken if no dedicated was set
   uint32_t MT_defaultInterval;    // Standard interval value taken if no dedicated was set
   uint16_t MT_qLimit;             // Maximum number of requests to accept in queue
+  std::atomic<uint8_t> MT_maxInflight; // Maximum number of requests on the wire at the same time
+  std::list<RequestEntry> MT_inflight; // Requests sent, but not yet answered (pipelined mode). Still counted in requests
+  ModbusTCPframer MT_framer;      // Reassembler for the responses on the active connection
+  PoolSlot MT_pool[MAXPOOLSIZE];  // Connection pool. Slot 0 is MT_client
+  uint8_t MT_poolSize;            // Number of slots in use
+  uint8_t MT_maxConnections;      // Number of connections allowed to be open at the same time
+  uint8_t MT_current;             // Slot of the active connection
+  uint32_t MT_idleTimeout;        // Time in ms after which unused connections are closed
+  ServerHealth MT_health;         // Learned response times and quarantined servers
+  std::vector<RequestEntry> MT_waiting; // Requests taken from the queue to pick the next by priority. Worker only
+  size_t MT_pick;                 // Index in MT_waiting of the request picked by nextRequest()
+  std::atomic<uint32_t> MT_classed; // Requests with priority or deadline not taken yet - pick from MT_waiting
+  PriorityStats MT_prio;          // Priority and deadline statistics
+  uint8_t MT_lastPriority;        // Priority of the request answered last
+  unsigned long MT_lastDone;      // millis() the last request was answered
+  RequestIndex MT_index;          // Requests queued by token, to cancel them
 };
 
 #endif  // HAS_FREERTOS
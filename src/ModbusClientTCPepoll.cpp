@@ -0,0 +1,691 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusClientTCPepoll.h"
+
+#if IS_LINUX
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "Logging.h"
+
+// Number of epoll events handled per epoll_wait() call
+static const int EPOLL_BATCH = 32;
+
+// Constructor takes the overall queue limit and the number of event loop threads
+ModbusClientTCPepoll::ModbusClientTCPepoll(uint16_t queueLimit, uint8_t loops) :
+  ModbusClient(),
+  ME_pending(0),
+  ME_running(false),
+  ME_target(IPAddress(0, 0, 0, 0), 0, DEFAULTTIMEOUT, TARGETHOSTINTERVAL),
+  ME_defaultTimeout(DEFAULTTIMEOUT),
+  ME_defaultInterval(TARGETHOSTINTERVAL),
+  ME_qLimit(queueLimit),
+  ME_maxInflight(1) {
+  if (loops < 1) loops = 1;
+  for (uint8_t i = 0; i < loops; ++i) {
+    Loop *l = new Loop;
+    l->client = this;
+    ME_loops.push_back(l);
+  }
+}
+
+// Destructor: stop loops, close connections
+ModbusClientTCPepoll::~ModbusClientTCPepoll() {
+  end();
+  for (auto& t : ME_targets) delete t.second;
+  for (auto l : ME_loops) delete l;
+}
+
+// begin: create the epoll instances and start the event loop threads
+void ModbusClientTCPepoll::begin() {
+  if (ME_running) {
+    mb_log_e("Event loops have been already started!");
+    return;
+  }
+  ME_running = true;
+  for (auto l : ME_loops) {
+    l->epfd = epoll_create1(EPOLL_CLOEXEC);
+    l->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (l->epfd < 0 || l->evfd < 0) {
+      mb_log_e("Error %d creating epoll instance", errno);
+      continue;
+    }
+    // The eventfd is the only one registered without a Connection
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->evfd, &ev);
+    int rc = pthread_create(&l->thread, NULL, &runLoop, l);
+    if (rc) {
+      mb_log_e("Error creating event loop thread: %d", rc);
+      l->thread = 0;
+    }
+  }
+  // Keep the first thread as "the" worker for the base class
+  worker = ME_loops[0]->thread;
+  mb_log_d("%u event loop(s) started.", (uint32_t)ME_loops.size());
+}
+
+// end: stop the event loop threads. Unanswered requests will get QUEUE_CLEARED
+void ModbusClientTCPepoll::end() {
+  if (!ME_running) return;
+  ME_running = false;
+  for (auto l : ME_loops) {
+    if (l->thread) {
+      wake(l);
+      pthread_join(l->thread, NULL);
+      l->thread = 0;
+    }
+  }
+  // Loops are gone, so everything left can be cleaned up here
+  for (auto l : ME_loops) {
+    dropAll(l, false, QUEUE_CLEARED);
+    if (l->evfd >= 0) close(l->evfd);
+    if (l->epfd >= 0) close(l->epfd);
+    l->evfd = l->epfd = -1;
+  }
+  worker = 0;
+  mb_log_d("Event loops stopped.");
+}
+
+// Set default timeout value (and interval) for targets created from now on
+void ModbusClientTCPepoll::setTimeout(uint32_t timeout, uint32_t interval) {
+  ME_defaultTimeout = timeout;
+  ME_defaultInterval = interval;
+}
+
+// Set number of requests allowed on the wire to the same target at the same time
+void ModbusClientTCPepoll::setMaxInflightRequests(uint8_t maxInflight) {
+  if (maxInflight < 1) maxInflight = 1;
+  if (maxInflight > MAXINFLIGHT) maxInflight = MAXINFLIGHT;
+  ME_maxInflight = maxInflight;
+  mb_log_d("Max in-flight requests set to %u", maxInflight);
+}
+
+// Set default target for addRequest() and syncRequest().
+// timeout and interval are applied if the target is used for the first time.
+// Return true, if the target was not known before.
+bool ModbusClientTCPepoll::setTarget(IPAddress host, uint16_t port, uint32_t timeout, uint32_t interval) {
+  ME_target.host = host;
+  ME_target.port = port;
+  ME_target.timeout = timeout ? timeout : ME_defaultTimeout;
+  ME_target.interval = interval ? interval : ME_defaultInterval;
+  mb_log_d("Target set: %d.%d.%d.%d:%d", host[0], host[1], host[2], host[3], port);
+  LOCK_GUARD(lockGuard, ME_targetLock);
+  uint32_t known = ME_targets.size();
+  getTarget(host, port, ME_target.timeout, ME_target.interval);
+  return ME_targets.size() != known;
+}
+
+// Return number of unprocessed requests for all targets
+uint32_t ModbusClientTCPepoll::pendingRequests() {
+  return ME_pending;
+}
+
+// Return number of targets known
+uint32_t ModbusClientTCPepoll::targetCount() {
+  LOCK_GUARD(lockGuard, ME_targetLock);
+  return ME_targets.size();
+}
+
+// Remove all pending (not yet sent) requests
+void ModbusClientTCPepoll::clearQueue() {
+  for (auto l : ME_loops) {
+    l->clear = true;
+    wake(l);
+  }
+}
+
+// Base addRequest for preformatted ModbusMessage and last set target
+Error ModbusClientTCPepoll::addRequestM(ModbusMessage msg, uint32_t token, MBOnResponse handler) {
+  Error rc = SUCCESS;        // Return value
+
+  // Add it to the queue, if valid
+  if (msg) {
+    // Queue add successful?
+    if (!addToQueue(token, std::move(msg), ME_target.host, ME_target.port, handler)) {
+      // No. Return error
+      rc = REQUEST_QUEUE_FULL;
+    }
+  }
+
+  mb_log_d("Add TCP request result: %02X", rc);
+  return rc;
+}
+
+// addRequest for preformatted ModbusMessage and explicit target
+Error ModbusClientTCPepoll::addRequestMT(ModbusMessage msg, uint32_t token, IPAddress targetHost, uint16_t targetPort, MBOnResponse handler) {
+  Error rc = SUCCESS;        // Return value
+
+  // Add it to the queue, if valid
+  if (msg) {
+    // Queue add successful?
+    if (!addToQueue(token, std::move(msg), targetHost, targetPort, handler)) {
+      // No. Return error
+      rc = REQUEST_QUEUE_FULL;
+    }
+  }
+
+  mb_log_d("Add TCP request result: %02X", rc);
+  return rc;
+}
+
+// Base syncRequest follows the same pattern
+ModbusMessage ModbusClientTCPepoll::syncRequestM(ModbusMessage msg, uint32_t token) {
+  return syncRequestMT(std::move(msg), token, ME_target.host, ME_target.port);
+}
+
+// syncRequest with explicit target
+ModbusMessage ModbusClientTCPepoll::syncRequestMT(ModbusMessage msg, uint32_t token, IPAddress targetHost, uint16_t targetPort) {
+  ModbusMessage response;
+
+  if (msg) {
+    uint8_t serverID = msg.getServerID();
+    uint8_t functionCode = msg.getFunctionCode();
+    SyncSlotPtr slot(new SyncSlot);
+    // Queue add successful?
+    if (!addToQueue(token, std::move(msg), targetHost, targetPort, nullptr, slot)) {
+      // No. Return error
+      response.setError(serverID, functionCode, REQUEST_QUEUE_FULL);
+    } else {
+      // Request is queued - wait for the result.
+      // Worst case is a connect plus all requests pending queued for this very target
+      uint32_t timeout;
+      {
+        LOCK_GUARD(lockGuard, ME_targetLock);
+        Connection *c = getTarget(targetHost, targetPort, ME_defaultTimeout, ME_defaultInterval);
+        timeout = (ME_pending + 1) * (c->target.timeout + c->target.interval);
+      }
+      response = waitSync(serverID, functionCode, slot, timeout);
+    }
+  } else {
+    response.setError(msg.getServerID(), msg.getFunctionCode(), EMPTY_MESSAGE);
+  }
+  return response;
+}
+
+// getTarget: find target by IP:port, create it if unknown. Needs ME_targetLock held
+ModbusClientTCPepoll::Connection *ModbusClientTCPepoll::getTarget(IPAddress host, uint16_t port, uint32_t timeout, uint32_t interval) {
+  uint64_t key = ((uint64_t)uint32_t(host) << 16) | port;
+  auto it = ME_targets.find(key);
+  if (it != ME_targets.end()) return it->second;
+  // New target. Distribute targets round robin over the loops
+  Loop *l = ME_loops[ME_targets.size() % ME_loops.size()];
+  Connection *c = new Connection(host, port, timeout, interval, l);
+  ME_targets[key] = c;
+  mb_log_d("New target %d.%d.%d.%d:%d", host[0], host[1], host[2], host[3], port);
+  return c;
+}
+
+// addToQueue: find or create the target and hand the request over to its loop
+bool ModbusClientTCPepoll::addToQueue(uint32_t token, ModbusMessage request, IPAddress host, uint16_t port, MBOnResponse handler, SyncSlotPtr slot) {
+  if (!request) return false;
+
+  // Reserve a place - if there is one left
+  uint32_t pending = ME_pending;
+  do {
+    if (pending >= ME_qLimit) return false;
+  } while (!ME_pending.compare_exchange_weak(pending, pending + 1));
+
+  Connection *c;
+  {
+    LOCK_GUARD(lockGuard, ME_targetLock);
+    c = getTarget(host, port, ME_defaultTimeout, ME_defaultInterval);
+  }
+  // The request takes the target data kept in the Connection
+  RequestEntry re(token, std::move(request), handler, c->target, slot);
+  {
+    // inject proper transactionID
+    LOCK_GUARD(cntLock, countAccessM);
+    re.head.transactionID = messageCount++;
+  }
+  re.head.len = re.msg.size();
+  {
+    LOCK_GUARD(lockGuard, c->loop->inLock);
+    c->loop->incoming.emplace_back(c, std::move(re));
+  }
+  wake(c->loop);
+  return true;
+}
+
+// wake: interrupt epoll_wait() of a loop
+void ModbusClientTCPepoll::wake(Loop *loop) {
+  if (loop->evfd >= 0) {
+    uint64_t one = 1;
+    if (write(loop->evfd, &one, sizeof(one)) < 0) {
+      // Counter is saturated - loop will wake up anyway
+    }
+  }
+}
+
+// runLoop: event loop thread
+void *ModbusClientTCPepoll::runLoop(void *p) {
+  Loop *loop = (Loop *)p;
+  ModbusClientTCPepoll *me = loop->client;
+  struct epoll_event events[EPOLL_BATCH];
+  int wait = 0;
+
+  while (me->ME_running) {
+    int n = epoll_wait(loop->epfd, events, EPOLL_BATCH, wait);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      mb_log_e("epoll_wait error %d", errno);
+      break;
+    }
+    for (int i = 0; i < n; ++i) {
+      Connection *c = (Connection *)events[i].data.ptr;
+      // Wake-up call only?
+      if (!c) {
+        uint64_t cnt;
+        if (read(loop->evfd, &cnt, sizeof(cnt)) < 0) {
+          // Nothing to read - fine as well
+        }
+        continue;
+      }
+      uint32_t ev = events[i].events;
+      // Connect completed?
+      if (c->state == Connection::CONNECTING) {
+        if (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)) me->connected(c);
+      } else {
+        if (ev & (EPOLLIN | EPOLLERR | EPOLLHUP)) me->readIn(c);
+        if (c->fd >= 0 && (ev & EPOLLOUT)) me->flushOut(c);
+      }
+      // There may be room for more requests now
+      me->markReady(c);
+    }
+    // Clear requests if requested
+    if (loop->clear.exchange(false)) me->dropAll(loop, true, QUEUE_CLEARED);
+    me->takeIncoming(loop);
+    wait = me->service(loop);
+  }
+  return nullptr;
+}
+
+// takeIncoming: move requests handed over by other threads to their targets
+void ModbusClientTCPepoll::takeIncoming(Loop *loop) {
+  std::deque<std::pair<Connection *, RequestEntry>> in;
+  {
+    LOCK_GUARD(lockGuard, loop->inLock);
+    in.swap(loop->incoming);
+  }
+  for (auto& i : in) {
+    Connection *c = i.first;
+    if (c->slot < 0) {
+      c->slot = loop->conns.size();
+      loop->conns.push_back(c);
+    }
+    c->waiting.push_back(std::move(i.second));
+    markReady(c);
+  }
+}
+
+// service: expire requests and connects, send what may be sent.
+// Only connections with an event or a deadline due are looked at.
+// Returns the time in ms until the next deadline, to be used as epoll_wait() timeout.
+int ModbusClientTCPepoll::service(Loop *loop) {
+  unsigned long now = millis();
+
+  // Deadlines due?
+  while (!loop->timers.empty() && (long)(now - loop->timers.top().at) >= 0) {
+    Timer t = loop->timers.top();
+    loop->timers.pop();
+    // Skip it if another timer was set for the connection meanwhile
+    if (!t.conn->timerSet || t.conn->timerAt != t.at) continue;
+    t.conn->timerSet = false;
+    expire(t.conn, now);
+    markReady(t.conn);
+  }
+
+  std::vector<Connection *> work;
+  work.swap(loop->ready);
+  for (auto c : work) {
+    c->ready = false;
+    // Send more, if possible
+    arm(c, kick(c));
+    // Nothing left to do? Then the connection is not looked at before the next request
+    if (c->slot >= 0 && c->waiting.empty() && c->inflight.empty() && c->state != Connection::CONNECTING) {
+      Connection *last = loop->conns.back();
+      loop->conns[c->slot] = last;
+      last->slot = c->slot;
+      loop->conns.pop_back();
+      c->slot = -1;
+    }
+  }
+
+  // Something came up while working? Then do not wait at all
+  if (!loop->ready.empty()) return 0;
+  if (loop->timers.empty()) return 1000;
+  long wait = (long)(loop->timers.top().at - millis());
+  if (wait < 0) return 0;
+  return wait < 1000 ? wait : 1000;
+}
+
+// expire: fail a connect or requests in flight that took too long
+void ModbusClientTCPepoll::expire(Connection *c, unsigned long now) {
+  // Connect taking too long?
+  if (c->state == Connection::CONNECTING && (uint32_t)(now - c->since) >= c->target.timeout) {
+    mb_log_w("Connect to %d.%d.%d.%d:%d timed out", c->target.host[0], c->target.host[1], c->target.host[2], c->target.host[3], c->target.port);
+    closeConnection(c, IP_CONNECTION_FAILED);
+    failWaiting(c, IP_CONNECTION_FAILED);
+    return;
+  }
+  // Requests in flight were sent in this order, so the oldest run out first
+  ModbusMessage response;
+  while (!c->inflight.empty() && (uint32_t)(now - c->inflight.front().sentTime) >= c->target.timeout) {
+    RequestEntry& request = c->inflight.front();
+    response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), TIMEOUT);
+    respond(request, response);
+    c->inflight.pop_front();
+  }
+}
+
+// markReady: have the next service() call look at a connection
+void ModbusClientTCPepoll::markReady(Connection *c) {
+  if (c->ready) return;
+  c->ready = true;
+  c->loop->ready.push_back(c);
+}
+
+// arm: set the timer of a connection to its next deadline - connect timeout, timeout of
+// the oldest request in flight or the end of the interval wait ms from now
+void ModbusClientTCPepoll::arm(Connection *c, uint32_t wait) {
+  bool due = false;
+  unsigned long at = 0;
+  // Keep the earliest of the deadlines there are
+  auto earliest = [&due, &at](unsigned long t) {
+    if (!due || (long)(t - at) < 0) {
+      at = t;
+      due = true;
+    }
+  };
+  if (wait) earliest(millis() + wait);
+  if (c->state == Connection::CONNECTING) earliest(c->since + c->target.timeout);
+  if (!c->inflight.empty()) earliest(c->inflight.front().sentTime + c->target.timeout);
+  // A timer set before will do, if it is not later
+  if (!due || (c->timerSet && (long)(c->timerAt - at) <= 0)) return;
+  c->timerSet = true;
+  c->timerAt = at;
+  c->loop->timers.emplace(at, c);
+}
+
+// kick: connect and send as far as the window allows.
+// Returns the time in ms to wait before the next request may be sent, 0 else.
+uint32_t ModbusClientTCPepoll::kick(Connection *c) {
+  if (c->waiting.empty()) return 0;
+  // Not connected? Start it
+  if (c->state == Connection::IDLE) {
+    startConnect(c);
+    return 0;
+  }
+  if (c->state != Connection::CONNECTED) return 0;
+  // Classic mode: give the server some slack between requests
+  if (ME_maxInflight == 1) {
+    if (!c->inflight.empty()) return 0;
+    uint32_t t = millis() - c->lastResponse;
+    if (t < c->target.interval) return c->target.interval - t;
+  }
+
+  bool added = false;
+  while (c->inflight.size() < ME_maxInflight && !c->waiting.empty()) {
+    RequestEntry& request = c->waiting.front();
+    // Put MBAP header and PDU into the output buffer in one go
+    uint8_t *frame = request.msg.headroom();
+    memcpy(frame, (const uint8_t *)request.head, 6);
+    c->outBuf.insert(c->outBuf.end(), frame, frame + 6 + request.msg.size());
+    mb_log_buf_v(request.msg.data(), request.msg.size());
+    request.sentTime = millis();
+    c->inflight.push_back(std::move(request));
+    c->waiting.pop_front();
+    added = true;
+  }
+  if (added) flushOut(c);
+  return 0;
+}
+
+// startConnect: begin non-blocking connect to the target
+void ModbusClientTCPepoll::startConnect(Connection *c) {
+  int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    mb_log_e("Error %d opening socket", errno);
+    failWaiting(c, IP_CONNECTION_FAILED);
+    return;
+  }
+  // Requests are small and shall go out immediately
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = htonl(uint32_t(c->target.host));
+  server.sin_port = htons(c->target.port);
+
+  int rc = ::connect(fd, (struct sockaddr *)&server, sizeof(server));
+  if (rc < 0 && errno != EINPROGRESS) {
+    mb_log_e("Error %d connecting to %d.%d.%d.%d:%d", errno, c->target.host[0], c->target.host[1], c->target.host[2], c->target.host[3], c->target.port);
+    ::close(fd);
+    failWaiting(c, IP_CONNECTION_FAILED);
+    return;
+  }
+  mb_log_d("Target connect (%d.%d.%d.%d:%d).", c->target.host[0], c->target.host[1], c->target.host[2], c->target.host[3], c->target.port);
+  c->fd = fd;
+  c->state = rc ? Connection::CONNECTING : Connection::CONNECTED;
+  c->since = millis();
+  c->framer.reset();
+  c->outBuf.clear();
+  c->wantWrite = (c->state == Connection::CONNECTING);
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | (c->wantWrite ? (uint32_t)EPOLLOUT : 0);
+  ev.data.ptr = c;
+  epoll_ctl(c->loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+
+  if (c->state == Connection::CONNECTED) kick(c);
+}
+
+// connected: non-blocking connect has finished - successfully or not
+void ModbusClientTCPepoll::connected(Connection *c) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+  if (err) {
+    mb_log_e("Error %d connecting to %d.%d.%d.%d:%d", err, c->target.host[0], c->target.host[1], c->target.host[2], c->target.host[3], c->target.port);
+    closeConnection(c, IP_CONNECTION_FAILED);
+    failWaiting(c, IP_CONNECTION_FAILED);
+    return;
+  }
+  mb_log_d("Is connected.");
+  c->state = Connection::CONNECTED;
+  c->wantWrite = false;
+  updateEvents(c);
+  kick(c);
+}
+
+// flushOut: write as much of the pending output as the socket takes
+void ModbusClientTCPepoll::flushOut(Connection *c) {
+  size_t done = 0;
+  while (done < c->outBuf.size()) {
+    ssize_t n = ::send(c->fd, c->outBuf.data() + done, c->outBuf.size() - done, MSG_NOSIGNAL);
+    if (n > 0) {
+      done += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      mb_log_e("Error %d sending to %d.%d.%d.%d:%d", errno, c->target.host[0], c->target.host[1], c->target.host[2], c->target.host[3], c->target.port);
+      closeConnection(c, IP_CONNECTION_FAILED);
+      return;
+    }
+  }
+  c->outBuf.erase(c->outBuf.begin(), c->outBuf.begin() + done);
+  // Wait for the socket to accept more, if there is a rest
+  bool want = !c->outBuf.empty();
+  if (want != c->wantWrite) {
+    c->wantWrite = want;
+    updateEvents(c);
+  }
+}
+
+// readIn: read all there is and dispatch complete responses to their requests
+void ModbusClientTCPepoll::readIn(Connection *c) {
+  ModbusTCPhead head;
+  ModbusMessage response;
+
+  while (1) {
+    ssize_t n = ::recv(c->fd, c->framer.tail(), c->framer.room(), 0);
+    if (n == 0) {
+      // Server has closed the connection
+      mb_log_d("Connection closed by server.");
+      closeConnection(c, IP_CONNECTION_FAILED);
+      return;
+    }
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+      mb_log_e("Error %d receiving from %d.%d.%d.%d:%d", errno, c->target.host[0], c->target.host[1], c->target.host[2], c->target.host[3], c->target.port);
+      closeConnection(c, IP_CONNECTION_FAILED);
+      return;
+    }
+    c->framer.added(n);
+
+    Error e;
+    while ((e = c->framer.next(head, response)) == SUCCESS) {
+      mb_log_buf_v(response.data(), response.size());
+      // Look for the request with this transactionID
+      auto it = c->inflight.begin();
+      while (it != c->inflight.end() && it->head.transactionID != head.transactionID) ++it;
+      if (it == c->inflight.end()) {
+        // Unknown - may be a late answer to a timed-out request
+        mb_log_w("Discarding response with unknown transactionID %04X", head.transactionID);
+        continue;
+      }
+      // Do server ID and function code match the request?
+      if (response.getServerID() != it->msg.getServerID()) {
+        response.setError(it->msg.getServerID(), it->msg.getFunctionCode(), SERVER_ID_MISMATCH);
+      } else if ((response.getFunctionCode() & 0x7F) != it->msg.getFunctionCode()) {
+        response.setError(it->msg.getServerID(), it->msg.getFunctionCode(), FC_MISMATCH);
+      }
+      respond(*it, response);
+      c->inflight.erase(it);
+      c->lastResponse = millis();
+    }
+    // Garbage on the line?
+    if (e == TCP_HEAD_MISMATCH) {
+      // Yes. Frame sync is lost, so all requests in flight are lost as well.
+      mb_log_e("Invalid MBAP header, dropping connection.");
+      closeConnection(c, TCP_HEAD_MISMATCH);
+      return;
+    }
+  }
+}
+
+// closeConnection: close the socket and fail all requests in flight with the given error
+void ModbusClientTCPepoll::closeConnection(Connection *c, Error e) {
+  if (c->fd >= 0) {
+    epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    ::close(c->fd);
+    c->fd = -1;
+  }
+  c->state = Connection::IDLE;
+  c->wantWrite = false;
+  c->outBuf.clear();
+  c->framer.reset();
+  // Requests still waiting need a new connection
+  markReady(c);
+  ModbusMessage response;
+  while (!c->inflight.empty()) {
+    RequestEntry& request = c->inflight.front();
+    response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), e);
+    respond(request, response);
+    c->inflight.pop_front();
+  }
+}
+
+// failWaiting: fail all requests not sent yet with the given error
+void ModbusClientTCPepoll::failWaiting(Connection *c, Error e) {
+  ModbusMessage response;
+  while (!c->waiting.empty()) {
+    RequestEntry& request = c->waiting.front();
+    response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), e);
+    respond(request, response);
+    c->waiting.pop_front();
+  }
+}
+
+// updateEvents: adjust the epoll interest of a connection
+void ModbusClientTCPepoll::updateEvents(Connection *c) {
+  if (c->fd < 0) return;
+  struct epoll_event ev;
+  ev.events = EPOLLIN | (c->wantWrite ? (uint32_t)EPOLLOUT : 0);
+  ev.data.ptr = c;
+  epoll_ctl(c->loop->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// dropAll: fail the requests of a loop - all or only those not sent yet.
+// Dropping all closes the idle connections of the loop as well
+void ModbusClientTCPepoll::dropAll(Loop *loop, bool waitingOnly, Error e) {
+  takeIncoming(loop);
+  if (waitingOnly) {
+    for (auto c : loop->conns) {
+      failWaiting(c, e);
+      markReady(c);
+    }
+    return;
+  }
+  // Response handlers may add requests, so do not hold the lock while calling them
+  std::vector<Connection *> all;
+  {
+    LOCK_GUARD(lockGuard, ME_targetLock);
+    for (auto& t : ME_targets) {
+      if (t.second->loop == loop) all.push_back(t.second);
+    }
+  }
+  for (auto c : all) {
+    failWaiting(c, e);
+    closeConnection(c, e);
+    c->ready = false;
+    c->timerSet = false;
+    c->slot = -1;
+  }
+  loop->conns.clear();
+  loop->ready.clear();
+  while (!loop->timers.empty()) loop->timers.pop();
+}
+
+// respond: hand over a response to the requester - sync response slot or onResponse handler
+void ModbusClientTCPepoll::respond(RequestEntry& request, ModbusMessage& response) {
+  // Request is done, free its place
+  ME_pending--;
+  // Did we get a normal response?
+  if (response.getError() == SUCCESS) {
+    mb_log_d("Data response.");
+  } else {
+    // No, something went wrong. All we have is an error
+    mb_log_d("Error response.");
+    // Count it
+    LOCK_GUARD(responseCnt, countAccessM);
+    errorCount++;
+  }
+  // Is it a synchronous request?
+  if (request.syncSlot) {
+    // Yes. Wake up the requester
+    request.syncSlot->complete(std::move(response));
+  // No, async request. Do we have an onResponse handler?
+  } else if (request.responseHandler) {
+    // Yes. Call it.
+    request.responseHandler(std::move(response), request.token);
+  } else {
+    mb_log_d("No response handler.");
+  }
+}
+
+#endif  // IS_LINUX
@@ -0,0 +1,189 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_CLIENT_TCP_EPOLL_H
+#define _MODBUS_CLIENT_TCP_EPOLL_H
+
+#include "options.h"
+
+#if IS_LINUX
+
+#include "ModbusClientTCP.h"
+#include <atomic>
+#include <deque>
+#include <list>
+#include <map>
+#include <queue>
+#include <vector>
+
+// ModbusClientTCPepoll: Linux client serving any number of TCP targets from a small, fixed
+// number of event loop threads. Each loop multiplexes the sockets of its targets with epoll,
+// so there is neither a thread per target nor a polling worker.
+// Requests are kept per target; up to setMaxInflightRequests() of them are pipelined on
+// each connection and matched by transactionID.
+// A loop only looks at targets that had an event or whose next deadline has come, so
+// the work per wake-up does not grow with the number of targets served.
+class ModbusClientTCPepoll : public ModbusClient {
+public:
+  // Constructor takes the overall queue limit and the number of event loop threads
+  explicit ModbusClientTCPepoll(uint16_t queueLimit = 100, uint8_t loops = 1);
+
+  // Destructor: stop loops, close connections
+  ~ModbusClientTCPepoll();
+
+  // begin: start the event loop threads
+  void begin();
+
+  // end: stop the event loop threads. Unanswered requests will get QUEUE_CLEARED
+  void end();
+
+  // Set default timeout value (and interval) for targets created from now on
+  void setTimeout(uint32_t timeout = DEFAULTTIMEOUT, uint32_t interval = TARGETHOSTINTERVAL);
+
+  // Set number of requests allowed on the wire to the same target at the same time
+  void setMaxInflightRequests(uint8_t maxInflight = 1);
+
+  // Set default target for addRequest() and syncRequest()
+  bool setTarget(IPAddress host, uint16_t port, uint32_t timeout = 0, uint32_t interval = 0);
+
+  // Requests for an explicit target
+  Error addRequestMT(ModbusMessage msg, uint32_t token, IPAddress targetHost, uint16_t targetPort, MBOnResponse handler = nullptr);
+  ModbusMessage syncRequestMT(ModbusMessage msg, uint32_t token, IPAddress targetHost, uint16_t targetPort);
+
+  // Template function to generate addRequest functions with explicit target, as long as
+  // there is a matching ModbusMessage::setMessage() call
+  template <typename... Args>
+  Error addRequestTo(IPAddress targetHost, uint16_t targetPort, uint32_t token, MBOnResponse handler, Args&&... args) {
+    ModbusMessage m;
+    Error rc = m.setMessage(std::forward<Args>(args) ...);
+    if (rc == SUCCESS) {
+      return addRequestMT(std::move(m), token, targetHost, targetPort, handler);
+    }
+    return rc;
+  }
+
+  // Return number of unprocessed requests for all targets
+  uint32_t pendingRequests();
+
+  // Return number of targets known
+  uint32_t targetCount();
+
+  // Remove all pending (not yet sent) requests
+  void clearQueue();
+
+protected:
+  typedef ModbusClientTCP::TargetHost TargetHost;
+  typedef ModbusClientTCP::RequestEntry RequestEntry;
+  typedef ModbusClientTCP::ModbusTCPhead ModbusTCPhead;
+  typedef ModbusClientTCP::ModbusTCPframer ModbusTCPframer;
+
+  struct Loop;
+
+  // State of one target and its connection
+  struct Connection {
+    enum State : uint8_t { IDLE = 0, CONNECTING, CONNECTED };
+    TargetHost target;                  // host, port, timeout and interval
+    Loop *loop;                         // event loop serving this target
+    int fd;                             // socket, -1 if not connected
+    State state;                        // connection state
+    bool wantWrite;                     // EPOLLOUT registered
+    bool ready;                         // listed in loop->ready
+    bool timerSet;                      // timerAt is in loop->timers
+    int32_t slot;                       // index in loop->conns, -1 if idle
+    unsigned long timerAt;              // millis() of the next deadline
+    std::deque<RequestEntry> waiting;   // requests not sent yet
+    std::list<RequestEntry> inflight;   // requests sent, awaiting response
+    std::vector<uint8_t> outBuf;        // bytes not yet accepted by the socket
+    ModbusTCPframer framer;             // response reassembly
+    unsigned long lastResponse;         // millis() of last response, for the interval
+    unsigned long since;                // millis() the connect was started at
+    Connection(IPAddress host, uint16_t port, uint32_t timeout, uint32_t interval, Loop *l) :
+      target(host, port, timeout, interval),
+      loop(l),
+      fd(-1),
+      state(IDLE),
+      wantWrite(false),
+      ready(false),
+      timerSet(false),
+      slot(-1),
+      timerAt(0),
+      lastResponse(0),
+      since(0) {}
+  };
+
+  // A connection's deadline: connect timeout, request timeout or interval
+  struct Timer {
+    unsigned long at;                   // millis() it is due
+    Connection *conn;
+    Timer(unsigned long a, Connection *c) : at(a), conn(c) {}
+    // Later: order for the min-heap, safe for millis() wrapping around
+    struct Later {
+      bool operator()(const Timer& a, const Timer& b) const { return (long)(a.at - b.at) > 0; }
+    };
+  };
+
+  // One event loop thread with its epoll instance
+  struct Loop {
+    ModbusClientTCPepoll *client;       // owning client
+    pthread_t thread;                   // the loop thread
+    int epfd;                           // epoll instance
+    int evfd;                           // eventfd to wake up the loop
+    std::vector<Connection *> conns;    // targets with requests waiting, in flight or connecting
+    std::vector<Connection *> ready;    // targets to look at in the next service() call
+    std::priority_queue<Timer, std::vector<Timer>, Timer::Later> timers; // deadlines, earliest first
+    std::deque<std::pair<Connection *, RequestEntry>> incoming; // requests handed over by other threads
+    std::mutex inLock;                  // protects incoming
+    std::atomic<bool> clear;            // waiting requests shall be dropped
+    Loop() : client(nullptr), thread(0), epfd(-1), evfd(-1), clear(false) {}
+  };
+
+  // Base addRequest and syncRequest must be present
+  Error addRequestM(ModbusMessage msg, uint32_t token, MBOnResponse handler = nullptr);
+  ModbusMessage syncRequestM(ModbusMessage msg, uint32_t token);
+
+  // addToQueue: find or create the target and hand the request over to its loop
+  bool addToQueue(uint32_t token, ModbusMessage request, IPAddress host, uint16_t port, MBOnResponse handler = nullptr, SyncSlotPtr slot = nullptr);
+
+  // getTarget: find target by IP:port, create it if unknown. Needs ME_targetLock held
+  Connection *getTarget(IPAddress host, uint16_t port, uint32_t timeout, uint32_t interval);
+
+  // Event loop thread function
+  static void *runLoop(void *p);
+
+  // Event handling
+  void wake(Loop *loop);                      // interrupt epoll_wait() of a loop
+  void takeIncoming(Loop *loop);              // move handed-over requests to their targets
+  int service(Loop *loop);                    // expire, send; returns ms until next deadline
+  void expire(Connection *c, unsigned long now); // fail connect and requests past their timeout
+  void markReady(Connection *c);              // have service() look at a connection
+  void arm(Connection *c, uint32_t wait);     // set the timer to the connection's next deadline
+  uint32_t kick(Connection *c);               // connect and send; returns ms to wait for the interval
+  void startConnect(Connection *c);           // begin non-blocking connect
+  void connected(Connection *c);              // connect completed (or failed)
+  void flushOut(Connection *c);               // write pending output
+  void readIn(Connection *c);                 // read and dispatch responses
+  void closeConnection(Connection *c, Error e); // close and fail requests in flight
+  void failWaiting(Connection *c, Error e);   // fail requests not sent yet
+  void updateEvents(Connection *c);           // adjust epoll interest
+  void dropAll(Loop *loop, bool waitingOnly, Error e); // fail queued requests
+
+  // respond: hand over a response to the requester
+  void respond(RequestEntry& request, ModbusMessage& response);
+
+  void isInstance() { return; }       // make class instantiable
+  std::vector<Loop *> ME_loops;       // event loops
+  std::map<uint64_t, Connection *> ME_targets; // targets by IP:port
+  std::mutex ME_targetLock;           // protects ME_targets
+  std::atomic<uint32_t> ME_pending;   // number of requests accepted and not answered yet
+  std::atomic<bool> ME_running;       // loops shall run
+  TargetHost ME_target;               // default target
+  uint32_t ME_defaultTimeout;         // timeout for new targets
+  uint32_t ME_defaultInterval;        // interval for new targets
+  uint16_t ME_qLimit;                 // maximum number of requests pending
+  uint8_t ME_maxInflight;             // pipelining window per target
+};
+
+#endif  // IS_LINUX
+
+#endif  // INCLUDE GUARD
@@ -0,0 +1,415 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusCoalescer.h"
+
+#if HAS_FREERTOS || IS_LINUX
+
+#include <algorithm>
+#include "Logging.h"
+
+// Constructor takes the client to send requests with, the time window and the gap allowed
+ModbusCoalescer::ModbusCoalescer(ModbusClient& client, uint32_t windowMs, uint16_t maxGap, uint16_t queueLimit) :
+  ModbusClient(),
+  MC_client(client),
+  MC_window(windowMs),
+  MC_maxGap(maxGap),
+  MC_qLimit(queueLimit),
+  MC_pending(0),
+  MC_stop(false),
+  MC_inFlight(0),
+  MC_token(0),
+  MC_opened(false) { }
+
+// Destructor: stop worker, send what was collected and wait for the responses.
+// Their handlers will use the coalescer, so it must outlive them
+ModbusCoalescer::~ModbusCoalescer() {
+  end();
+  while (MC_inFlight) delay(1);
+}
+
+// begin: start worker task
+void ModbusCoalescer::begin(int coreID) {
+  // Task already running? End it in case
+  end();
+  MC_stop = false;
+
+#if IS_LINUX
+  int rc = pthread_create(&worker, NULL, &pHandle, this);
+  if (rc) {
+    mb_log_e("Error creating coalescer thread: %d", rc);
+  } else {
+    mb_log_d("Coalescer worker started. Window=%u", MC_window);
+  }
+#else
+  // Create unique task name
+  char taskName[9];
+  snprintf(taskName, 9, "MB%02XCOA", instanceCounter);
+  // Start task to handle the collected requests
+  xTaskCreatePinnedToCore((TaskFunction_t)&handleConnection, taskName, CLIENT_TASK_STACK, this, 5, &worker, coreID >= 0 ? coreID : NULL);
+
+  mb_log_d("Coalescer task %u started. Window=%u", (uint32_t)worker, MC_window);
+#endif
+}
+
+#if IS_LINUX
+void *ModbusCoalescer::pHandle(void *p) {
+  handleConnection((ModbusCoalescer *)p);
+  return nullptr;
+}
+#endif
+
+// end: stop worker task and send the requests left
+void ModbusCoalescer::end() {
+  if (worker) {
+    // Let the worker finish its round and stop
+    {
+      LOCK_GUARD(lg, MC_lock);
+      MC_stop = true;
+    }
+#if USE_MUTEX
+    MC_wake.notify_all();
+#endif
+#if IS_LINUX
+    pthread_join(worker, NULL);
+    worker = 0;
+#else
+    while (eTaskGetState(worker) != eTaskState::eDeleted)
+    {
+      vTaskDelay(5 / portTICK_PERIOD_MS);
+    }
+    worker = nullptr;
+#endif
+    mb_log_d("Coalescer worker stopped.");
+  }
+  flush();
+}
+
+// flush: send all requests collected so far
+void ModbusCoalescer::flush() {
+  std::vector<Group> out;
+  takeGroups(out, true);
+  for (auto& g : out) sendGroup(g);
+}
+
+// Return number of requests collected and not sent yet
+uint32_t ModbusCoalescer::pendingRequests() {
+  LOCK_GUARD(lg, MC_lock);
+  return MC_pending;
+}
+
+// cancel: withdraw all requests with token collected and not sent yet
+uint32_t ModbusCoalescer::cancel(uint32_t token) {
+  return cancel_if([token](uint32_t t) { return t == token; });
+}
+
+// cancel_if: withdraw all requests collected whose token fulfills predicate.
+// They stay in their group to be answered by sendGroup(), in the worker like all responses
+uint32_t ModbusCoalescer::cancel_if(std::function<bool(uint32_t token)> predicate) {
+  uint32_t count = 0;
+  LOCK_GUARD(lg, MC_lock);
+  for (auto& g : MC_groups) {
+    for (auto& p : g.parts) {
+      if (!p.cancelled && predicate(p.token)) {
+        p.cancelled = true;
+        count++;
+      }
+    }
+  }
+  mb_log_d("Cancelled %u requests", count);
+  return count;
+}
+
+// getStats: get a copy of the statistics
+ModbusCoalescer::CoalesceStats ModbusCoalescer::getStats() {
+  LOCK_GUARD(lg, MC_lock);
+  return MC_stats;
+}
+
+// Base addRequest: collect read requests, pass on all others
+Error ModbusCoalescer::addRequestM(ModbusMessage msg, uint32_t token, MBOnResponse handler) {
+  uint8_t serverID = msg.getServerID();
+  uint8_t functionCode = msg.getFunctionCode();
+  uint16_t address = 0;
+  uint16_t count = 0;
+  uint16_t limit = (functionCode <= READ_DISCR_INPUT) ? COALESCE_MAX_COILS : COALESCE_MAX_REGISTERS;
+
+  // Is it a valid read request we can join with others?
+  bool collect = serverID != 0 && functionCode >= READ_COIL && functionCode <= READ_INPUT_REGISTER && msg.size() == 6;
+  if (collect) {
+    msg.get(2, address, count);
+    collect = count > 0 && count <= limit;
+  }
+
+  if (!collect) {
+    // No. Send the server's collected requests first to keep the order, then this one
+    std::vector<Group> out;
+    takeGroups(out, false, serverID);
+    for (auto& g : out) sendGroup(g);
+    return MC_client.addRequestM(std::move(msg), token, handler);
+  }
+
+  {
+    LOCK_GUARD(lg, MC_lock);
+    if (MC_pending >= MC_qLimit) {
+      return REQUEST_QUEUE_FULL;
+    }
+    // Is there a group for server and function code already?
+    auto g = std::find_if(MC_groups.begin(), MC_groups.end(), [serverID, functionCode](const Group& x) {
+      return x.serverID == serverID && x.functionCode == functionCode;
+    });
+    if (g == MC_groups.end()) {
+      // No. Open a new one
+      Group ng;
+      ng.serverID = serverID;
+      ng.functionCode = functionCode;
+      ng.opened = millis();
+      MC_groups.push_back(std::move(ng));
+      g = MC_groups.end() - 1;
+      // The worker has to watch its window
+      MC_opened = true;
+#if USE_MUTEX
+      MC_wake.notify_one();
+#endif
+    }
+    g->parts.emplace_back(token, address, count, handler);
+    MC_pending++;
+    MC_stats.requests++;
+  }
+  {
+    LOCK_GUARD(cntLock, countAccessM);
+    messageCount++;
+  }
+  mb_log_d("Collected %02X/%02X @%u/%u", serverID, functionCode, address, count);
+  return SUCCESS;
+}
+
+// Base syncRequest: passed on, the requester is waiting for it
+ModbusMessage ModbusCoalescer::syncRequestM(ModbusMessage msg, uint32_t token) {
+  return MC_client.syncRequestM(std::move(msg), token);
+}
+
+// takeGroups: move groups out to be sent - all of them, or those of a server ID, or expired ones.
+// Returns ms until the window of the oldest group left ends
+uint32_t ModbusCoalescer::takeGroups(std::vector<Group>& out, bool all, int serverID) {
+  LOCK_GUARD(lg, MC_lock);
+  unsigned long now = millis();
+  uint32_t wait = 0xFFFFFFFF;
+  MC_opened = false;
+  auto it = MC_groups.begin();
+  while (it != MC_groups.end()) {
+    bool take = all || (serverID >= 0 ? it->serverID == serverID : now - it->opened >= MC_window);
+    if (take) {
+      MC_pending -= it->parts.size();
+      out.push_back(std::move(*it));
+      it = MC_groups.erase(it);
+    } else {
+      uint32_t left = now - it->opened >= MC_window ? 0 : MC_window - (now - it->opened);
+      if (left < wait) wait = left;
+      ++it;
+    }
+  }
+  return wait;
+}
+
+// sendGroup: plan and send the requests for a group.
+// Taking the requests by address and extending each request as long as the next one is near
+// enough and the limit allows gives the fewest requests possible.
+void ModbusCoalescer::sendGroup(Group& g) {
+  uint16_t limit = (g.functionCode <= READ_DISCR_INPUT) ? COALESCE_MAX_COILS : COALESCE_MAX_REGISTERS;
+  uint8_t serverID = g.serverID;
+  uint8_t functionCode = g.functionCode;
+
+  // Withdrawn requests are answered and left out
+  size_t kept = 0;
+  for (size_t k = 0; k < g.parts.size(); ++k) {
+    Part& p = g.parts[k];
+    if (p.cancelled) {
+      ModbusMessage response;
+      response.setError(serverID, functionCode, REQUEST_CANCELLED);
+      {
+        LOCK_GUARD(cntLock, countAccessM);
+        errorCount++;
+      }
+      if (p.handler) p.handler(response, p.token);
+    } else {
+      if (k != kept) g.parts[kept] = std::move(p);
+      kept++;
+    }
+  }
+  g.parts.erase(g.parts.begin() + kept, g.parts.end());
+
+  // Sort the requests by address
+  std::stable_sort(g.parts.begin(), g.parts.end(), [](const Part& a, const Part& b) {
+    return a.address < b.address;
+  });
+
+  size_t i = 0;
+  while (i < g.parts.size()) {
+    // Start with the lowest address left and take all following that are close enough
+    uint32_t first = g.parts[i].address;
+    uint32_t end = first + g.parts[i].count;
+    bool gaps = false;
+    size_t j = i + 1;
+    while (j < g.parts.size()) {
+      uint32_t pEnd = g.parts[j].address + g.parts[j].count;
+      if (g.parts[j].address > end + MC_maxGap || std::max(end, pEnd) - first > limit) break;
+      // Registers in between nobody asked for?
+      if (g.parts[j].address > end) gaps = true;
+      if (pEnd > end) end = pEnd;
+      j++;
+    }
+
+    // The requests answered by this one, shared with the response handler
+    auto parts = std::make_shared<std::vector<Part>>(std::make_move_iterator(g.parts.begin() + i), std::make_move_iterator(g.parts.begin() + j));
+    ModbusMessage request;
+    request.setMessage(serverID, functionCode, (uint16_t)first, (uint16_t)(end - first));
+    mb_log_d("Sending %02X/%02X @%u/%u for %u requests", serverID, functionCode, first, end - first, parts->size());
+
+    MC_inFlight++;
+    // The token is the coalescer's - cancelling one of the parts' tokens must not hit the others
+    uint32_t token = COALESCE_TOKEN | MC_token++;
+    Error e = MC_client.addRequestM(std::move(request), token,
+      [this, parts, serverID, functionCode, first, gaps](ModbusMessage response, uint32_t) {
+        Error err = response.getError();
+        // An exception may be caused by the registers in between. Ask for each request alone
+        if (gaps && err >= ILLEGAL_FUNCTION && err <= GATEWAY_TARGET_NO_RESP) {
+          mb_log_d("Joined request %02X/%02X @%u failed with %02X, sending alone", serverID, functionCode, first, err);
+          for (auto& p : *parts) sendPart(serverID, functionCode, p);
+        } else {
+          // If we got an error, count it
+          if (err != SUCCESS) {
+            LOCK_GUARD(cntLock, countAccessM);
+            errorCount++;
+          }
+          // Give each request its own share
+          for (auto& p : *parts) {
+            if (p.handler) {
+              p.handler(split(response, serverID, functionCode, first, p), p.token);
+            } else {
+              mb_log_w("No response handler.");
+            }
+          }
+        }
+        // Done with this. The coalescer must not be used after this point
+        MC_inFlight--;
+      });
+
+    if (e != SUCCESS) {
+      MC_inFlight--;
+      // The client did not take it. Tell all requests
+      ModbusMessage response;
+      response.setError(serverID, functionCode, e);
+      for (auto& p : *parts) {
+        if (p.handler) p.handler(response, p.token);
+      }
+    }
+    {
+      LOCK_GUARD(lg, MC_lock);
+      MC_stats.frames++;
+    }
+    i = j;
+  }
+}
+
+// sendPart: send a request on its own again, after its joined request failed
+void ModbusCoalescer::sendPart(uint8_t serverID, uint8_t functionCode, const Part& p) {
+  ModbusMessage request;
+  request.setMessage(serverID, functionCode, p.address, p.count);
+  MBOnResponse handler = p.handler;
+  MC_inFlight++;
+  Error e = MC_client.addRequestM(std::move(request), p.token, [this, handler](ModbusMessage response, uint32_t token) {
+    // If we got an error, count it
+    if (response.getError() != SUCCESS) {
+      LOCK_GUARD(cntLock, countAccessM);
+      errorCount++;
+    }
+    if (handler) {
+      handler(response, token);
+    } else {
+      mb_log_w("No response handler.");
+    }
+    MC_inFlight--;
+  });
+  if (e != SUCCESS) {
+    MC_inFlight--;
+    // The client did not take it. Tell the request
+    ModbusMessage response;
+    response.setError(serverID, functionCode, e);
+    if (handler) handler(response, p.token);
+  }
+  LOCK_GUARD(lg, MC_lock);
+  MC_stats.frames++;
+  MC_stats.resent++;
+}
+
+// split: cut the part p out of response of a request starting at address first
+ModbusMessage ModbusCoalescer::split(const ModbusMessage& response, uint8_t serverID, uint8_t functionCode, uint16_t first, const Part& p) {
+  ModbusMessage m;
+  uint16_t offset = p.address - first;
+
+  // Errors are the same for all
+  Error e = response.getError();
+  if (e != SUCCESS) {
+    m.setError(serverID, functionCode, e);
+    return m;
+  }
+
+  if (functionCode <= READ_DISCR_INPUT) {
+    // Coils: the bits of p have to be shifted down to bit 0
+    uint16_t needed = (offset + p.count + 7) / 8;
+    if (response.size() < 3 || response[2] < needed || response.size() < 3 + needed) {
+      m.setError(serverID, functionCode, PACKET_LENGTH_ERROR);
+      return m;
+    }
+    m.add(serverID, functionCode, (uint8_t)((p.count + 7) / 8));
+    uint8_t bits = 0;
+    for (uint16_t i = 0; i < p.count; ++i) {
+      uint16_t bit = offset + i;
+      if (response[3 + (bit >> 3)] & (1 << (bit & 7))) bits |= 1 << (i & 7);
+      if ((i & 7) == 7 || i == p.count - 1) {
+        m.add(bits);
+        bits = 0;
+      }
+    }
+  } else {
+    // Registers: copy the words of p
+    uint16_t needed = (offset + p.count) * 2;
+    if (response.size() < 3 || response[2] < needed || response.size() < 3 + needed) {
+      m.setError(serverID, functionCode, PACKET_LENGTH_ERROR);
+      return m;
+    }
+    m.add(serverID, functionCode, (uint8_t)(p.count * 2));
+    m.add(response.data() + 3 + offset * 2, p.count * 2);
+  }
+  return m;
+}
+
+// sleep: wait up to ms for a window to end, a new group or the worker to stop
+void ModbusCoalescer::sleep(uint32_t ms) {
+#if USE_MUTEX
+  std::unique_lock<std::mutex> lk(MC_lock);
+  MC_wake.wait_for(lk, std::chrono::milliseconds(ms), [this] { return MC_opened || MC_stop; });
+#else
+  delay(ms < 1 ? 1 : ms);
+#endif
+}
+
+// handleConnection: worker task
+// Sends the groups whose time window has ended, sleeps until the next one ends
+void ModbusCoalescer::handleConnection(ModbusCoalescer *instance) {
+  while (!instance->MC_stop) {
+    std::vector<Group> out;
+    uint32_t wait = instance->takeGroups(out, false);
+    for (auto& g : out) instance->sendGroup(g);
+    // Nothing collected? Look again after a second at the latest
+    if (wait > 1000) wait = 1000;
+    if (out.empty()) instance->sleep(wait);
+  }
+#if HAS_FREERTOS
+  vTaskDelete(NULL);
+#endif
+}
+
+#endif  // HAS_FREERTOS || IS_LINUX
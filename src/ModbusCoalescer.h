@@ -0,0 +1,147 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_COALESCER_H
+#define _MODBUS_COALESCER_H
+
+#include "options.h"
+
+#if HAS_FREERTOS || IS_LINUX
+
+#include "ModbusClient.h"
+#include <vector>
+#include <atomic>
+#include <functional>
+#if USE_MUTEX
+#include <condition_variable>       // NOLINT
+#endif
+
+// Largest number of registers resp. coils a single read request may ask for
+#define COALESCE_MAX_REGISTERS 125
+#define COALESCE_MAX_COILS 2000
+// Token of joined requests sent to the client, with a running number in the lower 16 bits
+#define COALESCE_TOKEN 0xC0A10000
+
+// ModbusCoalescer: collects read requests (FC 0x01, 0x02, 0x03, 0x04) for a short time window
+// and sends overlapping or nearly adjacent ones to the same server as a single request via
+// another client. The response is cut back into one response per original request, that is
+// given to the request's own token and handler, as if it had been sent alone.
+// All other requests and synchronous requests are passed on to the client right away.
+// If a request joined across registers nobody asked for gets an exception response,
+// those registers may not exist - so the original requests are sent again one by one.
+// Joined requests go to the client with a token of the coalescer's own, so cancelling a
+// token at the client does not take the other requests' shares with it. Use cancel() of
+// the coalescer instead.
+//
+//   ModbusClientRTU RTU(-1);
+//   ModbusCoalescer MB(RTU, 20);     // collect for 20ms
+//   RTU.begin(Serial2);
+//   MB.begin();
+//   MB.addRequest(token, handler, 1, READ_HOLD_REGISTER, 10, 2);
+//   MB.addRequest(token + 1, handler, 1, READ_HOLD_REGISTER, 14, 4);  // sent together with the first
+class ModbusCoalescer : public ModbusClient {
+public:
+  // Constructor takes the client to send requests with, the time window in ms and the number
+  // of registers or coils not asked for that may be read in between to join two requests
+  explicit ModbusCoalescer(ModbusClient& client, uint32_t windowMs = 10, uint16_t maxGap = 8, uint16_t queueLimit = 100);
+
+  // Destructor: stop worker, send what was collected and wait for the responses
+  ~ModbusCoalescer();
+
+  // begin: start worker task
+  void begin(int coreID = -1);
+
+  // end: stop the worker. Requests still collected are sent
+  void end();
+
+  // flush: send all requests collected so far without waiting for the window to end
+  void flush();
+
+  // Return number of requests collected and not sent yet
+  uint32_t pendingRequests();
+
+  // cancel: withdraw all requests with token collected and not sent yet. They will be answered
+  // with REQUEST_CANCELLED instead. Returns the number of requests cancelled
+  uint32_t cancel(uint32_t token);
+
+  // cancel_if: same for all requests collected whose token fulfills predicate
+  uint32_t cancel_if(std::function<bool(uint32_t token)> predicate);
+
+  // Coalescing statistics
+  struct CoalesceStats {
+    uint32_t requests;          // read requests collected
+    uint32_t frames;            // requests sent for these
+    uint32_t resent;            // requests sent again alone after their joined request failed
+    CoalesceStats() : requests(0), frames(0), resent(0) {}
+  };
+
+  // getStats: get a copy of the statistics
+  CoalesceStats getStats();
+
+protected:
+  // Part: one read request as it was given to addRequest()
+  struct Part {
+    uint32_t token;
+    uint16_t address;
+    uint16_t count;
+    MBOnResponse handler;
+    bool cancelled;             // Withdrawn by cancel() - not to be sent
+    Part(uint32_t t, uint16_t a, uint16_t c, MBOnResponse h) : token(t), address(a), count(c), handler(h), cancelled(false) {}
+  };
+
+  // Group: all requests with the same server ID and function code collected in a window
+  struct Group {
+    uint8_t serverID;
+    uint8_t functionCode;
+    unsigned long opened;       // millis() when the first request came in
+    std::vector<Part> parts;
+  };
+
+  // Base addRequest and syncRequest must be present
+  Error addRequestM(ModbusMessage msg, uint32_t token, MBOnResponse handler = nullptr);
+  ModbusMessage syncRequestM(ModbusMessage msg, uint32_t token);
+
+  // takeGroups: move groups out to be sent - all of them, or those of a server ID, or expired ones.
+  // Returns ms until the window of the oldest group left ends
+  uint32_t takeGroups(std::vector<Group>& out, bool all, int serverID = -1);
+
+  // sendGroup: plan and send the requests for a group
+  void sendGroup(Group& g);
+
+  // sendPart: send a request on its own again, after its joined request failed
+  void sendPart(uint8_t serverID, uint8_t functionCode, const Part& p);
+
+  // sleep: wait up to ms for a window to end, a new group or the worker to stop
+  void sleep(uint32_t ms);
+
+  // split: cut the part p out of response of a request starting at address first
+  static ModbusMessage split(const ModbusMessage& response, uint8_t serverID, uint8_t functionCode, uint16_t first, const Part& p);
+
+  // handleConnection: worker task method
+  static void handleConnection(ModbusCoalescer *instance);
+#if IS_LINUX
+  static void *pHandle(void *p);
+#endif
+
+  void isInstance() { return; }   // make class instantiable
+  ModbusClient& MC_client;        // Client sending the requests
+  uint32_t MC_window;             // Time to collect requests in ms
+  uint16_t MC_maxGap;             // Registers resp. coils allowed between two requests to join them
+  uint16_t MC_qLimit;             // Maximum number of requests to collect
+  uint16_t MC_pending;            // Number of requests collected
+  std::vector<Group> MC_groups;   // Requests collected
+  CoalesceStats MC_stats;         // Statistics
+  std::atomic<bool> MC_stop;      // Worker shall stop
+  std::atomic<uint32_t> MC_inFlight; // Requests sent to MC_client, but not answered yet
+  std::atomic<uint16_t> MC_token; // Running number of the joined requests' tokens
+  bool MC_opened;                 // A group was opened since the worker looked last
+#if USE_MUTEX
+  std::mutex MC_lock;             // Protects MC_groups, MC_pending, MC_stats and MC_opened
+  std::condition_variable MC_wake; // Wakes up the worker
+#endif
+};
+
+#endif  // HAS_FREERTOS || IS_LINUX
+
+#endif  // INCLUDE GUARD
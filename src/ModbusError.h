@@ -99,6 +99,12 @@ private:
             return "Invalid ASCII character";
         case BROADCAST_ERROR: // 0xF0,
             return "Broadcast data invalid";
+        case SERVER_QUARANTINED: // 0xF1,
+            return "Server quarantined";
+        case REQUEST_EXPIRED: // 0xF2,
+            return "Request expired";
+        case REQUEST_CANCELLED: // 0xF3,
+            return "Request cancelled";
         case UNDEFINED_ERROR: // 0xFF  // otherwise uncovered communication error
         default:
             return "Unspecified error";
@@ -2,9 +2,20 @@
 // eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
 //               MIT license - see license.md for details
 // =================================================================================================
+#include "options.h"
 #include "ModbusMessage.h"
 #include "Logging.h"
 
+#if IS_LINUX && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAS_SHUFFLE_SSSE3 1
+#include <immintrin.h>
+#else
+#define HAS_SHUFFLE_SSSE3 0
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 // Default Constructor - takes optional size of MM_data to allocate memory
 ModbusMessage::ModbusMessage(uint16_t dataLen) {
   if (dataLen) MM_data.reserve(dataLen);
@@ -12,12 +23,10 @@ ModbusMessage::ModbusMessage(uint16_t dataLen) {
 
 // Special message Constructor - takes a std::vector<uint8_t>
 ModbusMessage::ModbusMessage(std::vector<uint8_t> s) :
-MM_data(s) { }
+MM_data(s.data(), s.size()) { }
 
 // Destructor
 ModbusMessage::~ModbusMessage() { 
-  // If paranoid, one can use the below :D
-  // std::vector<uint8_t>().swap(MM_data);
 }
 
 // Assignment operator
@@ -32,12 +41,11 @@ ModbusMessage& ModbusMessage::operator=(const ModbusMessage& m) {
 
 #ifndef NO_MOVE
   // Move constructor
-ModbusMessage::ModbusMessage(ModbusMessage&& m) {
-  MM_data = std::move(m.MM_data);
-}
+ModbusMessage::ModbusMessage(ModbusMessage&& m) noexcept :
+  MM_data(std::move(m.MM_data)) { }
   
 	// Move assignment
-ModbusMessage& ModbusMessage::operator=(ModbusMessage&& m) {
+ModbusMessage& ModbusMessage::operator=(ModbusMessage&& m) noexcept {
   MM_data = std::move(m.MM_data);
   return *this;
 }
@@ -47,6 +55,40 @@ ModbusMessage& ModbusMessage::operator=(ModbusMessage&& m) {
 ModbusMessage::ModbusMessage(const ModbusMessage& m) :
   MM_data(m.MM_data) { }
 
+// MMbuffer::grow: move contents to a larger heap block. Grows at least by half to
+// keep repeated push_back() cheap, but never beyond what a uint16_t length can address.
+// Returns false if n bytes cannot be held.
+bool ModbusMessage::MMbuffer::grow(uint32_t n) {
+  if (n > 0xFFFF) return false;
+  uint32_t newCap = cap + (cap >> 1);
+  if (newCap < n) newCap = n;
+  if (newCap > 0xFFFF) newCap = 0xFFFF;
+  uint8_t *block = new uint8_t[MM_HEADROOM + newCap + MM_TAILROOM];
+  heapBlocks++;
+  if (len) memcpy(block + MM_HEADROOM, data(), len);
+  delete[] heap;
+  heap = block;
+  cap = newCap;
+  return true;
+}
+
+// MMbuffer::take: steal a heap block or copy the inline bytes
+void ModbusMessage::MMbuffer::take(MMbuffer& m) noexcept {
+  delete[] heap;
+  heap = nullptr;
+  cap = MM_INLINE_SIZE;
+  len = m.len;
+  if (m.heap) {
+    heap = m.heap;
+    cap = m.cap;
+    m.heap = nullptr;
+    m.cap = MM_INLINE_SIZE;
+  } else if (len) {
+    memcpy(store + MM_HEADROOM, m.store + MM_HEADROOM, len);
+  }
+  m.len = 0;
+}
+
 // Equality comparison
 bool ModbusMessage::operator==(const ModbusMessage& m) {
   // Prevent self-compare
@@ -75,8 +117,8 @@ ModbusMessage::operator bool() {
 }
 
 // Exposed methods of std::vector
-const uint8_t *ModbusMessage::data() { return MM_data.data(); }
-uint16_t       ModbusMessage::size() { return MM_data.size(); }
+const uint8_t *ModbusMessage::data() const { return MM_data.data(); }
+uint16_t       ModbusMessage::size() const { return MM_data.size(); }
 void           ModbusMessage::push_back(const uint8_t& val) { MM_data.push_back(val); }
 void           ModbusMessage::clear() { MM_data.clear(); }
 // provide restricted operator[] interface
@@ -95,13 +137,11 @@ uint16_t ModbusMessage::resize(uint16_t newSize) {
 
 // Add append() for two ModbusMessages or a std::vector<uint8_t> to be appended
 void ModbusMessage::append(ModbusMessage& m) { 
-  MM_data.reserve(size() + m.size()); 
-  MM_data.insert(MM_data.end(), m.begin(), m.end()); 
+  MM_data.append(m.data(), m.size()); 
 }
 
 void ModbusMessage::append(std::vector<uint8_t>& m) { 
-  MM_data.reserve(size() + m.size()); 
-  MM_data.insert(MM_data.end(), m.begin(), m.end()); 
+  MM_data.append(m.data(), m.size()); 
 }
 
 uint8_t ModbusMessage::getServerID() const {
@@ -156,9 +196,7 @@ void    ModbusMessage::setFunctionCode(uint8_t FC) {
 // add() variant to copy a buffer into MM_data. Returns updated size
 uint16_t ModbusMessage::add(const uint8_t *arrayOfBytes, uint16_t count) {
   // Copy it
-  while (count--) {
-    MM_data.push_back(*arrayOfBytes++);
-  }
+  MM_data.append(arrayOfBytes, count);
   // Return updated size (logical length of message so far)
   return MM_data.size();
 }
@@ -304,9 +342,7 @@ double ModbusMessage::swapDouble(double& f, int swapRule) {
 
 // add() variant for a vector of uint8_t
 uint16_t ModbusMessage::add(vector<uint8_t> v) {
-  for (auto& b: v) {
-    MM_data.push_back(b);
-  }
+  MM_data.append(v.data(), v.size());
   return MM_data.size();
 }
 
@@ -377,7 +413,7 @@ uint16_t ModbusMessage::get(uint16_t index, float& v, int swapRule) const {
   if (determineFloatOrder()) {
     // If we get here, the floatOrder is known
     // Will it fit?
-    if (index <= MM_data.size() - sizeof(float)) {
+    if (index + sizeof(float) <= MM_data.size()) {
       // Yes. Get the bytes of v in normalized sequence
       uint8_t *bytes = (uint8_t *)&v;
       for (uint8_t i = 0; i < sizeof(float); ++i) {
@@ -402,7 +438,7 @@ uint16_t ModbusMessage::get(uint16_t index, double& v, int swapRule) const {
   if (determineDoubleOrder()) {
     // If we get here, the doubleOrder is known
     // Will it fit?
-    if (index <= MM_data.size() - sizeof(double)) {
+    if (index + sizeof(double) <= MM_data.size()) {
       // Yes. Get the bytes of v in normalized sequence
       uint8_t *bytes = (uint8_t *)&v;
       for (uint8_t i = 0; i < sizeof(double); ++i) {
@@ -422,6 +458,134 @@ uint16_t ModbusMessage::get(uint16_t index, double& v, int swapRule) const {
   return index;
 }
 
+#if HAS_SHUFFLE_SSSE3
+// shuffleSSSE3: apply a 16-byte shuffle mask to 16 bytes per step. Returns number of bytes done
+__attribute__((target("ssse3")))
+static uint16_t shuffleSSSE3(const uint8_t *src, uint8_t *dst, uint16_t len, const uint8_t *mask, bool nibbles) {
+  const __m128i m = _mm_loadu_si128((const __m128i *)mask);
+  const __m128i low = _mm_set1_epi8(0x0F);
+  uint16_t done = 0;
+  for (; done + 16 <= len; done += 16) {
+    __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + done)), m);
+    if (nibbles) {
+      v = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, low), 4), _mm_and_si128(_mm_srli_epi16(v, 4), low));
+    }
+    _mm_storeu_si128((__m128i *)(dst + done), v);
+  }
+  return done;
+}
+
+// cpuHasSSSE3: the processor knows PSHUFB
+static bool cpuHasSSSE3() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("ssse3");
+}
+#endif
+
+// shuffleScalar: apply the first SIZE bytes of a shuffle mask to count values
+template <uint8_t SIZE>
+static void shuffleScalar(const uint8_t *src, uint8_t *dst, uint16_t count, const uint8_t *mask, bool nibbles) {
+  uint8_t m[SIZE];
+  memcpy(m, mask, SIZE);
+  for (; count; --count, src += SIZE, dst += SIZE) {
+    for (uint8_t j = 0; j < SIZE; ++j) {
+      dst[j] = src[m[j]];
+    }
+    if (nibbles) {
+      for (uint8_t j = 0; j < SIZE; ++j) {
+        dst[j] = (dst[j] << 4) | (dst[j] >> 4);
+      }
+    }
+  }
+}
+
+// decodeArray: convert count MSB-first values of size bytes to host order and apply swapRule.
+// Each target byte i of a value is source byte order[swapTables[swapRule][i]], as in get(float&),
+// so a single shuffle mask does both. Sizes 2, 4 and 8 repeat that mask every 8 bytes.
+void ModbusMessage::decodeArray(const uint8_t *src, void *target, uint16_t count, uint8_t size, const uint8_t *order, int swapRule) {
+  uint8_t *dst = (uint8_t *)target;
+  bool nibbles = (swapRule & SWAP_NIBBLES);
+  uint8_t mask[16];
+
+  // Build the mask for 16 bytes
+  for (uint8_t j = 0; j < 16; ++j) {
+    uint8_t i = swapTables[swapRule & (size - 1)][j % size];
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    uint8_t host = order ? order[i] : i;
+#else
+    uint8_t host = order ? order[i] : size - 1 - i;
+#endif
+    mask[j] = (j / size) * size + host;
+  }
+
+  uint16_t done = 0;
+#if HAS_SHUFFLE_SSSE3
+  static const bool usable = cpuHasSSSE3();
+  if (usable) done = shuffleSSSE3(src, dst, count * size, mask, nibbles);
+#elif defined(__ARM_NEON)
+  const uint8x8_t m = vld1_u8(mask);
+  for (; done + 8 <= count * size; done += 8) {
+    uint8x8_t v = vtbl1_u8(vld1_u8(src + done), m);
+    if (nibbles) v = vorr_u8(vshl_n_u8(v, 4), vshr_n_u8(v, 4));
+    vst1_u8(dst + done, v);
+  }
+#endif
+
+  // Scalar for the rest
+  src += done;
+  dst += done;
+  count -= done / size;
+  switch (size) {
+  case 2:
+    shuffleScalar<2>(src, dst, count, mask, nibbles);
+    break;
+  case 4:
+    shuffleScalar<4>(src, dst, count, mask, nibbles);
+    break;
+  default:
+    shuffleScalar<8>(src, dst, count, mask, nibbles);
+    break;
+  }
+}
+
+// getRegisters() - read arrays of values. 16-bit values may have bytes swapped, 32-bit values
+// registers as well. Floats and doubles follow the same rules as the single value get().
+uint16_t ModbusMessage::getRegisters(uint16_t index, uint16_t *target, uint16_t count, int swapRules) const {
+  // Will it fit?
+  if (index + count * sizeof(uint16_t) > MM_data.size()) return index;
+  decodeArray(MM_data.data() + index, target, count, sizeof(uint16_t), nullptr, swapRules & 0x09);
+  return index + count * sizeof(uint16_t);
+}
+
+uint16_t ModbusMessage::getRegisters(uint16_t index, int16_t *target, uint16_t count, int swapRules) const {
+  return getRegisters(index, (uint16_t *)target, count, swapRules);
+}
+
+uint16_t ModbusMessage::getRegisters(uint16_t index, uint32_t *target, uint16_t count, int swapRules) const {
+  // Will it fit?
+  if (index + count * sizeof(uint32_t) > MM_data.size()) return index;
+  decodeArray(MM_data.data() + index, target, count, sizeof(uint32_t), nullptr, swapRules & 0x0B);
+  return index + count * sizeof(uint32_t);
+}
+
+uint16_t ModbusMessage::getRegisters(uint16_t index, int32_t *target, uint16_t count, int swapRules) const {
+  return getRegisters(index, (uint32_t *)target, count, swapRules);
+}
+
+uint16_t ModbusMessage::getRegisters(uint16_t index, float *target, uint16_t count, int swapRules) const {
+  // Byte order must be known and the values must fit
+  if (!determineFloatOrder() || index + count * sizeof(float) > MM_data.size()) return index;
+  decodeArray(MM_data.data() + index, target, count, sizeof(float), floatOrder, swapRules & 0x0B);
+  return index + count * sizeof(float);
+}
+
+uint16_t ModbusMessage::getRegisters(uint16_t index, double *target, uint16_t count, int swapRules) const {
+  // Byte order must be known and the values must fit
+  if (!determineDoubleOrder() || index + count * sizeof(double) > MM_data.size()) return index;
+  decodeArray(MM_data.data() + index, target, count, sizeof(double), doubleOrder, swapRules & 0x0F);
+  return index + count * sizeof(double);
+}
+
 // get() - read a byte array of a given size into a vector<uint8_t>. Returns updated index
 uint16_t ModbusMessage::get(uint16_t index, vector<uint8_t>& v, uint8_t count) const {
   // Clean target vector
@@ -569,9 +733,9 @@ Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode) {
   if (returnCode == SUCCESS)
   {
     // Yes, all fine. Create new ModbusMessage
-    MM_data.reserve(2);
-    MM_data.shrink_to_fit();
     MM_data.clear();
+    MM_data.shrink_to_fit();
+    MM_data.reserve(2);
     add(serverID, functionCode);
   }
   return returnCode;
@@ -585,9 +749,9 @@ Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode, uint16_t
   if (returnCode == SUCCESS)
   {
     // Yes, all fine. Create new ModbusMessage
-    MM_data.reserve(4);
-    MM_data.shrink_to_fit();
     MM_data.clear();
+    MM_data.shrink_to_fit();
+    MM_data.reserve(4);
     add(serverID, functionCode, p1);
   }
   return returnCode;
@@ -601,9 +765,9 @@ Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode, uint16_t
   if (returnCode == SUCCESS)
   {
     // Yes, all fine. Create new ModbusMessage
-    MM_data.reserve(6);
-    MM_data.shrink_to_fit();
     MM_data.clear();
+    MM_data.shrink_to_fit();
+    MM_data.reserve(6);
     add(serverID, functionCode, p1, p2);
   }
   return returnCode;
@@ -617,9 +781,9 @@ Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode, uint16_t
   if (returnCode == SUCCESS)
   {
     // Yes, all fine. Create new ModbusMessage
-    MM_data.reserve(8);
-    MM_data.shrink_to_fit();
     MM_data.clear();
+    MM_data.shrink_to_fit();
+    MM_data.reserve(8);
     add(serverID, functionCode, p1, p2, p3);
   }
   return returnCode;
@@ -633,9 +797,9 @@ Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode, uint16_t
   if (returnCode == SUCCESS)
   {
     // Yes, all fine. Create new ModbusMessage
-    MM_data.reserve(7 + count * 2);
-    MM_data.shrink_to_fit();
     MM_data.clear();
+    MM_data.shrink_to_fit();
+    MM_data.reserve(7 + count * 2);
     add(serverID, functionCode, p1, p2);
     add(count);
     for (uint8_t i = 0; i < (count >> 1); ++i) {
@@ -653,9 +817,9 @@ Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode, uint16_t
   if (returnCode == SUCCESS)
   {
     // Yes, all fine. Create new ModbusMessage
-    MM_data.reserve(7 + count);
-    MM_data.shrink_to_fit();
     MM_data.clear();
+    MM_data.shrink_to_fit();
+    MM_data.reserve(7 + count);
     add(serverID, functionCode, p1, p2);
     add(count);
     for (uint8_t i = 0; i < count; ++i) {
@@ -673,9 +837,9 @@ Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode, uint16_t
   if (returnCode == SUCCESS)
   {
     // Yes, all fine. Create new ModbusMessage
-    MM_data.reserve(2 + count);
-    MM_data.shrink_to_fit();
     MM_data.clear();
+    MM_data.shrink_to_fit();
+    MM_data.reserve(2 + count);
     add(serverID, functionCode);
     for (uint8_t i = 0; i < count; ++i) {
       add(arrayOfBytes[i]);
@@ -687,9 +851,9 @@ Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode, uint16_t
 // 8. Error response generator
 Error ModbusMessage::setError(uint8_t serverID, uint8_t functionCode, Error errorCode) {
   // No error checking for server ID or function code here, as both may be the cause for the message!? 
-  MM_data.reserve(3);
-  MM_data.shrink_to_fit();
   MM_data.clear();
+  MM_data.shrink_to_fit();
+  MM_data.reserve(3);
   add(serverID, static_cast<uint8_t>((functionCode | 0x80) & 0xFF), static_cast<uint8_t>(errorCode));
   return SUCCESS;
 }
@@ -699,5 +863,6 @@ void ModbusMessage::printError(const char *file, int lineNo, Error e, uint8_t se
   mb_log_e("(%s, line %d) Error in constructor: %02X - %s (%02X/%02X)", file_name(file), lineNo, e, (const char *)(ModbusError(e)), serverID, functionCode);
 }
 
+std::atomic<uint32_t> ModbusMessage::MMbuffer::heapBlocks(0);
 uint8_t ModbusMessage::floatOrder[] = { 0xFF };
 uint8_t ModbusMessage::doubleOrder[] = { 0xFF };
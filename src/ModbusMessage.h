@@ -8,6 +8,27 @@
 #include "ModbusError.h"
 #include <type_traits>
 #include <vector>
+#include <cstring>
+#include <atomic>
+
+// Messages up to MM_INLINE_SIZE bytes are held inside the ModbusMessage object itself,
+// only larger ones will allocate heap memory. May be set in the build flags.
+#ifndef MM_INLINE_SIZE
+#define MM_INLINE_SIZE 32
+#endif
+
+// Spare bytes kept in front of and behind the message data, for the transports to put
+// the MBAP header resp. the CRC around a message without copying it.
+#define MM_HEADROOM 6
+#define MM_TAILROOM 2
+
+// The compile-time float/double conversions take the bits of a value as an integer of the
+// same size. That needs floats to use the integer byte order, else the runtime functions are used.
+#if defined(__FLOAT_WORD_ORDER__) && defined(__BYTE_ORDER__) && __FLOAT_WORD_ORDER__ != __BYTE_ORDER__
+#define MM_FLOAT_BITS 0
+#else
+#define MM_FLOAT_BITS 1
+#endif
 
 using Modbus::Error;
 using Modbus::FCType;
@@ -43,10 +64,10 @@ public:
 
 #ifndef NO_MOVE
   // Move constructor
-	ModbusMessage(ModbusMessage&& m);
+	ModbusMessage(ModbusMessage&& m) noexcept;
   
 	// Move assignment
-	ModbusMessage& operator=(ModbusMessage&& m);
+	ModbusMessage& operator=(ModbusMessage&& m) noexcept;
 #endif
 
   // Comparison operators
@@ -55,15 +76,24 @@ public:
   operator bool();
   
   // Exposed methods of std::vector
-  const uint8_t   *data();  // address of MM_data
-  uint16_t   size();  // used length in MM_data
+  const uint8_t   *data() const;  // address of MM_data
+  uint16_t   size() const;  // used length in MM_data
   uint8_t    operator[](uint16_t index) const; // provide restricted operator[] interface
   void push_back(const uint8_t& val); // add a byte at the end of MM_data
   void clear();             // delete message contents
   uint16_t resize(uint16_t newSize);  // resize MM_data
 
+  // Number of heap blocks allocated for message data so far, all messages together.
+  // Messages fitting into MM_INLINE_SIZE do not allocate at all
+  static uint32_t heapAllocations() { return MMbuffer::heapBlocks; }
+
+  // Spare bytes around the message data, to complete a frame in place for sending.
+  // Their contents are no part of the message, they are undefined until written to.
+  inline uint8_t *headroom() { return MM_data.data() - MM_HEADROOM; } // MM_HEADROOM bytes before data()
+  inline uint8_t *tailroom() { return MM_data.data() + MM_data.size(); } // MM_TAILROOM bytes behind the data
+
   // provide iterator interface on MM_data
-  typedef std::vector<uint8_t>::const_iterator const_iterator;
+  typedef const uint8_t *const_iterator;
   const_iterator begin() const { return MM_data.begin(); }
   const_iterator end() const   { return MM_data.end(); }
 
@@ -129,6 +159,58 @@ uint16_t add(double v, int swapRules = 0);
 uint16_t get(uint16_t index, float& v, int swapRules = 0) const;
 uint16_t get(uint16_t index, double& v, int swapRules = 0) const;
 
+// add() and get() variants for float and double with the swap rule fixed at compile time:
+// add<SWAP_REGISTERS>(f) gives the same as add(f, SWAP_REGISTERS), but needs neither the
+// byte order probing nor the swap tables. The conversion folds into a few shifts or a bswap.
+template <int swapRules, typename T>
+typename std::enable_if<std::is_same<T, float>::value || std::is_same<T, double>::value, uint16_t>::type
+add(T v) {
+#if MM_FLOAT_BITS
+  typename FloatBits<T>::type u;
+  memcpy(&u, &v, sizeof(T));
+  u = swapBits<swapRules>(u);
+  // Put out MSB first
+  uint8_t bytes[sizeof(T)];
+  for (uint8_t i = 0; i < sizeof(T); ++i) {
+    bytes[i] = (u >> ((sizeof(T) - 1 - i) << 3)) & 0xFF;
+  }
+  MM_data.append(bytes, sizeof(T));
+  return MM_data.size();
+#else
+  return add(v, swapRules);
+#endif
+}
+
+template <int swapRules, typename T>
+typename std::enable_if<std::is_same<T, float>::value || std::is_same<T, double>::value, uint16_t>::type
+get(uint16_t index, T& v) const {
+#if MM_FLOAT_BITS
+  // Will it fit?
+  if (index + sizeof(T) > MM_data.size()) return index;
+  // Read MSB first
+  typename FloatBits<T>::type u = 0;
+  const uint8_t *bytes = MM_data.data() + index;
+  for (uint8_t i = 0; i < sizeof(T); ++i) {
+    u = (u << 8) | bytes[i];
+  }
+  u = swapBits<swapRules>(u);
+  memcpy(&v, &u, sizeof(T));
+  return index + sizeof(T);
+#else
+  return get(index, v, swapRules);
+#endif
+}
+
+// getRegisters() - read count values into an array in one go, applying the swapRules as get(float&) does.
+// 16-bit types will use SWAP_BYTES and SWAP_NIBBLES, 32-bit types SWAP_REGISTERS in addition.
+// Returns updated index, or the unchanged index if not all values are contained in the message
+uint16_t getRegisters(uint16_t index, uint16_t *target, uint16_t count, int swapRules = 0) const;
+uint16_t getRegisters(uint16_t index, int16_t *target, uint16_t count, int swapRules = 0) const;
+uint16_t getRegisters(uint16_t index, uint32_t *target, uint16_t count, int swapRules = 0) const;
+uint16_t getRegisters(uint16_t index, int32_t *target, uint16_t count, int swapRules = 0) const;
+uint16_t getRegisters(uint16_t index, float *target, uint16_t count, int swapRules = 0) const;
+uint16_t getRegisters(uint16_t index, double *target, uint16_t count, int swapRules = 0) const;
+
   // Message generation methods
   // 1. no additional parameter (FCs 0x07, 0x0b, 0x0c, 0x11)
   Error setMessage(uint8_t serverID, uint8_t functionCode);
@@ -155,6 +237,8 @@ uint16_t get(uint16_t index, double& v, int swapRules = 0) const;
   Error setError(uint8_t serverID, uint8_t functionCode, Error errorCode);
   
 protected:
+  friend class ModbusMessageView;   // shares the float/double byte order helpers
+
   // Data validation methods - used by the above!
   // 0. serverID and function code - used by all of the below
   static Error checkServerFC(uint8_t serverID, uint8_t functionCode);
@@ -183,7 +267,76 @@ protected:
   // Error output in case a message constructor will fail
   static void printError(const char *file, int lineNo, Error e, uint8_t serverID, uint8_t functionCode);
 
-  std::vector<uint8_t> MM_data;  // Message data buffer
+  // MMbuffer: byte buffer with the subset of the std::vector interface used here.
+  // Holds up to MM_INLINE_SIZE bytes inline and moves to the heap only beyond that.
+  // Both inline and heap storage have MM_HEADROOM bytes in front of and MM_TAILROOM
+  // bytes behind the capacity.
+  class MMbuffer {
+  public:
+    MMbuffer() : heap(nullptr), cap(MM_INLINE_SIZE), len(0) {}
+    MMbuffer(const uint8_t *src, uint16_t count) : MMbuffer() { append(src, count); }
+    MMbuffer(const MMbuffer& m) : MMbuffer() { append(m.data(), m.len); }
+    MMbuffer(MMbuffer&& m) noexcept : MMbuffer() { take(m); }
+    ~MMbuffer() { delete[] heap; }
+    MMbuffer& operator=(const MMbuffer& m) {
+      if (this != &m) {
+        len = 0;
+        append(m.data(), m.len);
+      }
+      return *this;
+    }
+    MMbuffer& operator=(MMbuffer&& m) noexcept {
+      if (this != &m) take(m);
+      return *this;
+    }
+
+    inline uint8_t *data() { return (heap ? heap : store) + MM_HEADROOM; }
+    inline const uint8_t *data() const { return (heap ? heap : store) + MM_HEADROOM; }
+    inline uint16_t size() const { return len; }
+    inline bool empty() const { return len == 0; }
+    inline uint8_t& operator[](uint16_t i) { return data()[i]; }
+    inline const uint8_t& operator[](uint16_t i) const { return data()[i]; }
+    inline const uint8_t *begin() const { return data(); }
+    inline const uint8_t *end() const { return data() + len; }
+    inline void clear() { len = 0; }
+    inline bool reserve(uint32_t n) { return n <= cap || grow(n); }
+    inline void push_back(uint8_t b) {
+      if (reserve(len + 1)) data()[len++] = b;
+    }
+    void append(const uint8_t *src, uint16_t count) {
+      if (!count || !reserve(len + count)) return;
+      memcpy(data() + len, src, count);
+      len += count;
+    }
+    void resize(uint16_t n) {
+      if (!reserve(n)) return;
+      if (n > len) memset(data() + len, 0, n - len);
+      len = n;
+    }
+    // Give back heap memory if the contents fit inline again
+    void shrink_to_fit() {
+      if (heap && len <= MM_INLINE_SIZE) {
+        memcpy(store + MM_HEADROOM, heap + MM_HEADROOM, len);
+        delete[] heap;
+        heap = nullptr;
+        cap = MM_INLINE_SIZE;
+      }
+    }
+
+  protected:
+    bool grow(uint32_t n);        // enlarge capacity to at least n bytes
+    void take(MMbuffer& m) noexcept; // move contents of m here, leaving m empty
+
+    friend class ModbusMessage;
+    static std::atomic<uint32_t> heapBlocks; // statistics: number of heap blocks allocated
+
+    uint8_t *heap;                // heap memory, nullptr while inline
+    uint16_t cap;                 // current capacity, head- and tailroom not counted
+    uint16_t len;                 // bytes used
+    uint8_t store[MM_HEADROOM + MM_INLINE_SIZE + MM_TAILROOM]; // inline storage
+  };
+
+  MMbuffer MM_data;  // Message data buffer
 
   static uint8_t floatOrder[sizeof(float)]; // order of bytes in a float variable
   static uint8_t doubleOrder[sizeof(double)]; // order of bytes in a double variable
@@ -194,6 +347,33 @@ protected:
   static float swapFloat(float& f, int swapRule);
   static double swapDouble(double& f, int swapRule);
 
+  // FloatBits: unsigned integer type holding the bits of a float or double
+  template <typename T> struct FloatBits {
+    typedef typename std::conditional<sizeof(T) == 8, uint64_t, uint32_t>::type type;
+  };
+
+  // swapBits: apply a swap rule to the bits of a float or double in MSB-first order.
+  // SWAP_WORDS is ignored for floats, like swapFloat() does.
+  template <int swapRules, typename U> static inline U swapBits(U u) {
+    if (swapRules & SWAP_BYTES) {
+      u = ((u & (U)0x00FF00FF00FF00FFULL) << 8) | ((u >> 8) & (U)0x00FF00FF00FF00FFULL);
+    }
+    if (swapRules & SWAP_REGISTERS) {
+      u = ((u & (U)0x0000FFFF0000FFFFULL) << 16) | ((u >> 16) & (U)0x0000FFFF0000FFFFULL);
+    }
+    if ((swapRules & SWAP_WORDS) && sizeof(U) == 8) {
+      u = (U)(((uint64_t)u << 32) | ((uint64_t)u >> 32));
+    }
+    if (swapRules & SWAP_NIBBLES) {
+      u = ((u & (U)0x0F0F0F0F0F0F0F0FULL) << 4) | ((u >> 4) & (U)0x0F0F0F0F0F0F0F0FULL);
+    }
+    return u;
+  }
+
+  // decodeArray: convert count MSB-first values of size (2, 4 or 8) bytes to host order, then swap.
+  // order is floatOrder/doubleOrder, nullptr for integers. swapRule must be valid for the size.
+  static void decodeArray(const uint8_t *src, void *target, uint16_t count, uint8_t size, const uint8_t *order, int swapRule);
+
   // getOne() - read a MSB-first value starting at byte index. Returns updated index
   template <typename T> uint16_t getOne(uint16_t index, T& retval) const {
     uint16_t sz = sizeof(retval);    // Size of value to be read
@@ -201,7 +381,7 @@ protected:
     retval = 0;                      // return value
 
     // Will it fit?
-    if (index <= MM_data.size() - sz) {
+    if (index + sz <= MM_data.size()) {
       // Yes. Copy it MSB first
       while (sz) {
         sz--;
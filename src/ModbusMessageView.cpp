@@ -0,0 +1,126 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusMessageView.h"
+#include "Logging.h"
+
+// RegisterSpan::copyTo: decode up to count registers into an array
+uint16_t ModbusMessageView::RegisterSpan::copyTo(uint16_t *target, uint16_t count) const {
+  if (count > RS_count) count = RS_count;
+  ModbusMessage::decodeArray(RS_data, target, count, sizeof(uint16_t), nullptr, 0);
+  return count;
+}
+
+// operator[]: byte at index, 0 if out of bounds
+uint8_t ModbusMessageView::operator[](uint16_t index) const {
+  if (index < MV_len) {
+    return MV_data[index];
+  }
+  mb_log_w("Index %d out of bounds (>=%d).", index, MV_len);
+  return 0;
+}
+
+// Compare contents to a ModbusMessage
+bool ModbusMessageView::operator==(const ModbusMessage& m) const {
+  if (MV_len != m.size()) return false;
+  return MV_len == 0 || memcmp(MV_data, m.data(), MV_len) == 0;
+}
+
+uint8_t ModbusMessageView::getServerID() const {
+  return (MV_len >= 2) ? MV_data[0] : 0;
+}
+
+uint8_t ModbusMessageView::getFunctionCode() const {
+  return (MV_len >= 2) ? MV_data[1] : 0;
+}
+
+Error ModbusMessageView::getError() const {
+  // Do we have an error function code?
+  if (MV_len > 2 && (MV_data[1] & 0x80)) {
+    return static_cast<Modbus::Error>(MV_data[2]);
+  }
+  return SUCCESS;
+}
+
+// slice: sub-view of length bytes starting at index
+ModbusMessageView ModbusMessageView::slice(uint16_t index, uint16_t length) const {
+  if (index >= MV_len) return ModbusMessageView();
+  if (length > MV_len - index) length = MV_len - index;
+  return ModbusMessageView(MV_data + index, length);
+}
+
+// payload: data bytes of a read response, following the byte count
+ModbusMessageView ModbusMessageView::payload() const {
+  switch (getFunctionCode()) {
+  case Modbus::READ_COIL:
+  case Modbus::READ_DISCR_INPUT:
+  case Modbus::READ_HOLD_REGISTER:
+  case Modbus::READ_INPUT_REGISTER:
+  case Modbus::R_W_MULT_REGISTERS:
+    // Byte count must be there and must match the frame
+    if (MV_len >= 3 && MV_data[2] <= MV_len - 3) {
+      return ModbusMessageView(MV_data + 3, MV_data[2]);
+    }
+    break;
+  default:
+    break;
+  }
+  return ModbusMessageView();
+}
+
+// registers: span of count registers starting at byte index, cut at the end of the frame
+ModbusMessageView::RegisterSpan ModbusMessageView::registers(uint16_t index, uint16_t count) const {
+  if (index >= MV_len) return RegisterSpan();
+  uint16_t fit = (MV_len - index) >> 1;
+  return RegisterSpan(MV_data + index, count < fit ? count : fit);
+}
+
+// registers: the registers of a register read response
+ModbusMessageView::RegisterSpan ModbusMessageView::registers() const {
+  uint8_t fc = getFunctionCode();
+  if (fc == Modbus::READ_HOLD_REGISTER || fc == Modbus::READ_INPUT_REGISTER || fc == Modbus::R_W_MULT_REGISTERS) {
+    ModbusMessageView p = payload();
+    return RegisterSpan(p.data(), p.size() >> 1);
+  }
+  return RegisterSpan();
+}
+
+// get() variants for float and double values - see ModbusMessage::get()
+uint16_t ModbusMessageView::get(uint16_t index, float& v, int swapRule) const {
+  if (ModbusMessage::determineFloatOrder()) {
+    // Will it fit?
+    if (index + sizeof(float) <= MV_len) {
+      // Yes. Get the bytes of v in normalized sequence
+      uint8_t *bytes = (uint8_t *)&v;
+      for (uint8_t i = 0; i < sizeof(float); ++i) {
+        bytes[i] = MV_data[index + ModbusMessage::floatOrder[i]];
+      }
+      // Do we need to apply a swap rule?
+      if (swapRule & 0x0B) {
+        ModbusMessage::swapFloat(v, swapRule & 0x0B);
+      }
+      index += sizeof(float);
+    }
+  }
+  return index;
+}
+
+uint16_t ModbusMessageView::get(uint16_t index, double& v, int swapRule) const {
+  if (ModbusMessage::determineDoubleOrder()) {
+    // Will it fit?
+    if (index + sizeof(double) <= MV_len) {
+      // Yes. Get the bytes of v in normalized sequence
+      uint8_t *bytes = (uint8_t *)&v;
+      for (uint8_t i = 0; i < sizeof(double); ++i) {
+        bytes[i] = MV_data[index + ModbusMessage::doubleOrder[i]];
+      }
+      // Do we need to apply a swap rule?
+      if (swapRule & 0x0F) {
+        ModbusMessage::swapDouble(v, swapRule & 0x0F);
+      }
+      index += sizeof(double);
+    }
+  }
+  return index;
+}
@@ -0,0 +1,128 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_MESSAGE_VIEW_H
+#define _MODBUS_MESSAGE_VIEW_H
+#include "ModbusMessage.h"
+
+// ModbusMessageView: read-only window on a message frame owned by someone else - a ModbusMessage,
+// a receive buffer or any other byte array. Nothing is copied, so the view is only valid
+// as long as the underlying bytes are left untouched!
+// The extraction functions work like their ModbusMessage counterparts.
+class ModbusMessageView {
+public:
+  // RegisterSpan: the MSB-first 16-bit registers of a frame section, decoded on access
+  class RegisterSpan {
+  public:
+    RegisterSpan(const uint8_t *data = nullptr, uint16_t count = 0) : RS_data(data), RS_count(count) {}
+    inline uint16_t size() const { return RS_count; }
+    inline bool empty() const { return RS_count == 0; }
+    // operator[]: register at index. No bounds check!
+    inline uint16_t operator[](uint16_t index) const {
+      return (RS_data[index << 1] << 8) | RS_data[(index << 1) + 1];
+    }
+    // copyTo: decode up to count registers into an array. Returns number of registers written
+    uint16_t copyTo(uint16_t *target, uint16_t count) const;
+
+    // Iterator over the decoded register values
+    class const_iterator {
+    public:
+      explicit const_iterator(const uint8_t *p) : pos(p) {}
+      inline uint16_t operator*() const { return (pos[0] << 8) | pos[1]; }
+      inline const_iterator& operator++() { pos += 2; return *this; }
+      inline bool operator==(const const_iterator& o) const { return pos == o.pos; }
+      inline bool operator!=(const const_iterator& o) const { return pos != o.pos; }
+    protected:
+      const uint8_t *pos;
+    };
+    const_iterator begin() const { return const_iterator(RS_data); }
+    const_iterator end() const { return const_iterator(RS_data + (RS_count << 1)); }
+
+  protected:
+    const uint8_t *RS_data;      // first byte of first register
+    uint16_t RS_count;           // number of registers
+  };
+
+  // Constructor for a raw frame: server ID, function code and data, no CRC or MBAP header
+  ModbusMessageView(const uint8_t *data = nullptr, uint16_t length = 0) :
+    MV_data(data),
+    MV_len(data ? length : 0) {}
+
+  // Constructor for a ModbusMessage. The message must outlive the view
+  explicit ModbusMessageView(const ModbusMessage& m) :
+    MV_data(m.data()),
+    MV_len(m.size()) {}
+
+  // Raw access
+  inline const uint8_t *data() const { return MV_data; }
+  inline uint16_t size() const { return MV_len; }
+  inline bool empty() const { return MV_len == 0; }
+  inline operator bool() const { return MV_len >= 2; }
+  uint8_t operator[](uint16_t index) const;       // 0 if out of bounds
+
+  // Iterator interface
+  typedef const uint8_t *const_iterator;
+  const_iterator begin() const { return MV_data; }
+  const_iterator end() const { return MV_data + MV_len; }
+
+  // Compare contents to a ModbusMessage
+  bool operator==(const ModbusMessage& m) const;
+  bool operator!=(const ModbusMessage& m) const { return !(*this == m); }
+
+  // Modbus data extraction
+  uint8_t getServerID() const;      // returns Server ID or 0 if shorter than 2
+  uint8_t getFunctionCode() const;  // returns FC or 0 if shorter than 2
+  Error   getError() const;         // returns error code ([2], if [1] > 0x7F, else SUCCESS)
+
+  // slice: sub-view of length bytes starting at index, cut at the end of the frame
+  ModbusMessageView slice(uint16_t index, uint16_t length = 0xFFFF) const;
+
+  // payload: the data bytes of a read response (FCs 0x01, 0x02, 0x03, 0x04, 0x17) following
+  // the byte count. Empty if the frame is no such response or is truncated
+  ModbusMessageView payload() const;
+
+  // registers: span of count registers starting at byte index
+  RegisterSpan registers(uint16_t index, uint16_t count) const;
+  // registers: the registers of a FC 0x03, 0x04 or 0x17 response
+  RegisterSpan registers() const;
+
+  // get() - recursion stopper for template function below
+  inline uint16_t get(uint16_t index) const { return index; }
+
+  // Template function to extend getOne(index, A&) to get(index, A&, B&, C&, ...)
+  template <class T, class... Args>
+  typename std::enable_if<!std::is_pointer<T>::value, uint16_t>::type
+  get(uint16_t index, T& v, Args&... args) const {
+    uint16_t pos = getOne(index, v);
+    return get(pos, args...);
+  }
+
+  // get() variants for float and double values
+  uint16_t get(uint16_t index, float& v, int swapRules = 0) const;
+  uint16_t get(uint16_t index, double& v, int swapRules = 0) const;
+
+protected:
+  // getOne() - read a MSB-first value starting at byte index. Returns updated index
+  template <typename T> uint16_t getOne(uint16_t index, T& retval) const {
+    uint16_t sz = sizeof(retval);    // Size of value to be read
+
+    retval = 0;                      // return value
+
+    // Will it fit?
+    if (index + sz <= MV_len) {
+      // Yes. Copy it MSB first
+      while (sz) {
+        sz--;
+        retval <<= 8;
+        retval |= MV_data[index++];
+      }
+    }
+    return index;
+  }
+
+  const uint8_t *MV_data;     // first byte of the frame
+  uint16_t MV_len;            // length of the frame
+};
+
+#endif
@@ -0,0 +1,270 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusPoller.h"
+
+#if HAS_FREERTOS || IS_LINUX
+
+#include "Logging.h"
+
+// Constructor takes the minimum time between two requests
+ModbusPoller::ModbusPoller(uint32_t spacing) :
+  MP_spacing(spacing),
+  MP_lastIssue(0),
+  MP_autoPhases(0),
+  MP_stop(false),
+  MP_inFlight(0),
+  MP_changed(false),
+#if HAS_FREERTOS
+  worker(NULL)
+#elif IS_LINUX
+  worker(0)
+#endif
+  { }
+
+// Destructor: stop worker and wait for the requests still on their way.
+// Their response handlers will use the poller, so it must outlive them
+ModbusPoller::~ModbusPoller() {
+  end();
+  while (MP_inFlight) delay(1);
+}
+
+// addPoll: define a request to be sent cyclically
+int ModbusPoller::addPoll(ModbusClient& client, uint8_t serverID, uint8_t functionCode, uint16_t address, uint16_t count,
+                          uint32_t period, int32_t phase, MBOnResponse handler, uint32_t token) {
+  Poll p;
+  // Is the request valid?
+  if (period == 0 || p.request.setMessage(serverID, functionCode, address, count) != SUCCESS) {
+    mb_log_e("Invalid poll %02X/%02X @%u/%u every %u ms", serverID, functionCode, address, count, period);
+    return -1;
+  }
+  p.client = &client;
+  p.handler = handler;
+  p.token = token;
+  p.period = period;
+  p.active = true;
+  p.inFlight = false;
+
+  LOCK_GUARD(lg, MP_lock);
+  if (phase < 0) {
+    // Spread the polls: the fractional parts of n * golden ratio are distributed evenly
+    phase = ((uint64_t)(MP_autoPhases++ * 0x9E3779B9UL) * period) >> 32;
+  }
+  p.due = (uint32_t)millis() + (uint32_t)phase % period;
+  int id = MP_polls.size();
+  MP_polls.push_back(std::move(p));
+  MP_due.push(std::make_pair(MP_polls[id].due, id));
+  // The new poll may be due before the one the worker is waiting for
+  MP_changed = true;
+#if USE_MUTEX
+  MP_wake.notify_one();
+#endif
+  mb_log_d("Poll %d: %02X/%02X @%u/%u every %u ms", id, serverID, functionCode, address, count, period);
+  return id;
+}
+
+// removePoll: stop a poll. Its heap entry is dropped when it comes up next
+bool ModbusPoller::removePoll(int id) {
+  LOCK_GUARD(lg, MP_lock);
+  if (id < 0 || id >= (int)MP_polls.size() || !MP_polls[id].active) return false;
+  MP_polls[id].active = false;
+  MP_changed = true;
+#if USE_MUTEX
+  MP_wake.notify_one();
+#endif
+  return true;
+}
+
+// begin: start worker task
+void ModbusPoller::begin(int coreID) {
+  // Task already running? End it in case
+  end();
+  MP_stop = false;
+
+#if IS_LINUX
+  int rc = pthread_create(&worker, NULL, &pHandle, this);
+  if (rc) {
+    mb_log_e("Error creating poller thread: %d", rc);
+  } else {
+    mb_log_d("Poller worker started.");
+  }
+#else
+  // Start task to send the requests
+  xTaskCreatePinnedToCore((TaskFunction_t)&handleConnection, "MBpoller", CLIENT_TASK_STACK, this, 5, &worker, coreID >= 0 ? coreID : NULL);
+
+  mb_log_d("Poller task %u started.", (uint32_t)worker);
+#endif
+}
+
+#if IS_LINUX
+void *ModbusPoller::pHandle(void *p) {
+  handleConnection((ModbusPoller *)p);
+  return nullptr;
+}
+#endif
+
+// end: stop worker task
+void ModbusPoller::end() {
+  if (worker) {
+    // Let the worker finish its round and stop
+    {
+      LOCK_GUARD(lg, MP_lock);
+      MP_stop = true;
+    }
+#if USE_MUTEX
+    MP_wake.notify_all();
+#endif
+#if IS_LINUX
+    pthread_join(worker, NULL);
+    worker = 0;
+#else
+    while (eTaskGetState(worker) != eTaskState::eDeleted)
+    {
+      vTaskDelay(5 / portTICK_PERIOD_MS);
+    }
+    worker = nullptr;
+#endif
+    mb_log_d("Poller worker stopped.");
+  }
+}
+
+// getStats: statistics of a single poll, or summed up over all polls
+ModbusPoller::PollStats ModbusPoller::getStats(int id) {
+  LOCK_GUARD(lg, MP_lock);
+  if (id >= 0) {
+    if (id < (int)MP_polls.size()) return MP_polls[id].stats;
+    return PollStats();
+  }
+  PollStats sum;
+  uint64_t jitterSum = 0;
+  uint32_t jitterCount = 0;
+  for (auto& p : MP_polls) {
+    sum.issued += p.stats.issued;
+    sum.responses += p.stats.responses;
+    sum.errors += p.stats.errors;
+    sum.overruns += p.stats.overruns;
+    if (p.stats.maxJitter > sum.maxJitter) sum.maxJitter = p.stats.maxJitter;
+    if (p.stats.issued) {
+      jitterSum += p.stats.lastJitter;
+      jitterCount++;
+    }
+  }
+  if (jitterCount) sum.lastJitter = jitterSum / jitterCount;
+  return sum;
+}
+
+// resetStats: start over with the statistics of all polls
+void ModbusPoller::resetStats() {
+  LOCK_GUARD(lg, MP_lock);
+  for (auto& p : MP_polls) {
+    p.stats = PollStats();
+  }
+}
+
+// runDue: send all requests due now. Returns ms until the next one is due
+uint32_t ModbusPoller::runDue() {
+  while (1) {
+    int id = -1;
+    ModbusClient *client = nullptr;
+    ModbusMessage request;
+    uint32_t token = 0;
+    {
+      LOCK_GUARD(lg, MP_lock);
+      uint32_t now = millis();
+      MP_changed = false;
+      // Anything due?
+      if (MP_due.empty()) return 0xFFFFFFFF;
+      uint32_t due = MP_due.top().first;
+      if ((int32_t)(due - now) > 0) return due - now;
+      // Keep the distance to the request before
+      if (MP_spacing && now - MP_lastIssue < MP_spacing) return MP_spacing - (now - MP_lastIssue);
+
+      id = MP_due.top().second;
+      MP_due.pop();
+      Poll& p = MP_polls[id];
+      // Removed in the meantime?
+      if (!p.active) continue;
+
+      // Schedule the next cycle. Cycles that have passed already are lost
+      p.due = due + p.period;
+      while ((int32_t)(now - p.due) >= 0) {
+        p.due += p.period;
+        p.stats.overruns++;
+      }
+      MP_due.push(std::make_pair(p.due, id));
+
+      // Is the previous request still on its way?
+      if (p.inFlight) {
+        p.stats.overruns++;
+        continue;
+      }
+
+      p.inFlight = true;
+      p.stats.issued++;
+      p.stats.lastJitter = now - due;
+      if (p.stats.lastJitter > p.stats.maxJitter) p.stats.maxJitter = p.stats.lastJitter;
+      MP_lastIssue = now;
+      client = p.client;
+      request = p.request;
+      token = p.token;
+    }
+
+    // Send it outside the lock - the response may come in before addRequestM() returns
+    uint8_t serverID = request.getServerID();
+    uint8_t functionCode = request.getFunctionCode();
+    MP_inFlight++;
+    Error e = client->addRequestM(std::move(request), token, [this, id](ModbusMessage response, uint32_t) {
+      done(id, response, true);
+      // The poller must not be used after this point
+      MP_inFlight--;
+    });
+    if (e != SUCCESS) {
+      MP_inFlight--;
+      // The client did not take it, report as error
+      ModbusMessage response;
+      response.setError(serverID, functionCode, e);
+      done(id, response, false);
+    }
+  }
+}
+
+// done: a request of poll id has been answered - or refused by the client
+void ModbusPoller::done(int id, const ModbusMessage& response, bool answered) {
+  MBOnResponse handler;
+  uint32_t token;
+  {
+    LOCK_GUARD(lg, MP_lock);
+    Poll& p = MP_polls[id];
+    p.inFlight = false;
+    if (answered) p.stats.responses++;
+    if (response.getError() != SUCCESS) p.stats.errors++;
+    handler = p.handler;
+    token = p.token;
+  }
+  if (handler) handler(response, token);
+}
+
+// sleep: wait up to ms for the next poll to be due, a change of the polls or the worker to stop
+void ModbusPoller::sleep(uint32_t ms) {
+#if USE_MUTEX
+  std::unique_lock<std::mutex> lk(MP_lock);
+  MP_wake.wait_for(lk, std::chrono::milliseconds(ms), [this] { return MP_changed || MP_stop; });
+#else
+  // Nobody to wake us up - look again after 10ms at the latest for new polls
+  delay(ms > 10 ? 10 : (ms < 1 ? 1 : ms));
+#endif
+}
+
+// handleConnection: worker task
+// Sends the requests when they are due, sleeps in between
+void ModbusPoller::handleConnection(ModbusPoller *instance) {
+  while (!instance->MP_stop) {
+    instance->sleep(instance->runDue());
+  }
+#if HAS_FREERTOS
+  vTaskDelete(NULL);
+#endif
+}
+
+#endif  // HAS_FREERTOS || IS_LINUX
@@ -0,0 +1,129 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_POLLER_H
+#define _MODBUS_POLLER_H
+
+#include "options.h"
+
+#if HAS_FREERTOS || IS_LINUX
+
+#include "ModbusClient.h"
+#include <vector>
+#include <queue>
+#include <atomic>
+#if USE_MUTEX
+#include <condition_variable>       // NOLINT
+#endif
+
+// ModbusPoller: issues requests cyclically, each with its own period, to one or more clients.
+// Due requests are kept in a min-heap, so the poller only looks at the next one due,
+// however many polls there are. Each poll has at most one request on its way: if it is
+// still waiting for the response when it is due again, that cycle is skipped and counted
+// as an overrun instead of piling up requests in the client queue.
+//
+//   ModbusPoller Poller;
+//   Poller.addPoll(MB, 1, READ_HOLD_REGISTER, 100, 10, 1000, -1, handler, 1);  // every second
+//   Poller.addPoll(MB, 2, READ_INPUT_REGISTER, 0, 4, 250, -1, handler, 2);     // 4 times a second
+//   Poller.begin();
+class ModbusPoller {
+public:
+  // Constructor takes the minimum time in ms between two requests (0: no limit)
+  explicit ModbusPoller(uint32_t spacing = 0);
+
+  // Destructor: stop worker and wait for the requests still on their way
+  ~ModbusPoller();
+
+  // addPoll: define a request to be sent to serverID via client every period ms.
+  // phase is the offset in ms into the period for the first request. With a negative phase
+  // the polls will be spread evenly over their periods.
+  // Returns the poll ID for the other calls or -1 if the request is invalid
+  int addPoll(ModbusClient& client, uint8_t serverID, uint8_t functionCode, uint16_t address, uint16_t count,
+              uint32_t period, int32_t phase = -1, MBOnResponse handler = nullptr, uint32_t token = 0);
+
+  // removePoll: stop a poll. Returns false if the ID is unknown
+  bool removePoll(int id);
+
+  // begin: start worker task
+  void begin(int coreID = -1);
+
+  // end: stop the worker
+  void end();
+
+  // Poll statistics, times in ms
+  struct PollStats {
+    uint32_t issued;            // requests sent
+    uint32_t responses;         // responses received
+    uint32_t errors;            // error responses, including requests the client refused
+    uint32_t overruns;          // cycles skipped as the previous request was not done yet
+    uint32_t lastJitter;        // delay of the last request against its schedule
+    uint32_t maxJitter;         // longest delay against schedule
+    PollStats() : issued(0), responses(0), errors(0), overruns(0), lastJitter(0), maxJitter(0) {}
+  };
+
+  // getStats: statistics of a single poll, or summed up over all polls for id -1.
+  // The summary has the highest maxJitter and the average lastJitter
+  PollStats getStats(int id = -1);
+
+  // resetStats: start over with the statistics of all polls
+  void resetStats();
+
+protected:
+  // Poll: a poll definition and its state
+  struct Poll {
+    ModbusClient *client;       // client to send requests with
+    ModbusMessage request;      // the request to send
+    MBOnResponse handler;       // response handler
+    uint32_t token;             // token for the handler
+    uint32_t period;            // cycle time in ms
+    uint32_t due;               // millis() the next request is due
+    bool active;                // still to be polled
+    bool inFlight;              // a request is on its way
+    PollStats stats;            // statistics
+  };
+
+  // DueOrder: heap order of (due time, poll ID). Wrap-around safe for times less than 24 days apart
+  struct DueOrder {
+    bool operator()(const std::pair<uint32_t, int>& a, const std::pair<uint32_t, int>& b) const {
+      return (int32_t)(a.first - b.first) > 0;
+    }
+  };
+
+  // runDue: send all requests due now. Returns ms until the next one is due
+  uint32_t runDue();
+
+  // sleep: wait up to ms for the next poll to be due, a change of the polls or the worker to stop
+  void sleep(uint32_t ms);
+
+  // done: a request of poll id has been answered - or refused by the client
+  void done(int id, const ModbusMessage& response, bool answered);
+
+  // handleConnection: worker task method
+  static void handleConnection(ModbusPoller *instance);
+#if IS_LINUX
+  static void *pHandle(void *p);
+#endif
+
+  std::vector<Poll> MP_polls;     // all polls, the index is the poll ID
+  std::priority_queue<std::pair<uint32_t, int>, std::vector<std::pair<uint32_t, int>>, DueOrder> MP_due; // polls by due time
+  uint32_t MP_spacing;            // minimum time between two requests
+  uint32_t MP_lastIssue;          // millis() of the last request sent
+  uint32_t MP_autoPhases;         // number of polls given evenly spread phases
+  std::atomic<bool> MP_stop;      // Worker shall stop
+  std::atomic<uint32_t> MP_inFlight; // Requests sent, but not answered yet
+  bool MP_changed;                // Polls were added or removed since the worker looked last
+#if HAS_FREERTOS
+  TaskHandle_t worker;            // Worker task
+#elif IS_LINUX
+  pthread_t worker;               // Worker thread
+#endif
+#if USE_MUTEX
+  std::mutex MP_lock;             // Protects MP_polls, MP_due and MP_changed
+  std::condition_variable MP_wake; // Wakes up the worker
+#endif
+};
+
+#endif  // HAS_FREERTOS || IS_LINUX
+
+#endif  // INCLUDE GUARD
@@ -82,6 +82,9 @@ enum Error : uint8_t {
   ASCII_CRC_ERR          = 0xEE,
   ASCII_INVALID_CHAR     = 0xEF,
   BROADCAST_ERROR        = 0xF0,
+  SERVER_QUARANTINED     = 0xF1,
+  REQUEST_EXPIRED        = 0xF2,
+  REQUEST_CANCELLED      = 0xF3,
   UNDEFINED_ERROR        = 0xFF  // otherwise uncovered communication error
 };
 
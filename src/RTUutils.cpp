@@ -5,68 +5,22 @@
 #include "options.h"
 #include "ModbusMessage.h"
 #include "RTUutils.h"
+#include "ModbusCRC.h"
 #include "Logging.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
-#if HAS_FREERTOS
+#if HAS_FREERTOS || IS_LINUX
 // calcCRC: calculate Modbus CRC16 on a given array of bytes
 uint16_t RTUutils::calcCRC(const uint8_t *data, uint16_t len) {
-  // CRC16 pre-calculated tables
-  const uint8_t crcHiTable[] = {
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81,
-    0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01,
-    0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81,
-    0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01,
-    0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81,
-    0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01,
-    0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81,
-    0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01,
-    0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81,
-    0x40
-  };
-
-  const uint8_t crcLoTable[] = {
-    0x00, 0xC0, 0xC1, 0x01, 0xC3, 0x03, 0x02, 0xC2, 0xC6, 0x06, 0x07, 0xC7, 0x05, 0xC5, 0xC4,
-    0x04, 0xCC, 0x0C, 0x0D, 0xCD, 0x0F, 0xCF, 0xCE, 0x0E, 0x0A, 0xCA, 0xCB, 0x0B, 0xC9, 0x09,
-    0x08, 0xC8, 0xD8, 0x18, 0x19, 0xD9, 0x1B, 0xDB, 0xDA, 0x1A, 0x1E, 0xDE, 0xDF, 0x1F, 0xDD,
-    0x1D, 0x1C, 0xDC, 0x14, 0xD4, 0xD5, 0x15, 0xD7, 0x17, 0x16, 0xD6, 0xD2, 0x12, 0x13, 0xD3,
-    0x11, 0xD1, 0xD0, 0x10, 0xF0, 0x30, 0x31, 0xF1, 0x33, 0xF3, 0xF2, 0x32, 0x36, 0xF6, 0xF7,
-    0x37, 0xF5, 0x35, 0x34, 0xF4, 0x3C, 0xFC, 0xFD, 0x3D, 0xFF, 0x3F, 0x3E, 0xFE, 0xFA, 0x3A,
-    0x3B, 0xFB, 0x39, 0xF9, 0xF8, 0x38, 0x28, 0xE8, 0xE9, 0x29, 0xEB, 0x2B, 0x2A, 0xEA, 0xEE,
-    0x2E, 0x2F, 0xEF, 0x2D, 0xED, 0xEC, 0x2C, 0xE4, 0x24, 0x25, 0xE5, 0x27, 0xE7, 0xE6, 0x26,
-    0x22, 0xE2, 0xE3, 0x23, 0xE1, 0x21, 0x20, 0xE0, 0xA0, 0x60, 0x61, 0xA1, 0x63, 0xA3, 0xA2,
-    0x62, 0x66, 0xA6, 0xA7, 0x67, 0xA5, 0x65, 0x64, 0xA4, 0x6C, 0xAC, 0xAD, 0x6D, 0xAF, 0x6F,
-    0x6E, 0xAE, 0xAA, 0x6A, 0x6B, 0xAB, 0x69, 0xA9, 0xA8, 0x68, 0x78, 0xB8, 0xB9, 0x79, 0xBB,
-    0x7B, 0x7A, 0xBA, 0xBE, 0x7E, 0x7F, 0xBF, 0x7D, 0xBD, 0xBC, 0x7C, 0xB4, 0x74, 0x75, 0xB5,
-    0x77, 0xB7, 0xB6, 0x76, 0x72, 0xB2, 0xB3, 0x73, 0xB1, 0x71, 0x70, 0xB0, 0x50, 0x90, 0x91,
-    0x51, 0x93, 0x53, 0x52, 0x92, 0x96, 0x56, 0x57, 0x97, 0x55, 0x95, 0x94, 0x54, 0x9C, 0x5C,
-    0x5D, 0x9D, 0x5F, 0x9F, 0x9E, 0x5E, 0x5A, 0x9A, 0x9B, 0x5B, 0x99, 0x59, 0x58, 0x98, 0x88,
-    0x48, 0x49, 0x89, 0x4B, 0x8B, 0x8A, 0x4A, 0x4E, 0x8E, 0x8F, 0x4F, 0x8D, 0x4D, 0x4C, 0x8C,
-    0x44, 0x84, 0x85, 0x45, 0x87, 0x47, 0x46, 0x86, 0x82, 0x42, 0x43, 0x83, 0x41, 0x81, 0x80,
-    0x40
-  };
-
-  uint8_t crcHi = 0xFF;
-  uint8_t crcLo = 0xFF;
-  uint8_t index;
-
-  while (len--) {
-    index = crcLo ^ *data++;
-    crcLo = crcHi ^ crcHiTable[index];
-    crcHi = crcLoTable[index];
-  }
-  return (crcHi << 8 | crcLo);
+  return ModbusCRC::calc(data, len);
 }
 
 // calcCRC: calculate Modbus CRC16 on a given message
-uint16_t RTUutils::calcCRC(ModbusMessage msg) {
+uint16_t RTUutils::calcCRC(const ModbusMessage& msg) {
   return calcCRC(msg.data(), msg.size());
 }
 
@@ -84,12 +38,12 @@ bool RTUutils::validCRC(const uint8_t *data, uint16_t len, uint16_t CRC) {
 }
 
 // validCRC #3: check the given CRC in a message for correctness
-bool RTUutils::validCRC(ModbusMessage msg) {
+bool RTUutils::validCRC(const ModbusMessage& msg) {
   return validCRC(msg.data(), msg.size() - 2, msg[msg.size() - 2] | (msg[msg.size() - 1] << 8));
 }
 
 // validCRC #4: check the CRC of a message against a given one for equality
-bool RTUutils::validCRC(ModbusMessage msg, uint16_t CRC) {
+bool RTUutils::validCRC(const ModbusMessage& msg, uint16_t CRC) {
   return validCRC(msg.data(), msg.size(), CRC);
 }
 
@@ -111,82 +65,208 @@ uint32_t RTUutils::calculateInterval(uint32_t baudRate) {
   return interval;
 }
 
+// encodeASCII: write len bytes as 2*len upper case hex digits into target
+uint16_t RTUutils::encodeASCII(const uint8_t *data, uint16_t len, uint8_t *target) {
+  uint16_t done = 0;
+#if defined(__SSE2__)
+  // 8 bytes per step: split into nibbles, interleave them and add '0', or 'A'-10 for 10..15
+  const __m128i lowNibble = _mm_set1_epi8(0x0F);
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i zero = _mm_set1_epi8('0');
+  const __m128i letter = _mm_set1_epi8('A' - '0' - 10);
+  for (; done + 8 <= len; done += 8) {
+    __m128i x = _mm_loadl_epi64((const __m128i *)(data + done));
+    __m128i n = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(x, 4), lowNibble), _mm_and_si128(x, lowNibble));
+    n = _mm_add_epi8(_mm_add_epi8(n, zero), _mm_and_si128(_mm_cmpgt_epi8(n, nine), letter));
+    _mm_storeu_si128((__m128i *)(target + 2 * done), n);
+  }
+#elif defined(__ARM_NEON)
+  const uint8x8_t nine = vdup_n_u8(9);
+  const uint8x8_t zero = vdup_n_u8('0');
+  const uint8x8_t letter = vdup_n_u8('A' - '0' - 10);
+  for (; done + 8 <= len; done += 8) {
+    uint8x8_t x = vld1_u8(data + done);
+    uint8x8x2_t n;
+    n.val[0] = vshr_n_u8(x, 4);
+    n.val[1] = vand_u8(x, vdup_n_u8(0x0F));
+    n.val[0] = vadd_u8(vadd_u8(n.val[0], zero), vand_u8(vcgt_u8(n.val[0], nine), letter));
+    n.val[1] = vadd_u8(vadd_u8(n.val[1], zero), vand_u8(vcgt_u8(n.val[1], nine), letter));
+    // vst2 interleaves high and low nibbles
+    vst2_u8(target + 2 * done, n);
+  }
+#endif
+  for (; done < len; ++done) {
+    target[2 * done] = ASCIIwrite[(data[done] >> 4) & 0x0F];
+    target[2 * done + 1] = ASCIIwrite[data[done] & 0x0F];
+  }
+  return 2 * len;
+}
+
+// decodeASCII: convert len hex digits (upper or lower case) into len/2 bytes.
+// source and target may be the same. Returns the number of bytes or -1 for an invalid character
+int16_t RTUutils::decodeASCII(const uint8_t *source, uint16_t len, uint8_t *target) {
+  uint16_t done = 0;
+  len &= 0xFFFE;
+#if defined(__SSE2__)
+  // 16 characters per step. Signed compares are fine: characters >= 0x80 are invalid anyway
+  const __m128i caseBit = _mm_set1_epi8(0x20);
+  for (; done + 16 <= len; done += 16) {
+    __m128i c = _mm_loadu_si128((const __m128i *)(source + done));
+    __m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i lower = _mm_or_si128(c, caseBit);
+    __m128i isHex = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    if (_mm_movemask_epi8(_mm_or_si128(isDigit, isHex)) != 0xFFFF) return -1;
+    __m128i n = _mm_or_si128(_mm_and_si128(isDigit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                             _mm_and_si128(isHex, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+    // Each 16-bit lane has the high nibble in its low byte: combine and pack to bytes
+    n = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(n, 4), _mm_set1_epi16(0x00F0)), _mm_srli_epi16(n, 8));
+    _mm_storel_epi64((__m128i *)(target + done / 2), _mm_packus_epi16(n, n));
+  }
+#elif defined(__ARM_NEON)
+  const uint8x8_t nine = vdup_n_u8(9);
+  const uint8x8_t five = vdup_n_u8(5);
+  const uint8x8_t caseBit = vdup_n_u8(0x20);
+  for (; done + 16 <= len; done += 16) {
+    // vld2 separates the high (val[0]) and low (val[1]) nibble characters
+    uint8x8x2_t c = vld2_u8(source + done);
+    uint8x8_t valid = vdup_n_u8(0xFF);
+    for (uint8_t k = 0; k < 2; ++k) {
+      uint8x8_t d = vsub_u8(c.val[k], vdup_n_u8('0'));
+      uint8x8_t h = vsub_u8(vorr_u8(c.val[k], caseBit), vdup_n_u8('a'));
+      uint8x8_t isDigit = vcle_u8(d, nine);
+      valid = vand_u8(valid, vorr_u8(isDigit, vcle_u8(h, five)));
+      c.val[k] = vbsl_u8(isDigit, d, vadd_u8(h, vdup_n_u8(10)));
+    }
+    if (vget_lane_u64(vreinterpret_u64_u8(valid), 0) != ~0ULL) return -1;
+    vst1_u8(target + done / 2, vorr_u8(vshl_n_u8(c.val[0], 4), c.val[1]));
+  }
+#endif
+  for (; done < len; done += 2) {
+    uint8_t hi = (source[done] & 0x80) ? 0xFF : ASCIIread[source[done]];
+    uint8_t lo = (source[done + 1] & 0x80) ? 0xFF : ASCIIread[source[done + 1]];
+    if ((hi | lo) & 0xF0) return -1;
+    target[done / 2] = (hi << 4) | lo;
+  }
+  return len / 2;
+}
+
 // send: send a message via Serial, watching interval times - including CRC!
 void RTUutils::send(Stream& serial, unsigned long& lastMicros, uint32_t interval, RTScallback rts, const uint8_t *data, uint16_t len, bool ASCIImode) {
-  // Clear serial buffers
-  while (serial.available()) serial.read();
-  
   // Treat ASCII differently
   if (ASCIImode) {
+    // Clear serial buffers
+    while (serial.available()) serial.read();
+
+    // Yes, ASCII mode. Build the complete frame to write it in one go:
+    // lead-in, two characters per byte and for the LRC, lead-out CR LF.
+    // Messages longer than a Modbus frame can be are written in more than one chunk.
+    uint8_t frame[2 * 256 + 5];
+    uint16_t pos = 0;
+    uint16_t cnt = len;
+    const uint8_t *cp = data;
+    uint8_t lrc = 0;
+
     // Toggle rtsPin, if necessary
     rts(HIGH);
-    // Yes, ASCII mode. Send lead-in
-    serial.write(':');
-
-    uint16_t cnt = len;
-    uint8_t crc = 0;
-    uint8_t *cp = (uint8_t *)data;
-
-    // Loop over all bytes of the message
-    while (cnt--) {
-      // Write two nibbles as ASCII characters
-      serial.write(ASCIIwrite[(*cp >> 4) & 0x0F]);
-      serial.write(ASCIIwrite[*cp & 0x0F]);
-      // Advance CRC
-      crc += *cp;
-      // Next byte
-      cp++;
+    frame[pos++] = ':';
+    while (cnt) {
+      // Take as many bytes as will fit, leaving room for LRC and lead-out
+      uint16_t chunk = (sizeof(frame) - 4 - pos) / 2;
+      if (chunk > cnt) chunk = cnt;
+      for (uint16_t i = 0; i < chunk; ++i) {
+        lrc += cp[i];
+      }
+      pos += encodeASCII(cp, chunk, frame + pos);
+      cp += chunk;
+      cnt -= chunk;
+      if (cnt) {
+        serial.write(frame, pos);
+        pos = 0;
+      }
     }
-    // Finalize CRC (2's complement)
-    crc = ~crc;
-    crc++;
-    // Write ist - two nibbles as ASCII characters
-    serial.write(ASCIIwrite[(crc >> 4) & 0x0F]);
-    serial.write(ASCIIwrite[crc & 0x0F]);
-    
-    // Send lead-out
-    serial.write("\r");
+    // Finalize LRC (2's complement) and write it as two nibbles
+    lrc = -lrc;
+    pos += encodeASCII(&lrc, 1, frame + pos);
+    // Lead-out
+    frame[pos++] = '\r';
+    frame[pos++] = '\n';
+    serial.write(frame, pos);
     serial.flush();
     
     // Toggle rtsPin, if necessary
     rts(LOW);
+    // Mark end-of-message time for next interval
+    lastMicros = micros();
   } else {
     // RTU mode
     uint16_t crc16 = calcCRC(data, len);
+    // CRC in LSB order
+    uint8_t crc[2] = { (uint8_t)(crc16 & 0xFF), (uint8_t)((crc16 >> 8) & 0xFF) };
+    sendRTU(serial, lastMicros, interval, rts, data, len, crc, 2);
+  }
 
-    // Respect interval - we must not toggle rtsPin before
-    if (micros() - lastMicros < interval) delayMicroseconds(interval - (micros() - lastMicros));
+  mb_log_buf_d(data, len);
+}
 
-    // Toggle rtsPin, if necessary
-    rts(HIGH);
-    delayMicroseconds(120);
-    // Write message
-    serial.write(data, len);
-    // Write CRC in LSB order
-    serial.write(crc16 & 0xff);
-    serial.write((crc16 >> 8) & 0xFF);
-    serial.flush();
-    
-    delayMicroseconds(120);
-    // Toggle rtsPin, if necessary
-    rts(LOW);
+// send: send a message via Serial, watching interval times - including CRC!
+// In RTU mode the CRC is put into the tailroom of the message to write it in one go.
+void RTUutils::send(Stream& serial, unsigned long& lastMicros, uint32_t interval, RTScallback rts, ModbusMessage& raw, bool ASCIImode) {
+  if (ASCIImode) {
+    send(serial, lastMicros, interval, rts, raw.data(), raw.size(), ASCIImode);
+  } else {
+    uint16_t crc16 = calcCRC(raw.data(), raw.size());
+    // Write CRC in LSB order behind the message
+    uint8_t *tail = raw.tailroom();
+    tail[0] = crc16 & 0xFF;
+    tail[1] = (crc16 >> 8) & 0xFF;
+    sendRTU(serial, lastMicros, interval, rts, raw.data(), raw.size() + 2, nullptr, 0);
+    mb_log_buf_d(raw.data(), raw.size());
   }
+}
+
+// sendRTU: put out a RTU frame, optionally followed by a separate tail, watching interval times
+void RTUutils::sendRTU(Stream& serial, unsigned long& lastMicros, uint32_t interval, RTScallback rts, const uint8_t *data, uint16_t len, const uint8_t *tail, uint16_t tailLen) {
+  // Clear serial buffers
+  while (serial.available()) serial.read();
+
+  // Respect interval - we must not toggle rtsPin before
+  if (micros() - lastMicros < interval) delayMicroseconds(interval - (micros() - lastMicros));
+
+  // Toggle rtsPin, if necessary
+  rts(HIGH);
+  delayMicroseconds(120);
+  // Write message
+  serial.write(data, len);
+  if (tailLen) serial.write(tail, tailLen);
+  serial.flush();
+  
+  delayMicroseconds(120);
+  // Toggle rtsPin, if necessary
+  rts(LOW);
   // Mark end-of-message time for next interval
   lastMicros = micros();
-
-  mb_log_buf_d(data, len);
 }
 
-// send: send a message via Serial, watching interval times - including CRC!
-void RTUutils::send(Stream& serial, unsigned long& lastMicros, uint32_t interval, RTScallback rts, ModbusMessage raw, bool ASCIImode) {
-  send(serial, lastMicros, interval, rts, raw.data(), raw.size(), ASCIImode);
+// waitData: wait up to timeout microseconds for data to arrive on serial.
+// Linux blocks on the device with poll(). FreeRTOS has no event for a Stream, so sleeps a
+// tick if the wait is long enough, and returns at once otherwise to have the caller spin.
+bool RTUutils::waitData(Stream& serial, uint32_t timeout) {
+  if (serial.available()) return true;
+#if IS_LINUX
+  return serial.waitAvailable(timeout) > 0;
+#else
+  if (timeout >= 2000 * portTICK_PERIOD_MS) {
+    delay(1);
+  }
+  return serial.available() > 0;
+#endif
 }
 
 // receive: get (any) message from Serial, taking care of timeout and interval
-ModbusMessage RTUutils::receive(uint8_t caller, Stream& serial, uint32_t timeout, unsigned long& lastMicros, uint32_t interval, bool ASCIImode, bool skipLeadingZeroBytes) {
-  // Allocate initial receive buffer size: 1 block of BUFBLOCKSIZE bytes
-  const uint16_t BUFBLOCKSIZE(512);
-  uint8_t *buffer = new uint8_t[BUFBLOCKSIZE];
+ModbusMessage RTUutils::receive(uint8_t caller, Stream& serial, uint32_t timeout, unsigned long& lastMicros, uint32_t interval, bool ASCIImode, bool skipLeadingZeroBytes, RTUtiming *timing, uint8_t *rxBuffer) {
+  // Use the caller's receive buffer, or allocate one for this call
+  const uint16_t BUFBLOCKSIZE(RTU_RXBUFSIZE);
+  uint8_t *buffer = rxBuffer ? rxBuffer : new uint8_t[BUFBLOCKSIZE];
   ModbusMessage rv;
 
   // Index into buffer
@@ -209,6 +289,10 @@ ModbusMessage RTUutils::receive(uint8_t caller, Stream& serial, uint32_t timeout
   if (!ASCIImode) {
     // Yes.
     state = WAIT_DATA;
+    // Running CRC of the bytes received
+    ModbusCRC::Running crc;
+    // Longest pause between two bytes of the frame
+    unsigned long charGap = 0;
     // interval tracker 
     lastMicros = micros();
   
@@ -226,27 +310,35 @@ ModbusMessage RTUutils::receive(uint8_t caller, Stream& serial, uint32_t timeout
           if (b > 0 || !skipLeadingZeroBytes) {
             // No, we can go process it regularly
             buffer[bufferPtr++] = b;
+            crc.add(b);
             state = IN_PACKET;
           } 
         } else {
           // No, we had no byte. Just check the timeout period
-          if (millis() - TimeOut >= timeout) {
+          unsigned long waited = millis() - TimeOut;
+          if (waited >= timeout) {
             rv.push_back(TIMEOUT);
             state = FINISHED;
+          } else {
+            // Sleep until data arrives, but not beyond the timeout
+            waitData(serial, (timeout - waited) * 1000);
           }
-          delay(1);
         }
         break;
       // IN_PACKET: read data until a gap of at least _interval time passed without another byte arriving
       case IN_PACKET:
-        // tight loop until finished reading or error
+        // loop until finished reading or error
         while (state == IN_PACKET) {
           // Is there a byte?
           while (serial.available()) {
-            // Yes, collect it
-            buffer[bufferPtr++] = serial.read();
-            // Mark time of last byte
-            lastMicros = micros();
+            // Yes, collect it and fold it into the CRC right away
+            b = serial.read();
+            buffer[bufferPtr++] = b;
+            crc.add(b);
+            // Mark time of last byte, keeping the longest pause within the frame
+            unsigned long now = micros();
+            if (now - lastMicros > charGap) charGap = now - lastMicros;
+            lastMicros = now;
             // Buffer full?
             if (bufferPtr >= BUFBLOCKSIZE) {
               // Yes. Something fishy here - bail out!
@@ -258,12 +350,20 @@ ModbusMessage RTUutils::receive(uint8_t caller, Stream& serial, uint32_t timeout
           // No more byte read
           if (state == IN_PACKET) {
             // Are we past the interval gap?
-            if (micros() - lastMicros >= interval) {
+            unsigned long silence = micros() - lastMicros;
+            if (silence >= interval) {
               // Yes, terminate reading
-              mb_log_v("%c/%ldus without data after %u", (const char)caller, micros() - lastMicros, bufferPtr);
+              mb_log_v("%c/%ldus without data after %u", (const char)caller, silence, bufferPtr);
+              if (timing) {
+                timing->gap = silence;
+                timing->charGap = charGap;
+                timing->length = bufferPtr;
+              }
               state = DATA_READ;
               break;
             }
+            // No. Wait for the next byte or the end of the gap, whatever comes first
+            waitData(serial, interval - silence);
           }
         }
         break;
@@ -274,15 +374,13 @@ ModbusMessage RTUutils::receive(uint8_t caller, Stream& serial, uint32_t timeout
         mb_log_buf_v(buffer, bufferPtr);
         if (bufferPtr >= 4)
         {
-          // Yes. Check CRC
-          if (!validCRC(buffer, bufferPtr)) {
+          // Yes. Check CRC - it was calculated while the bytes came in
+          if (!crc.valid()) {
             // Ooops. CRC is wrong.
             rv.push_back(CRC_ERROR);
           } else {
-            // CRC was fine, Now allocate response object without the CRC
-            for (uint16_t i = 0; i < bufferPtr - 2; ++i) {
-              rv.push_back(buffer[i]);
-            }
+            // CRC was fine, Now fill response object without the CRC in one go
+            rv.add(buffer, bufferPtr - 2);
           }
         } else {
           // No, packet was too short for anything usable. Return error
@@ -299,141 +397,103 @@ ModbusMessage RTUutils::receive(uint8_t caller, Stream& serial, uint32_t timeout
       }
     }
   } else {
-    // We are in ASCII mode.
+    // We are in ASCII mode. The frame characters are collected first and decoded
+    // in one go when the lead-out has arrived.
     state = A_WAIT_DATA;
 
-    // Track nibbles in a byte
-    bool byteComplete = true; 
-
-    // Track bytes read
-    bool hadBytes = false;
-
-    // ASCII crc byte
-    uint8_t crc = 0;
-
     while (state != A_FINISHED) {
-      // Always watch timeout - 1s
-      if (millis() - TimeOut >= timeout) {
+      // Always watch timeout
+      unsigned long waited = millis() - TimeOut;
+      if (waited >= timeout) {
         // Timeout! Bail out with error
         rv.push_back(TIMEOUT);
         state = A_FINISHED;
-      } else {
-        // Still in time. Check for another byte on serial
-        if (!hadBytes && serial.available()) {
-          b = serial.read();
-          if (b >= 0) {
-            hadBytes = true;
-          }
-        }
-        // Only use state machine with new data arrived
-        if (hadBytes) {
-          // First reset timeout
-          TimeOut = millis();
-          // Is it a valid character?
+        break;
+      }
+      // Still in time. Sleep until some data arrives or the timeout is reached
+      if (!waitData(serial, (timeout - waited) * 1000)) continue;
+
+      // Take all there is
+      while (state != A_FINISHED && (b = serial.read()) >= 0) {
+        // First reset timeout
+        TimeOut = millis();
+        switch (state) {
+        // A_WAIT_DATA: await lead-in byte ':'
+        case A_WAIT_DATA:
+          // Is it a valid character at all?
           if ((b & 0x80) || ASCIIread[b] == 0xFF) {
             // No. Report error and leave.
-            rv.clear();
             rv.push_back(ASCII_INVALID_CHAR);
-            hadBytes = false;
+            state = A_FINISHED;
+          } else if (b == ':') {
+            // Lead-in. Proceed to data read state
+            state = A_DATA;
+          }
+          break;
+        // A_DATA: collect characters up to the first lead-out byte
+        case A_DATA:
+          if (b == '\r') {
+            state = A_WAIT_LEAD_OUT;
+          } else if (b == ':') {
+            // Another lead-in is garbage
+            rv.push_back(ASCII_INVALID_CHAR);
+            state = A_FINISHED;
+          } else if (bufferPtr >= BUFBLOCKSIZE) {
+            // Too long for any Modbus message
+            rv.push_back(PACKET_LENGTH_ERROR);
             state = A_FINISHED;
           } else {
-            // Yes, is valid. Furtheron use interpreted byte
-            b = ASCIIread[b];
-            switch (state) {
-            // A_WAIT_DATA: await lead-in byte ':'
-            case A_WAIT_DATA:
-              // Is it the lead-in?
-              if (b == 0xF0) {
-                // Yes, proceed to data read state
-                state = A_DATA;
-              }
-              // byte was consumed in any case
-              hadBytes = false;
-              break;
-            // A_DATA: read data as it comes
-            case A_DATA:
-              // Lead-out byte 1 received?
-              if (b == 0xF1) {
-                // Yes. Was last buffer byte completed?
-                if (byteComplete) {
-                  // Yes. Move to final state
-                  state = A_WAIT_LEAD_OUT;
-                } else {
-                  // No, signal with error
-                  rv.push_back(PACKET_LENGTH_ERROR);
-                  state = A_FINISHED;
-                }
+            // Hex digits are checked when decoding
+            buffer[bufferPtr++] = b;
+          }
+          break;
+        // A_WAIT_LEAD_OUT: await second lead-out byte
+        case A_WAIT_LEAD_OUT:
+          if (b == '\n') {
+            // Lead-out byte 2 received. Did we get complete bytes?
+            if (bufferPtr & 1) {
+              // No, signal with error
+              rv.push_back(PACKET_LENGTH_ERROR);
+            } else {
+              // Yes. Decode the characters in place
+              int16_t bytes = decodeASCII(buffer, bufferPtr, buffer);
+              mb_log_v("%c/", (const char)caller);
+              if (bytes < 0) {
+                rv.push_back(ASCII_INVALID_CHAR);
+              // Did we get a sensible buffer length?
+              } else if (bytes < 3) {
+                // No, packet was too short for anything usable. Return error
+                rv.push_back(PACKET_LENGTH_ERROR);
               } else {
-                // No lead-out, must be data byte.
-                // Is it valid?
-                if (b < 0xF0) {
-                  // Yes. Add it into current buffer byte
-                  buffer[bufferPtr] <<= 4;
-                  buffer[bufferPtr] += (b & 0x0F);
-                  // Advance nibble
-                  byteComplete = !byteComplete;
-                  // Was it the second of the byte?
-                  if (byteComplete) {
-                    // Yes. Advance CRC and move buffer pointer by one
-                    crc += buffer[bufferPtr];
-                    bufferPtr++;
-                    buffer[bufferPtr] = 0;
-                  }
-                } else {
-                  // No, garbage. report error
-                  rv.push_back(ASCII_INVALID_CHAR);
-                  state = A_FINISHED;
+                mb_log_buf_v(buffer, bytes);
+                // Data plus its LRC must add up to 0
+                uint8_t lrc = 0;
+                for (int16_t i = 0; i < bytes; ++i) {
+                  lrc += buffer[i];
                 }
-              }
-              hadBytes = false;
-              break;
-            // A_WAIT_LEAD_OUT: await 
-            case A_WAIT_LEAD_OUT:
-              if (b == 0xF2) {
-                // Lead-out byte 2 received. Transfer buffer to returned message
-                mb_log_v("%c/", (const char)caller);
-                mb_log_buf_v(buffer, bufferPtr);
-                // Did we get a sensible buffer length?
-                if (bufferPtr >= 3)
-                {
-                  // Yes. Was the CRC calculated correctly?
-                  if (crc == 0) {
-                    // Yes, reduce buffer by 1 to get rid of CRC byte...
-                    bufferPtr--;
-                    // Move data into returned message
-                    for (uint16_t i = 0; i < bufferPtr; ++i) {
-                      rv.push_back(buffer[i]);
-                    }
-                  } else {
-                    // No, CRC calculation seems to have failed
-                    rv.push_back(ASCII_CRC_ERR);
-                  }
+                if (lrc == 0) {
+                  // Yes, move data into returned message, without the LRC
+                  rv.add(buffer, bytes - 1);
                 } else {
-                  // No, packet was too short for anything usable. Return error
-                  rv.push_back(PACKET_LENGTH_ERROR);
+                  // No, CRC calculation seems to have failed
+                  rv.push_back(ASCII_CRC_ERR);
                 }
-              } else {
-                // No lead out byte 2, but something else - report error.
-                rv.push_back(ASCII_FRAME_ERR);
               }
-              state = A_FINISHED;
-              break;
-            // A_FINISHED: Message completed
-            case A_FINISHED:
-              // Clean up serial buffer
-              while (serial.available()) serial.read();
-              break;
             }
+          } else {
+            // No lead out byte 2, but something else - report error.
+            rv.push_back(ASCII_FRAME_ERR);
           }
-        } else {
-          // No data received, so give the task scheduler room to breathe
-          delay(1);
+          state = A_FINISHED;
+          break;
+        default:
+          break;
         }
       }
     }
   }
-  // Deallocate buffer
-  delete[] buffer;
+  // Deallocate buffer, if it was ours
+  if (!rxBuffer) delete[] buffer;
 
   mb_log_d("%c/", (const char)caller);
   mb_log_buf_d(rv.data(), rv.size());
@@ -442,7 +502,7 @@ ModbusMessage RTUutils::receive(uint8_t caller, Stream& serial, uint32_t timeout
 }
 
 // Lower 7 bit ASCII characters - all invalid are set to 0xFF
-const char RTUutils::ASCIIread[] = { 
+const uint8_t RTUutils::ASCIIread[] = { 
   /* 00-07 */ 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 
   /* 08-0F */ 0xFF, 0xFF, 0xF2, 0xFF, 0xFF, 0xF1, 0xFF, 0xFF,  // LF + CR
   /* 10-17 */ 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 
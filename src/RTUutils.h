@@ -4,6 +4,7 @@
 // =================================================================================================
 #ifndef _RTU_UTILS_H
 #define _RTU_UTILS_H
+#include "options.h"
 #include <stdint.h>
 #if NEED_UART_PATCH
 #include <soc/uart_struct.h>
@@ -15,8 +16,19 @@
 
 typedef std::function<void(bool level)> RTScallback;
 
+// Size of a receive buffer - room for a maximum RTU frame or an ASCII frame decoded
+#define RTU_RXBUFSIZE 512
+
 using namespace Modbus;  // NOLINT
 
+// RTUtiming: measurements of a received RTU frame
+struct RTUtiming {
+  uint32_t gap;             // us of silence after the last byte until the frame end was detected
+  uint32_t charGap;         // longest pause in us between two bytes of the frame
+  uint16_t length;          // bytes received, including CRC
+  RTUtiming() : gap(0), charGap(0), length(0) {}
+};
+
 // RTUutils is bundling the send, receive and CRC functions for Modbus RTU communications.
 // RTU client will make use of it. 
 // All functions are static!
@@ -28,7 +40,7 @@ public:
   static uint16_t calcCRC(const uint8_t *data, uint16_t len);
 
 // calcCRC: calculate the CRC16 value for a given block of data
-  static uint16_t calcCRC(ModbusMessage msg);
+  static uint16_t calcCRC(const ModbusMessage& msg);
 
 // validCRC #1: check the CRC in a block of data for validity
   static bool validCRC(const uint8_t *data, uint16_t len);
@@ -37,39 +49,55 @@ public:
   static bool validCRC(const uint8_t *data, uint16_t len, uint16_t CRC);
 
 // validCRC #1: check the CRC in a message for validity
-  static bool validCRC(ModbusMessage msg);
+  static bool validCRC(const ModbusMessage& msg);
 
 // validCRC #2: check the CRC of a message against a given one
-  static bool validCRC(ModbusMessage msg, uint16_t CRC);
+  static bool validCRC(const ModbusMessage& msg, uint16_t CRC);
 
 // addCRC: extend a RTUMessage by a valid CRC
   static void addCRC(ModbusMessage& raw);
 
+// encodeASCII: write len bytes as 2*len upper case hex digits into target. Returns 2*len
+  static uint16_t encodeASCII(const uint8_t *data, uint16_t len, uint8_t *target);
+
+// decodeASCII: convert len hex digits into len/2 bytes, source and target may be the same.
+// Returns the number of bytes or -1 if an invalid character was found
+  static int16_t decodeASCII(const uint8_t *source, uint16_t len, uint8_t *target);
+
 // calculateInterval: determine the minimal gap time between messages
   static uint32_t calculateInterval(uint32_t baudRate);
 
 // RTSauto: dummy callback for auto half duplex RS485 boards
   inline static void RTSauto(bool level) { return; } // NOLINT
 
+#if HAS_FREERTOS
 // Necessary preparations for a HardwareSerial
 static void prepareHardwareSerial(HardwareSerial& s, uint16_t bufferSize = 260) {
   s.setRxBufferSize(bufferSize);
   s.setTxBufferSize(bufferSize);
 }
+#endif
 
 protected:
 // Printable characters for ASCII protocol: 012345678ABCDEF
   static const char ASCIIwrite[];
-  static const char ASCIIread[];
+  static const uint8_t ASCIIread[];
 
   RTUutils() = delete;
 
 // receive: get a Modbus message from serial, maintaining timeouts etc.
-  static ModbusMessage receive(uint8_t caller, Stream& serial, uint32_t timeout, unsigned long& lastMicros, uint32_t interval, bool ASCIImode, bool skipLeadingZeroBytes = false);
+// rxBuffer may point to a buffer of RTU_RXBUFSIZE bytes to be used, else one is allocated for each call.
+  static ModbusMessage receive(uint8_t caller, Stream& serial, uint32_t timeout, unsigned long& lastMicros, uint32_t interval, bool ASCIImode, bool skipLeadingZeroBytes = false, RTUtiming *timing = nullptr, uint8_t *rxBuffer = nullptr);
+
+// waitData: wait up to timeout microseconds for data on serial. Returns true if there is some
+  static bool waitData(Stream& serial, uint32_t timeout);
 
 // send: send a Modbus message in either format (ModbusMessage or data/len)
   static void send(Stream& serial, unsigned long& lastMicros, uint32_t interval, RTScallback r, const uint8_t *data, uint16_t len, bool ASCIImode);
-  static void send(Stream& serial, unsigned long& lastMicros, uint32_t interval, RTScallback r, ModbusMessage raw, bool ASCIImode);
+  static void send(Stream& serial, unsigned long& lastMicros, uint32_t interval, RTScallback r, ModbusMessage& raw, bool ASCIImode);
+
+// sendRTU: write a RTU frame, optionally followed by a separate tail (the CRC)
+  static void sendRTU(Stream& serial, unsigned long& lastMicros, uint32_t interval, RTScallback r, const uint8_t *data, uint16_t len, const uint8_t *tail, uint16_t tailLen);
 };
 
 #endif
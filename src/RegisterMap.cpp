@@ -0,0 +1,110 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "RegisterMap.h"
+#include "Logging.h"
+
+// Constructor - determine the number of registers spanned
+RegisterMap::RegisterMap(const Field *fields, uint16_t count) :
+  RM_fields(fields),
+  RM_count(count),
+  RM_words(0),
+  RM_changedCount(0),
+  RM_changed(count, false) {
+  for (uint16_t i = 0; i < count; ++i) {
+    const Field& f = fields[i];
+    uint16_t end = f.reg + ((f.type == RM_BITS || f.type == RM_FLAG) ? 1 : f.size / 2);
+    if (end > RM_words) RM_words = end;
+  }
+}
+
+// decode: fill target from a response
+Error RegisterMap::decode(const ModbusMessage& response, void *target, bool skipUnchanged) {
+  // Error responses have no data to decode
+  Error e = response.getError();
+  if (e != SUCCESS) return e;
+
+  // Only register read responses are understood
+  uint8_t fc = response.getFunctionCode();
+  if (fc != READ_HOLD_REGISTER && fc != READ_INPUT_REGISTER && fc != R_W_MULT_REGISTERS) {
+    mb_log_w("Register map cannot decode FC %02X", fc);
+    return FC_MISMATCH;
+  }
+
+  // Do all fields fit?
+  if (response.size() < 3 || response[2] < RM_words * 2 || response.size() < 3 + RM_words * 2) {
+    mb_log_w("Register map needs %d registers, response is too short", RM_words);
+    return PACKET_LENGTH_ERROR;
+  }
+
+  const uint8_t *data = response.data() + 3;
+  uint8_t *base = (uint8_t *)target;
+  // Can we compare to the previous data?
+  bool compare = skipUnchanged && RM_last.size() == RM_words * 2u;
+  RM_changedCount = 0;
+
+  for (uint16_t i = 0; i < RM_count; ++i) {
+    const Field& f = RM_fields[i];
+    uint16_t index = 3 + f.reg * 2;
+    uint8_t *dst = base + f.offset;
+    bool bits = (f.type == RM_BITS || f.type == RM_FLAG);
+
+    // Skip the field if its registers are unchanged
+    if (compare && !memcmp(data + f.reg * 2, RM_last.data() + f.reg * 2, bits ? 2 : f.size)) {
+      RM_changed[i] = false;
+      continue;
+    }
+    RM_changed[i] = true;
+    RM_changedCount++;
+
+    switch (f.type) {
+    case RM_UINT16:
+    case RM_INT16:
+      response.getRegisters(index, (uint16_t *)dst, 1, f.rule);
+      break;
+    case RM_UINT32:
+    case RM_INT32:
+      response.getRegisters(index, (uint32_t *)dst, 1, f.rule);
+      break;
+    case RM_FLOAT:
+      response.getRegisters(index, (float *)dst, 1, f.rule);
+      break;
+    case RM_DOUBLE:
+      response.getRegisters(index, (double *)dst, 1, f.rule);
+      break;
+    case RM_BITS:
+    case RM_FLAG:
+      {
+        uint16_t v = 0;
+        response.get(index, v);
+        v = (v >> f.rule) & ((1UL << f.width) - 1);
+        if (f.type == RM_FLAG) {
+          *(bool *)dst = (v != 0);
+        } else if (f.size == 1) {
+          *dst = v & 0xFF;
+        } else {
+          *(uint16_t *)dst = v;
+        }
+      }
+      break;
+    }
+  }
+
+  // Keep the data for the next comparison
+  RM_last.assign(data, data + RM_words * 2);
+  return SUCCESS;
+}
+
+// isChanged: field number index was written by the last decode()
+bool RegisterMap::isChanged(uint16_t index) const {
+  if (index < RM_count) return RM_changed[index];
+  return false;
+}
+
+// reset: forget the previous response
+void RegisterMap::reset() {
+  RM_last.clear();
+  RM_changedCount = 0;
+  RM_changed.assign(RM_count, false);
+}
@@ -0,0 +1,101 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _REGISTER_MAP_H
+#define _REGISTER_MAP_H
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "ModbusMessage.h"
+
+// RegisterMap: decode a register read response (FC 0x03, 0x04, 0x17) into a struct in one pass.
+// The layout is described by a table of fields, that will be built at compile time:
+//
+//   struct Meter { uint16_t status; int32_t power; float voltage; bool alarm; uint8_t mode; };
+//   const RegisterMap::Field meterFields[] = {
+//     RM_FIELD(Meter, status, 0, 0),               // register 0
+//     RM_FIELD(Meter, power, 1, SWAP_REGISTERS),   // registers 1 and 2, low word first
+//     RM_FIELD(Meter, voltage, 3, 0),              // registers 3 and 4
+//     RM_BITS(Meter, alarm, 0, 15, 1),             // bit 15 of register 0
+//     RM_BITS(Meter, mode, 0, 8, 3),               // bits 8..10 of register 0
+//   };
+//   RegisterMap meterMap(meterFields);
+//   ...
+//   Error e = meterMap.decode(response, &meter);
+//
+// Register numbers count from the first register requested. Registers not named in the map are
+// ignored, so a map may cover only the values of interest.
+class RegisterMap {
+public:
+  // Value types. The member types select them, see TypeOf below
+  enum Type : uint8_t {
+    RM_UINT16 = 0,
+    RM_INT16,
+    RM_UINT32,
+    RM_INT32,
+    RM_FLOAT,
+    RM_DOUBLE,
+    RM_BITS,         // bit group of a single register into a uint8_t or uint16_t
+    RM_FLAG,         // bit group of a single register into a bool
+  };
+
+  // Field: one value of the map. Use the RM_FIELD() and RM_BITS() macros to set it up
+  struct Field {
+    uint16_t reg;        // first register of the value
+    Type type;           // type of the value
+    uint8_t rule;        // RM_BITS, RM_FLAG: lowest bit, else SWAP_* rules as for ModbusMessage::get()
+    uint8_t width;       // RM_BITS, RM_FLAG: number of bits
+    uint8_t size;        // size of the target member
+    uint16_t offset;     // position of the target member in the struct
+  };
+
+  // TypeOf: the Type for a member type. Unsupported types will not compile
+  template <typename T> struct TypeOf;
+
+  // Constructor - takes the field table, that must live as long as the map
+  RegisterMap(const Field *fields, uint16_t count);
+  template <size_t N> explicit RegisterMap(const Field (&fields)[N]) : RegisterMap(fields, N) {}
+
+  // decode: fill target from a response. With skipUnchanged set, fields whose registers are
+  // the same as in the previous decode() are not written again. Returns SUCCESS or an error
+  Error decode(const ModbusMessage& response, void *target, bool skipUnchanged = false);
+
+  // words: number of registers the map spans, to be requested starting with register 0
+  inline uint16_t words() const { return RM_words; }
+
+  // changed: number of fields written by the last decode()
+  inline uint16_t changed() const { return RM_changedCount; }
+
+  // isChanged: field number index was written by the last decode()
+  bool isChanged(uint16_t index) const;
+
+  // reset: forget the previous response, the next decode() will write all fields
+  void reset();
+
+protected:
+  const Field *RM_fields;          // field table
+  uint16_t RM_count;               // number of fields
+  uint16_t RM_words;               // registers spanned
+  uint16_t RM_changedCount;        // fields written by last decode()
+  std::vector<bool> RM_changed;    // field written by last decode()
+  std::vector<uint8_t> RM_last;    // register data of the last decode()
+};
+
+template <> struct RegisterMap::TypeOf<uint16_t> { static constexpr Type value = RM_UINT16; };
+template <> struct RegisterMap::TypeOf<int16_t>  { static constexpr Type value = RM_INT16; };
+template <> struct RegisterMap::TypeOf<uint32_t> { static constexpr Type value = RM_UINT32; };
+template <> struct RegisterMap::TypeOf<int32_t>  { static constexpr Type value = RM_INT32; };
+template <> struct RegisterMap::TypeOf<float>    { static constexpr Type value = RM_FLOAT; };
+template <> struct RegisterMap::TypeOf<double>   { static constexpr Type value = RM_DOUBLE; };
+
+// RM_FIELD: value of struct S member, starting at register reg, with SWAP_* rules applied
+#define RM_FIELD(S, member, reg, swapRules) \
+  { reg, RegisterMap::TypeOf<decltype(S::member)>::value, swapRules, 0, sizeof(S::member), offsetof(S, member) }
+
+// RM_BITS: width bits of register reg, starting at bit lowBit, into struct S member
+#define RM_BITS(S, member, reg, lowBit, width) \
+  { reg, std::is_same<decltype(S::member), bool>::value ? RegisterMap::RM_FLAG : RegisterMap::RM_BITS, \
+    lowBit, width, sizeof(S::member), offsetof(S, member) }
+
+#endif
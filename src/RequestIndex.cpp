@@ -0,0 +1,98 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "RequestIndex.h"
+
+#if HAS_FREERTOS || IS_LINUX
+
+#include "Logging.h"
+
+// Constructor: all slots free
+RequestIndex::RequestIndex(uint32_t size) :
+  RI_size(size ? size : 1),
+  RI_next(0) {
+  RI_slots = new Slot[RI_size];
+  for (uint32_t i = 0; i < RI_size; ++i) {
+    RI_slots[i].state.store(FREE, std::memory_order_relaxed);
+    RI_slots[i].token.store(0, std::memory_order_relaxed);
+  }
+}
+
+RequestIndex::~RequestIndex() {
+  delete[] RI_slots;
+}
+
+// add: take a free slot for a request about to be queued
+RequestIndex::Ticket RequestIndex::add(uint32_t token) {
+  Ticket t;
+  // Start where the last one was found, the next slots are free most of the time
+  for (uint32_t n = 0; n < RI_size; ++n) {
+    uint32_t i = RI_next.fetch_add(1, std::memory_order_relaxed) % RI_size;
+    Slot& s = RI_slots[i];
+    uint32_t state = s.state.load(std::memory_order_relaxed);
+    if ((state & STATE_MASK) != FREE) continue;
+    uint32_t gen = (state & ~STATE_MASK) + GEN_STEP;
+    if (s.state.compare_exchange_strong(state, gen | PENDING, std::memory_order_acquire, std::memory_order_relaxed)) {
+      // cancel() does not look at the token before the slot is QUEUED
+      s.token.store(token, std::memory_order_relaxed);
+      t.slot = i;
+      t.gen = gen;
+      break;
+    }
+  }
+  return t;
+}
+
+// queued: the request made it into the queue
+void RequestIndex::queued(const Ticket& t) {
+  if (t.slot < 0) return;
+  // The worker may have claimed it already - then it stays free
+  uint32_t state = t.gen | PENDING;
+  RI_slots[t.slot].state.compare_exchange_strong(state, t.gen | QUEUED, std::memory_order_release, std::memory_order_relaxed);
+}
+
+// remove: the request did not make it into the queue
+void RequestIndex::remove(const Ticket& t) {
+  if (t.slot < 0) return;
+  RI_slots[t.slot].state.store(t.gen | FREE, std::memory_order_release);
+}
+
+// claim: the worker takes the request off the index. Returns false if it was cancelled
+bool RequestIndex::claim(const Ticket& t) {
+  if (t.slot < 0) return true;
+  Slot& s = RI_slots[t.slot];
+  uint32_t state = s.state.load(std::memory_order_acquire);
+  // Only a cancel() may change the state in between - then try again
+  while ((state & ~STATE_MASK) == t.gen && (state & STATE_MASK) != FREE) {
+    if (s.state.compare_exchange_weak(state, t.gen | FREE, std::memory_order_acq_rel, std::memory_order_acquire)) {
+      return (state & STATE_MASK) != CANCELLED;
+    }
+  }
+  return true;
+}
+
+// cancel: cancel all requests with token queued now. Returns their number
+uint32_t RequestIndex::cancel(uint32_t token) {
+  return cancel_if([token](uint32_t t) { return t == token; });
+}
+
+// cancel_if: cancel all requests queued now whose token fulfills predicate. Returns their number
+uint32_t RequestIndex::cancel_if(std::function<bool(uint32_t token)> predicate) {
+  uint32_t count = 0;
+  LOCK_GUARD(lg, RI_lock);
+  for (uint32_t i = 0; i < RI_size; ++i) {
+    Slot& s = RI_slots[i];
+    uint32_t state = s.state.load(std::memory_order_acquire);
+    if ((state & STATE_MASK) != QUEUED) continue;
+    if (!predicate(s.token.load(std::memory_order_relaxed))) continue;
+    // Fails if the worker claimed it meanwhile, or the slot went to another request
+    if (s.state.compare_exchange_strong(state, (state & ~STATE_MASK) | CANCELLED, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+      count++;
+    }
+  }
+  mb_log_d("Cancelled %u requests", count);
+  return count;
+}
+
+#endif  // HAS_FREERTOS || IS_LINUX
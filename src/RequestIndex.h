@@ -0,0 +1,86 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _REQUEST_INDEX_H
+#define _REQUEST_INDEX_H
+
+#include "options.h"
+
+#if HAS_FREERTOS || IS_LINUX
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#if USE_MUTEX
+#include <mutex>                    // NOLINT
+#endif
+
+// RequestIndex: the requests waiting in a client queue, by token, to cancel them.
+// The lock-free queue does not allow to take out entries in the middle, so each request
+// gets a slot in a fixed table with its token and state. The worker claims the slot before
+// working on the request and drops it if it was cancelled in the meantime.
+// Queueing and claiming are single atomic operations on the slot, only cancel() and
+// cancel_if() take a lock to walk the table. A request is counted only once it is in the
+// queue: cancel() can not count a request that does not make it in.
+// Each slot carries a generation number, so a slot given to the next request is not
+// mistaken for the one before.
+class RequestIndex {
+public:
+  // Constructor takes the number of slots - the most requests queued at the same time
+  explicit RequestIndex(uint32_t size);
+
+  ~RequestIndex();
+
+  // Ticket: slot and generation of a request
+  struct Ticket {
+    int32_t slot;               // -1: not indexed
+    uint32_t gen;
+    Ticket() : slot(-1), gen(0) {}
+  };
+
+  // add: a request with token is about to be queued. It is not counted before queued() is called.
+  // Returns a ticket with slot -1 if all slots are in use
+  Ticket add(uint32_t token);
+
+  // queued: the request made it into the queue, cancel() will count it from now on
+  void queued(const Ticket& t);
+
+  // remove: the request did not make it into the queue
+  void remove(const Ticket& t);
+
+  // claim: the worker takes the request off the index.
+  // Returns false if it was cancelled and has to be dropped
+  bool claim(const Ticket& t);
+
+  // cancel: cancel all requests with token queued now. Returns their number
+  uint32_t cancel(uint32_t token);
+
+  // cancel_if: cancel all requests queued now whose token fulfills predicate. Returns their number
+  uint32_t cancel_if(std::function<bool(uint32_t token)> predicate);
+
+protected:
+  // Slot states, in the lower bits of the state word. The upper bits are the generation
+  enum : uint32_t { FREE = 0, PENDING = 1, QUEUED = 2, CANCELLED = 3, STATE_MASK = 3, GEN_STEP = 4 };
+
+  // Slot: a request's token and state
+  struct Slot {
+    std::atomic<uint32_t> state;
+    std::atomic<uint32_t> token;
+  };
+
+  // No copies
+  RequestIndex(const RequestIndex&) = delete;
+  RequestIndex& operator=(const RequestIndex&) = delete;
+
+  Slot *RI_slots;                 // The table
+  uint32_t RI_size;               // Number of slots
+  std::atomic<uint32_t> RI_next;  // Slot to try next in add()
+#if USE_MUTEX
+  std::mutex RI_lock;             // Serializes cancel() and cancel_if()
+#endif
+};
+
+#endif  // HAS_FREERTOS || IS_LINUX
+
+#endif  // INCLUDE GUARD
@@ -0,0 +1,142 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _REQUEST_QUEUE_H
+#define _REQUEST_QUEUE_H
+
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <cinttypes>
+#include <utility>
+#include <vector>
+
+// RequestQueue: bounded, lock-free multi-producer/single-consumer FIFO of preallocated slots.
+// Any number of threads may push(), only the worker may use front(), pop(), take() and release().
+// An entry is counted against the limit from push() until it is released - by pop(), or by
+// release() after take(), when the consumer still holds it elsewhere (a request in flight).
+template <typename T>
+class RequestQueue {
+public:
+  explicit RequestQueue(uint32_t limit) :
+    limit(limit),
+    count(0),
+    head(0),
+    tail(0) {
+    // Ring size is the next power of 2 to hold limit entries
+    capacity = 1;
+    while (capacity < limit) capacity <<= 1;
+    mask = capacity - 1;
+    cells = new Cell[capacity];
+    for (uint32_t i = 0; i < capacity; ++i) {
+      // Slot i is free for position i
+      cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  ~RequestQueue() {
+    while (front()) pop();
+    delete[] cells;
+  }
+
+  // push: add entry, moved in if given as an rvalue. Returns false if the limit is reached
+  template <typename U>
+  bool push(U&& entry) {
+    // Reserve a place - if there is one left
+    uint32_t c = count.load(std::memory_order_relaxed);
+    do {
+      if (c >= limit) return false;
+    } while (!count.compare_exchange_weak(c, c + 1, std::memory_order_acquire, std::memory_order_relaxed));
+    // Claim the next position. The reservation guarantees its slot has been freed
+    uint32_t pos = tail.fetch_add(1, std::memory_order_relaxed);
+    Cell& cell = cells[pos & mask];
+    new (&cell.data) T(std::forward<U>(entry));
+    // Publish it to the consumer
+    cell.seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // front: oldest entry, nullptr if there is none (yet)
+  T *front() {
+    Cell& cell = cells[head & mask];
+    if (cell.seq.load(std::memory_order_acquire) != head + 1) return nullptr;
+    return reinterpret_cast<T *>(&cell.data);
+  }
+
+  // take: remove the front entry, but keep it counted until release() is called
+  void take() {
+    Cell& cell = cells[head & mask];
+    reinterpret_cast<T *>(&cell.data)->~T();
+    // Slot is free for the position one round later
+    cell.seq.store(head + capacity, std::memory_order_release);
+    head++;
+  }
+
+  // release: stop counting an entry removed by take()
+  void release() {
+    count.fetch_sub(1, std::memory_order_release);
+  }
+
+  // pop: remove the front entry
+  void pop() {
+    take();
+    release();
+  }
+
+  // Number of entries pushed and not released yet
+  uint32_t size() const { return count.load(std::memory_order_relaxed); }
+
+  // Is there anything left for the consumer?
+  bool empty() { return front() == nullptr; }
+
+protected:
+  struct Cell {
+    std::atomic<uint32_t> seq;    // position + 1 if filled, position if free
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type data;
+  };
+
+  // No copies
+  RequestQueue(const RequestQueue&) = delete;
+  RequestQueue& operator=(const RequestQueue&) = delete;
+
+  Cell *cells;                    // The ring
+  uint32_t capacity;              // Number of cells, power of 2
+  uint32_t mask;                  // capacity - 1
+  uint32_t limit;                 // Maximum number of entries counted
+  std::atomic<uint32_t> count;    // Entries counted
+  uint32_t head;                  // Next position to consume - consumer only
+  std::atomic<uint32_t> tail;     // Next position to fill
+};
+
+// Helpers for consumers taking the entries out of the queue to pick the next one themselves.
+// Entries need priority, hasDeadline and expires members.
+
+// topPriority: highest priority of all entries
+template <typename T>
+uint8_t topPriority(const std::vector<T>& entries) {
+  uint8_t top = 0;
+  for (auto& e : entries) {
+    if (e.priority > top) top = e.priority;
+  }
+  return top;
+}
+
+// earliestDeadline: index of the entry with the given priority and the earliest deadline.
+// Entries without a deadline follow those having one, in queue order.
+template <typename T>
+size_t earliestDeadline(const std::vector<T>& entries, uint8_t priority) {
+  size_t pick = entries.size();
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const T& e = entries[i];
+    if (e.priority != priority) continue;
+    if (pick == entries.size()) {
+      pick = i;
+    } else if (e.hasDeadline && (!entries[pick].hasDeadline || (int32_t)(e.expires - entries[pick].expires) < 0)) {
+      pick = i;
+    }
+  }
+  return pick;
+}
+
+#endif  // _REQUEST_QUEUE_H
@@ -0,0 +1,149 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ServerHealth.h"
+
+#if HAS_FREERTOS || IS_LINUX
+
+#include "Logging.h"
+
+// Constructor: fixed timeouts, no quarantine
+ServerHealth::ServerHealth() :
+  SH_adaptive(false),
+  SH_minTimeout(20),
+  SH_failures(0),
+  SH_probeInterval(1000),
+  SH_maxInterval(60000) { }
+
+// setAdaptive: use learned timeouts (true) or the client's fixed one (false)
+void ServerHealth::setAdaptive(bool onOff, uint32_t minTimeout) {
+  LOCK_GUARD(lg, SH_lock);
+  SH_adaptive = onOff;
+  SH_minTimeout = minTimeout;
+}
+
+// setQuarantine: quarantine a server after failures timeouts in a row (0: never)
+void ServerHealth::setQuarantine(uint8_t failures, uint32_t probeInterval, uint32_t maxInterval) {
+  LOCK_GUARD(lg, SH_lock);
+  SH_failures = failures;
+  SH_probeInterval = probeInterval;
+  SH_maxInterval = maxInterval < probeInterval ? probeInterval : maxInterval;
+  // Without quarantine, nobody is in there any more
+  if (!failures) {
+    for (auto& s : SH_servers) {
+      s.second.stats.quarantined = false;
+      s.second.probing = false;
+    }
+  }
+}
+
+// admit: may a request be sent to the server now?
+bool ServerHealth::admit(uint64_t key) {
+  LOCK_GUARD(lg, SH_lock);
+  auto it = SH_servers.find(key);
+  if (it == SH_servers.end() || !it->second.stats.quarantined) return true;
+  Server& s = it->second;
+  // A probe is allowed if none is on its way and its time has come
+  if (!s.probing && (long)(millis() - s.probeAt) >= 0) {
+    s.probing = true;
+    mb_log_d("Probing quarantined server %08X%08X", (uint32_t)(key >> 32), (uint32_t)key);
+    return true;
+  }
+  s.stats.refused++;
+  return false;
+}
+
+// calcTimeout: smoothed response time plus 4 times the deviation, doubled for each timeout in a row
+uint32_t ServerHealth::calcTimeout(const Server& s, uint32_t maxTimeout) {
+  if (!SH_adaptive || !s.stats.responses) return maxTimeout;
+  uint64_t t = ((uint64_t)s.stats.responseTime + 4 * (uint64_t)s.stats.deviation + 999) / 1000;
+  if (t < SH_minTimeout) t = SH_minTimeout;
+  t <<= (s.stats.failures < 16 ? s.stats.failures : 16);
+  return t < maxTimeout ? t : maxTimeout;
+}
+
+// timeout: time in ms to wait for the server's response
+uint32_t ServerHealth::timeout(uint64_t key, uint32_t maxTimeout) {
+  LOCK_GUARD(lg, SH_lock);
+  auto it = SH_servers.find(key);
+  if (it == SH_servers.end()) return maxTimeout;
+  return calcTimeout(it->second, maxTimeout);
+}
+
+// responseTime: smoothed response time in us, 0 if the server never answered
+uint32_t ServerHealth::responseTime(uint64_t key) {
+  LOCK_GUARD(lg, SH_lock);
+  auto it = SH_servers.find(key);
+  if (it == SH_servers.end()) return 0;
+  return it->second.stats.responseTime;
+}
+
+// success: the server answered after us microseconds
+void ServerHealth::success(uint64_t key, uint32_t us) {
+  LOCK_GUARD(lg, SH_lock);
+  Server& s = SH_servers[key];
+  Stats& st = s.stats;
+  if (!st.responses) {
+    // First sample: deviation is half of it
+    st.responseTime = us;
+    st.deviation = us / 2;
+  } else {
+    // deviation = 3/4 deviation + 1/4 |difference|, responseTime = 7/8 responseTime + 1/8 sample
+    uint32_t diff = us > st.responseTime ? us - st.responseTime : st.responseTime - us;
+    st.deviation = ((uint64_t)st.deviation * 3 + diff) / 4;
+    st.responseTime = ((uint64_t)st.responseTime * 7 + us) / 8;
+  }
+  st.responses++;
+  st.failures = 0;
+  // Any answer ends the quarantine
+  if (st.quarantined) {
+    mb_log_d("Server %08X%08X back from quarantine", (uint32_t)(key >> 32), (uint32_t)key);
+    st.quarantined = false;
+    s.probing = false;
+  }
+}
+
+// failure: the server did not answer in time
+void ServerHealth::failure(uint64_t key) {
+  LOCK_GUARD(lg, SH_lock);
+  Server& s = SH_servers[key];
+  Stats& st = s.stats;
+  st.failures++;
+  if (st.quarantined) {
+    // Probe failed. Wait twice as long for the next one
+    s.probing = false;
+    s.probeInterval = (s.probeInterval < SH_maxInterval / 2) ? s.probeInterval * 2 : SH_maxInterval;
+    s.probeAt = millis() + s.probeInterval;
+  } else if (SH_failures && st.failures >= SH_failures) {
+    // Too many timeouts - quarantine it
+    st.quarantined = true;
+    st.quarantines++;
+    s.probing = false;
+    s.probeInterval = SH_probeInterval;
+    s.probeAt = millis() + s.probeInterval;
+    mb_log_w("Server %08X%08X quarantined after %u timeouts", (uint32_t)(key >> 32), (uint32_t)key, st.failures);
+  }
+}
+
+// getStats: learned data of a server
+ServerHealth::Stats ServerHealth::getStats(uint64_t key, uint32_t maxTimeout) {
+  LOCK_GUARD(lg, SH_lock);
+  auto it = SH_servers.find(key);
+  if (it == SH_servers.end()) {
+    Stats st;
+    st.timeout = maxTimeout;
+    return st;
+  }
+  Stats st = it->second.stats;
+  st.timeout = calcTimeout(it->second, maxTimeout);
+  return st;
+}
+
+// reset: forget all servers
+void ServerHealth::reset() {
+  LOCK_GUARD(lg, SH_lock);
+  SH_servers.clear();
+}
+
+#endif  // HAS_FREERTOS || IS_LINUX
@@ -0,0 +1,99 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _SERVER_HEALTH_H
+#define _SERVER_HEALTH_H
+
+#include "options.h"
+
+#if HAS_FREERTOS || IS_LINUX
+
+#include <stdint.h>
+#include <map>
+#if USE_MUTEX
+#include <mutex>                    // NOLINT
+#endif
+
+// ServerHealth: learns the response time of each server and keeps track of servers not answering.
+// The clients identify a server by a key of their own - the server ID for RTU, target and
+// server ID for TCP.
+// Timeouts are derived like TCP retransmission timeouts (RFC 6298): the smoothed response
+// time plus four times its mean deviation, doubled for each timeout in a row. They never
+// exceed the timeout set for the client, and never fall below a minimum.
+// A server that failed to answer a number of times in a row is quarantined: requests to it
+// are refused right away, except for a single probe request now and then. The time between
+// probes doubles with each failed probe. The first answer ends the quarantine.
+class ServerHealth {
+public:
+  ServerHealth();
+
+  // setAdaptive: use learned timeouts (true) or the client's fixed one (false)
+  void setAdaptive(bool onOff, uint32_t minTimeout);
+
+  // setQuarantine: quarantine a server after failures timeouts in a row (0: never).
+  // It is probed after probeInterval ms, the interval doubling up to maxInterval ms.
+  void setQuarantine(uint8_t failures, uint32_t probeInterval, uint32_t maxInterval);
+
+  // Learned data of a server
+  struct Stats {
+    uint32_t responseTime;      // smoothed response time in us
+    uint32_t deviation;         // mean deviation of the response time in us
+    uint32_t timeout;           // timeout in ms used for the next request
+    uint32_t responses;         // responses received
+    uint32_t failures;          // timeouts in a row
+    uint32_t quarantines;       // number of times the server was quarantined
+    uint32_t refused;           // requests refused during quarantine
+    bool quarantined;           // server is in quarantine now
+    Stats() : responseTime(0), deviation(0), timeout(0), responses(0), failures(0),
+      quarantines(0), refused(0), quarantined(false) {}
+  };
+
+  // admit: may a request be sent to the server now? false if it is quarantined and no probe is due
+  bool admit(uint64_t key);
+
+  // timeout: time in ms to wait for the server's response. maxTimeout is the client's fixed timeout
+  uint32_t timeout(uint64_t key, uint32_t maxTimeout);
+
+  // responseTime: smoothed response time in us, 0 if the server never answered
+  uint32_t responseTime(uint64_t key);
+
+  // success: the server answered after us microseconds
+  void success(uint64_t key, uint32_t us);
+
+  // failure: the server did not answer in time
+  void failure(uint64_t key);
+
+  // getStats: learned data of a server
+  Stats getStats(uint64_t key, uint32_t maxTimeout);
+
+  // reset: forget all servers
+  void reset();
+
+protected:
+  // Server: learned data and quarantine state of a server
+  struct Server {
+    Stats stats;
+    uint32_t probeInterval;     // ms from the last failed probe to the next
+    unsigned long probeAt;      // millis() the next probe is due
+    bool probing;               // a probe request is on its way
+    Server() : probeInterval(0), probeAt(0), probing(false) {}
+  };
+
+  // calcTimeout: timeout in ms for a server. Needs SH_lock held
+  uint32_t calcTimeout(const Server& s, uint32_t maxTimeout);
+
+  std::map<uint64_t, Server> SH_servers; // servers seen so far
+  bool SH_adaptive;               // use learned timeouts
+  uint32_t SH_minTimeout;         // lower limit for learned timeouts in ms
+  uint8_t SH_failures;            // timeouts in a row to quarantine a server, 0: never
+  uint32_t SH_probeInterval;      // first time in ms until a quarantined server is probed
+  uint32_t SH_maxInterval;        // longest time in ms between two probes
+#if USE_MUTEX
+  std::mutex SH_lock;             // Protects SH_servers
+#endif
+};
+
+#endif  // HAS_FREERTOS || IS_LINUX
+
+#endif  // INCLUDE GUARD
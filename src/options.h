@@ -38,11 +38,20 @@ const unsigned int CLIENT_TASK_STACK = 4096;
 #include <wiringPi.h>
 #else
 #include <chrono>  // NOLINT
-// Use nanosleep() to avoid problems with pthreads (std::this_thread::sleep_for would interfere!)
-#define delay(x)  nanosleep((const struct timespec[]){{x/1000, (x%1000)*1000000L}}, NULL);
 typedef std::chrono::steady_clock clk;
 #define millis() std::chrono::duration_cast<std::chrono::milliseconds>(clk::now().time_since_epoch()).count()
 #define micros() std::chrono::duration_cast<std::chrono::microseconds>(clk::now().time_since_epoch()).count()
+// Use nanosleep() to avoid problems with pthreads (std::this_thread::sleep_for would interfere!)
+inline void delay(uint32_t ms) {
+  struct timespec ts = { (time_t)(ms / 1000), (long)(ms % 1000) * 1000000L };
+  nanosleep(&ts, NULL);
+}
+inline void delayMicroseconds(uint32_t us) {
+  struct timespec ts = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000L };
+  nanosleep(&ts, NULL);
+}
+#define LOW 0
+#define HIGH 1
 #endif
 
 /* === INVALID TARGET === */